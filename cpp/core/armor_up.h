@@ -1,8 +1,14 @@
 #ifndef _MONSTER_AVENGERS_ARMOR_UP_
 #define _MONSTER_AVENGERS_ARMOR_UP_
 
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <cstdlib>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
@@ -10,256 +16,330 @@
 #include "supp/timer.h"
 #include "utils/query.h"
 #include "utils/signature.h"
+#include "utils/signature_table.h"
 #include "utils/jewels_query.h"
+#include "utils/hole_client_cache.h"
 #include "utils/formatter.h"
 #include "utils/output_specs.h"
+#include "utils/worker_pool.h"
 #include "or_and_tree.h"
 #include "iterator.h"
 #include "explore.h"
+#include "parallel.h"
 
 namespace monster_avengers {
 
   const int FOUNDATION_NUM = 2;
 
-  class ListIterator : public TreeIterator {
+  template <typename Key>
+  class ListIterator : public BasicTreeIterator<Key> {
   public:
-    explicit ListIterator(const std::vector<TreeRoot> &&input) 
-      : forest_(input), current_(0) {}
+    explicit ListIterator(std::vector<BasicTreeRoot<Key> > &&input) 
+      : forest_(std::move(input)), current_(0) {}
     
-    inline void operator++() override {
-      if (current_ < forest_.size()) current_++;
-    }
-
-    inline const TreeRoot &operator*() const override {
-      return forest_[current_];
-    }
-    
-    inline bool empty() const override {
-      return current_ >= forest_.size();
+    size_t NextBatch(BasicTreeRoot<Key> *roots, size_t size) override {
+      size_t count = 0;
+      for (; count < size && current_ < forest_.size(); ++count) {
+        roots[count] = forest_[current_++];
+      }
+      return count;
     }
-
-    inline void Reset() override {}
     
   private:
-    std::vector<TreeRoot> forest_;
+    std::vector<BasicTreeRoot<Key> > forest_;
     size_t current_;
   };
 
-  class JewelFilterIterator : public TreeIterator {
+  template <typename Key>
+  class JewelFilterIterator : public BasicTreeIterator<Key> {
   public:
-    explicit JewelFilterIterator(TreeIterator *base_iter,
-                                 const DataSet &data,
-                                 const NodePool *pool,
+    explicit JewelFilterIterator(BasicTreeIterator<Key> *base_iter,
+                                 BasicNodePool<Key> *pool,
+                                 std::shared_ptr<BasicHoleClient<Key> > 
+                                 hole_client,
                                  int effect_id,
                                  const std::vector<Effect> &effects)
       : base_iter_(base_iter), 
         pool_(pool),
-        hole_client_(data, {effects[effect_id].skill_id}, effects),
-        current_(0),
-        inverse_points_(sig::InverseKey(effects.begin(),
-                                        effects.begin() + effect_id + 1)) {
-      Proceed();
-    }
-
-    inline void operator++() override {
-      if (!base_iter_->empty()) {
-        ++(*base_iter_);
-        Proceed();
+        hole_client_(hole_client),
+        inverse_points_(sig::InverseKey<Key>(effects.begin(),
+                                             effects.begin() + 
+                                             effect_id + 1)) {}
+
+    // The roots of the base are read straight into roots and filtered
+    // in place, with the ones kept packed to the front.
+    size_t NextBatch(BasicTreeRoot<Key> *roots, size_t size) override {
+      size_t count = 0;
+      while (count < size) {
+        size_t wanted = size - count;
+        size_t read = base_iter_->NextBatch(roots + count, wanted);
+        size_t end = count + read;
+        for (size_t i = count; i < end; ++i) {
+          if (Filter(roots[i], &roots[i])) {
+            std::swap(roots[count], roots[i]);
+            count++;
+          }
+        }
+        if (read < wanted) break;
       }
+      return count;
     }
 
-    inline const TreeRoot &operator*() const override {
-      return current_;
-    }
-
-    inline bool empty() const override {
-      return base_iter_->empty();
-    }
-
-    inline void Reset() override {}
-
   private:
-    inline void Proceed() {
-      current_.jewel_keys.clear();
-      while (!base_iter_->empty()) {
-        const TreeRoot &root = **base_iter_;
-        current_.id = root.id;
-        current_.torso_multiplier = root.torso_multiplier;
-        const Signature &key = pool_->Or(current_.id).key;
-        if (root.jewel_keys.empty()) {
-          const std::unordered_set<Signature> &jewel_keys = 
-            hole_client_.Query(key);
-          for (const Signature &jewel_key : jewel_keys) {
-            if (sig::Satisfy(key | jewel_key, inverse_points_)) {
-              current_.jewel_keys.push_back(jewel_key);
-            }
-          }
-        } else {
-          int one(0), two(0), three(0), extra(0);
-          for (const Signature &existing_key : root.jewel_keys) {
-            hole_client_.GetResidual(key, existing_key,
-                                     &one, &two, &three, &extra);
-            Signature key0 = key | existing_key;
-            for (const Signature &jewel_key : 
-                   hole_client_.Query(one, two, 
-                                      three, extra,
-                                      root.torso_multiplier)) {
-              if (sig::Satisfy(key0 | jewel_key, inverse_points_)) {
-                current_.jewel_keys.push_back(existing_key + jewel_key);
-              }
-            }
-          }
-        }
-        if (current_.jewel_keys.empty()) {
-          ++(*base_iter_);
-        } else {
-          return;
+    // Writes root with the jewel keys that complete the effects so far
+    // to output, which may be root itself, and returns false if there
+    // are none. The keys are added to the arena of the pool as a new
+    // list.
+    inline bool Filter(const BasicTreeRoot<Key> &root, 
+                       BasicTreeRoot<Key> *output) {
+      BasicKeyArena<Key> *arena = pool_->jewel_keys();
+      const Key key = pool_->Or(root.id).key;
+      arena->Open();
+      if (root.jewel_keys.empty()) {
+        const std::vector<Key> &jewel_keys = 
+          hole_client_->Query(key);
+        sig::SatisfyBatch(key, jewel_keys, inverse_points_, &survivors_);
+        kernel::ForEachSurvivor(survivors_, [arena, &jewel_keys](int i) {
+            arena->Add(jewel_keys[i]);
+          });
+      } else {
+        int one(0), two(0), three(0), extra(0);
+        // The keys of root are in the same arena, which may move them
+        // as keys are added.
+        for (int j = 0; j < root.jewel_keys.size(); ++j) {
+          const Key existing_key = root.jewel_keys[j];
+          hole_client_->GetResidual(key, existing_key,
+                                   &one, &two, &three, &extra);
+          Key key0 = key | existing_key;
+          const std::vector<Key> &jewel_keys = 
+            hole_client_->Query(one, two, three, extra,
+                                root.torso_multiplier);
+          sig::SatisfyBatch(key0, jewel_keys, inverse_points_, 
+                            &survivors_);
+          kernel::ForEachSurvivor(survivors_, 
+                                  [arena, &jewel_keys, 
+                                   &existing_key](int i) {
+            arena->Add(existing_key + jewel_keys[i]);
+          });
         }
       }
+      output->id = root.id;
+      output->torso_multiplier = root.torso_multiplier;
+      output->jewel_keys = arena->Close();
+      return !output->jewel_keys.empty();
     }
     
-    TreeIterator *base_iter_;
-    const NodePool *pool_;
-    HoleClient hole_client_;
-    TreeRoot current_;
-    Signature inverse_points_;
+    BasicTreeIterator<Key> *base_iter_;
+    BasicNodePool<Key> *pool_;
+    std::shared_ptr<BasicHoleClient<Key> > hole_client_;
+    Key inverse_points_;
+    std::vector<uint64_t> survivors_;
   };
 
-  class SkillSplitIterator : public TreeIterator {
+  // Splits the trees by the skills of effects [effect_id, effect_id +
+  // skills), and completes them with the jewels of those skills.
+  template <typename Key>
+  class SkillSplitIterator : public BasicTreeIterator<Key> {
   public:
-    SkillSplitIterator(TreeIterator *base_iter, 
+    typedef SplitScratch::Points Points;
+    
+    SkillSplitIterator(BasicTreeIterator<Key> *base_iter, 
                        const DataSet &data,
-                       NodePool *pool,
+                       BasicNodePool<Key> *pool,
+                       std::shared_ptr<BasicHoleClient<Key> > hole_client,
+                       SplitScratch *scratch,
                        int effect_id,
+                       int skills,
                        const Query &query)
       : base_iter_(base_iter), pool_(pool), 
-        splitter_(data, pool, effect_id, 
-                  query.effects[effect_id].skill_id),
-        hole_client_(data, query.effects[effect_id].skill_id, query.effects),
+        splitter_(data, pool, query.effects, effect_id, skills, scratch),
+        hole_client_(hole_client),
         effect_id_(effect_id),
-        required_points_(query.effects[effect_id].points),
-      inverse_points_(sig::InverseKey(query.effects.begin(), 
-                                      query.effects.begin() + effect_id + 1)) {
-      Proceed();
-    }
-
-    inline void operator++() override {
-      buffer_.pop_back();
-      if (buffer_.empty()) {
-        ++(*base_iter_);
-        Proceed();
+        skills_(skills),
+        required_points_(),
+      inverse_points_(sig::InverseKey<Key>(query.effects.begin(), 
+                                           query.effects.begin() + 
+                                           effect_id + skills)),
+        inputs_(), input_size_(0), input_(0), input_done_(false),
+        candidates_(), buffer_(), pending_(0), survivors_() {
+      for (int k = 0; k < skills_; ++k) {
+        required_points_[k] = query.effects[effect_id + k].points;
       }
+      pool_->set_splitter(effect_id_, &splitter_);
     }
 
-    inline const TreeRoot &operator*() const override {
-      return buffer_.back();
+    ~SkillSplitIterator() {
+      pool_->set_splitter(effect_id_, nullptr);
     }
 
-    inline bool empty() const override {
-      return buffer_.empty();
+    // Most roots have a split or more, so the roots of the base are
+    // read in batches of at most as many as the splits asked for.
+    size_t NextBatch(BasicTreeRoot<Key> *roots, size_t size) override {
+      size_t count = 0;
+      while (count < size) {
+        if (0 < pending_) {
+          std::swap(roots[count++], buffer_[--pending_]);
+        } else if (pool_->OverBudget()) {
+          // The splits would only add to the nodes.
+          break;
+        } else if (input_ < input_size_) {
+          Split(inputs_[input_++]);
+        } else if (!input_done_) {
+          size_t wanted = size - count;
+          if (inputs_.size() < wanted) {
+            inputs_.resize(wanted, BasicTreeRoot<Key>(-1));
+          }
+          input_size_ = base_iter_->NextBatch(inputs_.data(), wanted);
+          input_ = 0;
+          input_done_ = input_size_ < wanted;
+        } else {
+          break;
+        }
+      }
+      return count;
     }
-
-    inline void Reset() override {}
     
   private:
-    inline void Proceed() {
-      while (!base_iter_->empty()) {
-        const TreeRoot root = **base_iter_;
-        const OR &node = pool_->Or(root.id);
-        int one(0), two(0), three(0), body_holes(0);
-
-        int sub_max = splitter_.Max(root);
-        int sub_min = 1000;
-        Signature key0 = sig::AddPoints(node.key, effect_id_, sub_max);
-        std::vector<Signature> jewel_candidates;
-
-        for (const Signature &jewel_key : root.jewel_keys) {
-          HoleClient::GetResidual(node.key, jewel_key,
-                                  &one, &two, &three, &body_holes);
-          for (const Signature &new_key : 
-                 hole_client_.Query(one, two, three, 
-                                    body_holes, root.torso_multiplier)) {
-            Signature key1 = jewel_key + new_key;
-            if (sig::Satisfy(key0 | key1, inverse_points_)) {
-              jewel_candidates.push_back(key1);
-              int diff = required_points_ - sig::GetPoints(key1, effect_id_);
-              if (diff < sub_min) {
-                sub_min = diff;
+    // Leaves the splits of root that some jewel keys complete in
+    // buffer_[0, pending_), to go out from the last. The jewel keys of
+    // the splits are added to the arena of the pool, and the splits
+    // that every candidate completes share one list.
+    inline void Split(const BasicTreeRoot<Key> &root) {
+      int one(0), two(0), three(0), body_holes(0);
+
+      typename BasicSkillSplitter<Key>::Range bounds = 
+        splitter_.Bounds(root);
+      if (pool_->OverBudget()) return;
+      const Key root_key = pool_->Or(root.id).key;
+      Points sub_min;
+      sub_min.fill(1000);
+      Key key0 = root_key;
+      for (int k = 0; k < skills_; ++k) {
+        key0 = sig::AddPoints(key0, effect_id_ + k, bounds.max[k]);
+      }
+      std::vector<Key> &jewel_candidates = candidates_;
+      jewel_candidates.clear();
+
+      for (const Key &jewel_key : root.jewel_keys) {
+        BasicHoleClient<Key>::GetResidual(root_key, jewel_key,
+                                          &one, &two, &three, &body_holes);
+        const std::vector<Key> &new_keys = 
+          hole_client_->Query(one, two, three, 
+                              body_holes, root.torso_multiplier);
+        // key0 | (jewel_key + new_key) == (key0 + jewel_key) | new_key
+        sig::SatisfyBatch(key0 + jewel_key, new_keys, inverse_points_,
+                          &survivors_);
+        kernel::ForEachSurvivor(survivors_, [&](int i) {
+            Key key1 = jewel_key + new_keys[i];
+            jewel_candidates.push_back(key1);
+            for (int k = 0; k < skills_; ++k) {
+              int diff = required_points_[k] - 
+                sig::GetPoints(key1, effect_id_ + k);
+              if (diff < sub_min[k]) {
+                sub_min[k] = diff;
               }
             }
-          }
-        }
-        if (!jewel_candidates.empty()) {
-          std::vector<int> new_ors = splitter_.Split(root, sub_min);
-          for (int or_id : new_ors) {
-            buffer_.emplace_back(or_id, pool_->Or(or_id));
-            const OR &or_node = pool_->Or(or_id);
-            for (const Signature &jewel_key : jewel_candidates) {
-              if (sig::Satisfy(jewel_key | or_node.key, inverse_points_)) {
-                buffer_.back().jewel_keys.push_back(jewel_key);
-              }
+          });
+      }
+      // If there is no valid jewel signatures, we can proceed to the
+      // next tree in the forest.
+      if (jewel_candidates.empty()) return;
+
+      // With one skill, the candidate that needs the fewest points
+      // completes every split of at least sub_min. With more, the
+      // fewest points of each skill may come from different
+      // candidates.
+      const std::vector<int> &new_ors = 
+        splitter_.Split(root, sub_min, [&](const Key &key) {
+            if (1 == skills_) return true;
+            sig::SatisfyBatch(key, jewel_candidates, inverse_points_,
+                              &survivors_);
+            for (uint64_t word : survivors_) {
+              if (0 != word) return true;
             }
+            return false;
+          });
+      BasicKeyArena<Key> *arena = pool_->jewel_keys();
+      BasicKeyList<Key> shared;
+      for (int or_id : new_ors) {
+        if (buffer_.size() == pending_) buffer_.emplace_back(or_id);
+        BasicTreeRoot<Key> &split = buffer_[pending_++];
+        const BasicOR<Key> &or_node = pool_->Or(or_id);
+        split.id = or_id;
+        split.torso_multiplier = or_node.key.multiplier();
+        sig::SatisfyBatch(or_node.key, jewel_candidates, inverse_points_,
+                          &survivors_);
+        arena->Open();
+        kernel::ForEachSurvivor(survivors_, [&](int i) {
+            arena->Add(jewel_candidates[i]);
+          });
+        split.jewel_keys = arena->Close();
+        if (split.jewel_keys.size() == jewel_candidates.size()) {
+          if (shared.empty()) {
+            shared = split.jewel_keys;
+          } else {
+            arena->Truncate(split.jewel_keys.offset());
+            split.jewel_keys = shared;
           }
-          break;
         }
-
-        // If there is no valid jewel signatures, we can proceed to
-        // the next tree in the forest.
-        ++(*base_iter_);
       }
     }
       
-    TreeIterator *base_iter_;
-    NodePool *pool_;
-    SkillSplitter splitter_;
-    HoleClient hole_client_;
+    BasicTreeIterator<Key> *base_iter_;
+    BasicNodePool<Key> *pool_;
+    BasicSkillSplitter<Key> splitter_;
+    std::shared_ptr<BasicHoleClient<Key> > hole_client_;
     int effect_id_;
-    int required_points_;
-    Signature inverse_points_;
-    std::vector<TreeRoot> buffer_;
+    int skills_;
+    Points required_points_;
+    Key inverse_points_;
+    // The roots read from the base, of which [input_, input_size_) are
+    // not split yet.
+    std::vector<BasicTreeRoot<Key> > inputs_;
+    size_t input_size_;
+    size_t input_;
+    bool input_done_;
+    // Reused across roots.
+    std::vector<Key> candidates_;
+    std::vector<BasicTreeRoot<Key> > buffer_;
+    size_t pending_;
+    std::vector<uint64_t> survivors_;
   };
 
-  class DefenseFilterIterator : public ArmorSetIterator {
+  template <typename Key>
+  class DefenseFilterIterator : public BasicArmorSetIterator<Key> {
   public:
-    DefenseFilterIterator(ArmorSetIterator *base_iter,
+    DefenseFilterIterator(BasicArmorSetIterator<Key> *base_iter,
 			  const DataSet *data,
 			  int min_defense)
-      : base_iter_(base_iter), data_(data), min_defense_(min_defense) {
-      Proceed();
-    }
-
-    void operator++() override {
-      ++(*base_iter_);
-      Proceed();
-    }
-    
-    const ArmorSet &operator*() const override {
-      return **base_iter_;
-    }
-
-    bool empty() const override {
-      return base_iter_->empty();
-    }
-
-    int BaseIndex() const override {
-      return base_iter_->BaseIndex();
-    }
-    
-  private:
-    void Proceed() {
-      while (!base_iter_->empty()) {
-	const ArmorSet &armor_set = **base_iter_;
-	int defense = 0;
-	for (int id : armor_set.ids) defense += data_->armor(id).max_defense;
-	if (defense >= min_defense_) {
-	  break;
-	} else {
-	  ++(*base_iter_);
-	}
+      : base_iter_(base_iter), data_(data), min_defense_(min_defense) {}
+
+    // The armor sets of the base are written straight to sets, and
+    // the ones kept are packed to the front.
+    size_t NextBatch(BasicArmorSet<Key> *sets, int *base_indices,
+                     size_t size) override {
+      size_t count = 0;
+      while (count < size) {
+        size_t wanted = size - count;
+        size_t read = base_iter_->NextBatch(sets + count, 
+                                            base_indices + count, wanted);
+        size_t end = count + read;
+        for (size_t i = count; i < end; ++i) {
+          int defense = 0;
+          for (int id : sets[i].ids) defense += data_->armor(id).max_defense;
+          if (defense >= min_defense_) {
+            std::swap(sets[count], sets[i]);
+            base_indices[count] = base_indices[i];
+            count++;
+          }
+        }
+        if (read < wanted) break;
       }
+      return count;
     }
 
-    ArmorSetIterator *base_iter_;
+  private:
+    BasicArmorSetIterator<Key> *base_iter_;
     const DataSet *data_;
     int min_defense_;
   };
@@ -267,88 +347,131 @@ namespace monster_avengers {
 
 
 
-  class ArmorUp {
+  // Key layouts from the smallest to the largest. ArmorUp searches
+  // with the first one that fits the query, see SelectLayout().
+  enum KeyLayout {
+    SMALL_KEY = 0,  // Signature
+    LONG_KEY,       // LongSignature
+    WIDE_KEY,       // WideSignature
+    LONG_WIDE_KEY,  // LongWideSignature
+    KEY_LAYOUT_NUM
+  };
+
+  // The search over one key layout. Every query passed in has already
+  // been optimized by ArmorUp::OptimizeQuery().
+  class SearchEngine {
   public:
-    ArmorUp(const std::string &data_folder) 
-      : data_(data_folder), pool_(),
-        iterators_(), output_iterators_() {}
-    
-    std::vector<TreeRoot> Foundation(const Query &query) {
+    virtual ~SearchEngine() {}
+    // Fails if the query can not be searched, and leaves no output.
+    virtual Status SearchCore(const Query &query) = 0;
+    virtual void Format(OutputSpec spec, const Query &query,
+                        const std::string &output_path) = 0;
+    virtual std::string Encode(const Query &query) = 0;
+    virtual std::wstring Serialize(const Query &query) = 0;
+    virtual void Iterate(const Query &query) = 0;
+    // Tells in pass whether the query has any result, and discards the
+    // nodes created for it. Fails if the query went over the node
+    // budget before a result was found.
+    virtual Status Explore(const Query &query, bool *pass) = 0;
+    // Fails if a worker of the last query failed, or if the query went
+    // over the node budget, in which case its results are cut short.
+    virtual Status CheckStatus() const = 0;
+    // Discards the nodes of the last query, keeping the memory.
+    virtual void Release() = 0;
+    virtual void set_node_budget(size_t nodes) = 0;
+    // The most nodes held at once by the queries so far.
+    virtual size_t NodeHighWater() const = 0;
+    virtual void Summarize() const = 0;
+  };
 
-      // Forest with no torso up.
-      std::array<std::vector<int>, PART_NUM> part_forests;
-      for (int part = HEAD; part < PART_NUM; ++part) {
-        part_forests[part] = 
-          std::move(ClassifyArmors(static_cast<ArmorPart>(part),
-                                   query));
-      }
-      
-      std::vector<int> current;
-      for (int part = HEAD; part < PART_NUM; ++part) {
-        if (HEAD == part) {
-          current = part_forests[part];
-        } else {
-          current = std::move(MergeForests(part_forests[part], current,
-                                           part == BODY));
-        }
+  template <typename Key>
+  class ArmorUpEngine : public SearchEngine {
+  public:
+    typedef BasicOR<Key> OR;
+
+    // Pairs of ORs that one MergeForests() worker takes at least.
+    static const size_t MERGE_GRAIN = 1 << 15;
+    // Estimated ANDs of a foundation above which it is built by
+    // joining the halves, see Foundation().
+    static constexpr double JOIN_THRESHOLD = 1 << 16;
+    // Buckets above which the skills of a query are not split by in
+    // one stage, see SplitPlan().
+    static const int MULTI_SPLIT_BUCKETS = 64;
+    // Chunks of the foundation per worker of a parallel search, which
+    // leaves the workers that finish early something to steal.
+    static const int PARALLEL_CHUNKS = 8;
+    // Armor sets that the workers of a parallel search may find ahead
+    // of the reader.
+    static const size_t PARALLEL_QUEUE = 256;
+
+    explicit ArmorUpEngine(DataSet *data) 
+      : data_(data), pool_(), groups_(), merge_groups_(), merge_ands_(),
+        threads_((std::max)(1u, std::thread::hardware_concurrency())),
+        worker_pool_(), merge_order_(), split_plan_(), hole_clients_(), 
+        plans_(), split_scratch_(), workers_(), workers_mutex_(),
+        workers_status_(SUCCESS), workers_failed_(false),
+        iterators_(), output_iterators_() {
+      std::iota(merge_order_.begin(), merge_order_.end(), 0);
+    }
+    
+    // Merges the part forests in merge_order_ into result. With join,
+    // every merge is checked against the frontier of the points that
+    // the parts left can reach together, rather than the sum of their
+    // maxima, see FoundationBounds(). Stops at the first merge that
+    // does not fit in the node budget.
+    Status Foundation(
+        const Query &query, 
+        const std::array<std::vector<int>, PART_NUM> &part_forests,
+        bool join, std::vector<BasicTreeRoot<Key> > *result) {
+      MergeBounds bounds = FoundationBounds(query, part_forests, join);
+      std::vector<int> current = part_forests[merge_order_[0]];
+      std::vector<int> merged;
+      for (int step = 1; step < PART_NUM; ++step) {
+        int part = merge_order_[step];
+        Status status = MergeForests(part_forests[part], current, &merged,
+                                     part == BODY, &bounds, step);
+        if (!status.Success()) return status;
+        current.swap(merged);
       }
 
-      std::vector<TreeRoot> result;
-      
+      result->clear();
       for (int id : current) {
-        result.emplace_back(id, pool_.Or(id));
+        result->emplace_back(id, pool_.Or(id));
       }
 
-      return result;
+      return Status(SUCCESS);
     }
 
-    void SearchCore(const Query &query) {
+    Status SearchCore(const Query &query) override {
+      Release();
+
       // Add in custom armors
       InitializeExtraArmors(query);
 
       // Core Search
-      CHECK_SUCCESS(ApplyFoundation(query));
-      for (int i = 0; i < FOUNDATION_NUM; ++i) {
-        CHECK_SUCCESS(ApplySingleJewelFilter(query.effects, i));
-      }
-      for (int i = FOUNDATION_NUM; i < query.effects.size(); ++i) {
-        CHECK_SUCCESS(ApplySkillSplitter(query, i));	
-      }
-      CHECK_SUCCESS(PrepareOutput());
-      CHECK_SUCCESS(ApplyDefenseFilter(query));
+      if (0 < query.parallel) return ApplyParallelStages(query);
+      Status status = ApplyFoundation(query);
+      if (!status.Success()) return status;
+      return ApplyStages(query);
     }
 
-    template <OutputSpec Spec>
-    void Search(const Query &query, const std::string &output_path = "") {
-      // Optimize the Query
-      Query optimized_query = OptimizeQuery(query);
-
-      SearchCore(optimized_query);
-
-      // Prepare formatter
-      ArmorSetFormatter<Spec> formatter(output_path, &data_, 
-                                        optimized_query);
-      
-      int count = 0;
-      while (count < query.max_results && !output_iterators_.back()->empty()) {
-        formatter(**output_iterators_.back());
-	++count;
-        ++(*output_iterators_.back());
+    void Format(OutputSpec spec, const Query &query,
+                const std::string &output_path) override {
+      switch (spec) {
+      case SCREEN: Format<SCREEN>(query, output_path); break;
+      case LISP: Format<LISP>(query, output_path); break;
+      case JSON: Format<JSON>(query, output_path); break;
       }
     }
 
-    std::string SearchEncoded(const Query &query) {
-      // Optimize the Query
-      Query optimized_query = OptimizeQuery(query);
-
-      SearchCore(optimized_query);
-
+    std::string Encode(const Query &query) override {
       // Prepare formatter
-      EncodeFormatter formatter(&data_, optimized_query);
+      BasicEncodeFormatter<Key> formatter(data_, query, &plans_);
 
       std::string output;
       int count = 0;
-      while (count < query.max_results && !output_iterators_.back()->empty()) {
+      while (count < query.max_results && !output_iterators_.back()->empty() &&
+             !Failed()) {
         formatter(**output_iterators_.back(), &output);
 	++count;
         ++(*output_iterators_.back());
@@ -356,18 +479,14 @@ namespace monster_avengers {
       return output;
     }
 
-    std::wstring SearchSerialized(const Query &query) {
-      // Optimize the Query
-      Query optimized_query = OptimizeQuery(query);
-
-      SearchCore(optimized_query);
-
+    std::wstring Serialize(const Query &query) override {
       // Prepare formatter
-      ResultSerializer serializer(&data_, optimized_query);
+      BasicResultSerializer<Key> serializer(data_, query, &plans_);
 
       std::string output;
       int count = 0;
-      while (count < query.max_results && !output_iterators_.back()->empty()) {
+      while (count < query.max_results && !output_iterators_.back()->empty() &&
+             !Failed()) {
         serializer.Add(**output_iterators_.back());
 	++count;
         ++(*output_iterators_.back());
@@ -375,125 +494,159 @@ namespace monster_avengers {
       return serializer.ToString();
     }
 
-    // Iterate is for speed test only.
-    void Iterate(const Query &input_query) {
-      // Optimize the Query
-      Query query = OptimizeQuery(input_query);
+    void Iterate(const Query &query) override {
+      Release();
 
       // Add in custom armors
       InitializeExtraArmors(query);
 
       // Core Search
-      CHECK_SUCCESS(ApplyFoundation(query));
-      CHECK_SUCCESS(ApplySingleJewelFilter(query.effects, 0));
-      CHECK_SUCCESS(ApplySingleJewelFilter(query.effects, 1));
-      for (int i = FOUNDATION_NUM; i < query.effects.size(); ++i) {
-        CHECK_SUCCESS(ApplySkillSplitter(query, i));	
-      }
+      if (!ApplyFoundation(query).Success()) return;
+      CHECK_SUCCESS(ApplySingleJewelFilter(query, 0));
+      CHECK_SUCCESS(ApplySingleJewelFilter(query, 1));
+      if (!ApplySkillSplitters(query).Success()) return;
       CHECK_SUCCESS(PrepareOutput());
       CHECK_SUCCESS(ApplyDefenseFilter(query));
       
       // Prepare formatter
-      while (!output_iterators_.back()->empty()) {
+      while (!output_iterators_.back()->empty() && !pool_.OverBudget()) {
         ++(*output_iterators_.back());
       }
     }
-    
-    void Explore(const Query &input_query,
-                 const std::string output_path = "") {
-      Timer overall_timer;
-      overall_timer.Tic();
-      Timer timer;
+
+    Status Explore(const Query &query, bool *pass) override {
       pool_.PushSnapshot();
+      iterators_.clear();
 
-      ExploreFormatter formatter(output_path);
-      
-      for (int i = 1; i < data_.skill_systems().size(); ++i) {
-        timer.Tic();
-        if (input_query.HasSkill(i)) {
-          formatter.Push(i, false,
-                         data_.skill_system(i).name,
-                         timer.Toc());
-          continue;
-        }
-        pool_.RestoreSnapshot();
-        iterators_.clear();
-        
-        Query updated_query = input_query;
-        updated_query.effects.push_back({
-            i, data_.skill_system(i).LowestPositivePoints()});
-        Query query = OptimizeQuery(updated_query, false);
-        
-        // Add in custom armors
-        InitializeExtraArmors(query);
+      // Add in custom armors
+      InitializeExtraArmors(query);
 
-        // Core Search
-        CHECK_SUCCESS(ApplyFoundation(query));
+      // Core Search
+      *pass = false;
+      Status status = ApplyFoundation(query);
+      if (status.Success()) {
         for (int i = 0; i < FOUNDATION_NUM; ++i) {
-          CHECK_SUCCESS(ApplySingleJewelFilter(query.effects, i));
-        }
-        for (int i = FOUNDATION_NUM; i < query.effects.size(); ++i) {
-          CHECK_SUCCESS(ApplySkillSplitter(query, i));	
+          CHECK_SUCCESS(ApplySingleJewelFilter(query, i));
         }
-
-        formatter.Push(i, !iterators_.back()->empty(), 
-                       data_.skill_system(i).name,
-                       timer.Toc());
+        status = ApplySkillSplitters(query);
       }
-      wprintf(L"Overall: %.4lf sec\n", overall_timer.Toc());
+      if (status.Success()) {
+        *pass = !iterators_.back()->empty();
+        // The last stage stops short once the pool is over the budget.
+        if (!*pass && pool_.OverBudget()) status = BudgetStatus();
+      }
+
+      iterators_.clear();
+      pool_.PopSnapshot();
+      return status;
     }
 
-    Query OptimizeQuery(const Query &query, bool verbose = true) {
-      std::vector<double> scores;
-      std::vector<int> indices;
-      for (int i = 0; i < query.effects.size(); ++i) {
-        const Effect &effect = query.effects[i];
-        indices.push_back(i);
-        scores.push_back(data_.EffectScore(effect));
-        if (verbose) {
-          wprintf(L"(%03d) %ls: %.5lf\n", 
-                  effect.skill_id,
-                  data_.skill_system(effect.skill_id).name.c_str(),
-                  scores.back());
-        }
+    Status CheckStatus() const override {
+      {
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        if (workers_failed_) return workers_status_;
       }
+      if (pool_.OverBudget()) return BudgetStatus();
+      return Status(SUCCESS);
+    }
 
-      std::sort(indices.begin(), indices.end(), 
-                [&scores](int a, int b) {
-                  return scores[a] < scores[b];
-                });
-      Query optimized = query;
-      optimized.effects.clear();
-      for (int i = 0; i < query.effects.size(); ++i) {
-        optimized.effects.push_back(query.effects[indices[i]]);
+    void Release() override {
+      // Joins the threads of a parallel search first.
+      output_iterators_.clear();
+      iterators_.clear();
+      pool_.Clear();
+      for (std::unique_ptr<ArmorUpEngine<Key> > &worker : workers_) {
+        worker->Release();
       }
-      return optimized;
+      workers_status_ = Status(SUCCESS);
+      workers_failed_ = false;
     }
 
-    void ListSkills() {
-      data_.PrintSkillSystems();
+    void set_node_budget(size_t nodes) override {
+      pool_.set_budget(nodes);
+    }
+
+    size_t NodeHighWater() const override {
+      size_t nodes = pool_.NodeHighWater();
+      for (const std::unique_ptr<ArmorUpEngine<Key> > &worker : workers_) {
+        nodes = (std::max)(nodes, worker->NodeHighWater());
+      }
+      return nodes;
     }
 
     // ----- Debug -----
-    void Summarize() {
-      data_.Summarize();
-      Log(INFO, L"OR Nodes: %lld\n", pool_.OrSize());
-      Log(INFO, L"AND Nodes: %lld\n", pool_.AndSize());
+    void Summarize() const override {
+      Log(INFO, L"OR Nodes: %lld (high water %lld)\n", pool_.OrSize(),
+          pool_.OrHighWater());
+      Log(INFO, L"AND Nodes: %lld (high water %lld)\n", pool_.AndSize(),
+          pool_.AndHighWater());
+      Log(INFO, L"Node Pool: %lld KB, %lld shared ORs\n", 
+          pool_.MemoryBytes() >> 10, pool_.InternHits());
+      Log(INFO, L"Lazy Splits: %lld, %lld expanded\n", pool_.LazyNodes(),
+          pool_.LazyExpansions());
+      Log(INFO, L"Jewel Keys: %lld (%lld KB)\n", pool_.jewel_keys().size(),
+          pool_.jewel_keys().MemoryBytes() >> 10);
+      Log(INFO, L"Hole Clients: %lld (%lld KB), %lld hits, %lld misses\n",
+          hole_clients_.size(), hole_clients_.MemoryBytes() >> 10,
+          hole_clients_.hits(), hole_clients_.misses());
+      Log(INFO, L"Jewel Plans: %lld, %lld hits, %lld misses\n",
+          plans_.size(), plans_.hits(), plans_.misses());
     } 
 
+    // Runs the stages of query, one skill splitter per effect after
+    // the foundation, and calls visit(effect_id, forest, &pool, scratch)
+    // with the forest that reaches each splitter stage and the scratch
+    // of the stage. The forest is rewound after visit. For benchmarks.
+    template <typename Visit>
+    Status VisitSplitterStages(const Query &query, Visit visit) {
+      Release();
+      InitializeExtraArmors(query);
+      Status status = ApplyFoundation(query);
+      for (int i = 0; status.Success() && i < FOUNDATION_NUM; ++i) {
+        status = ApplySingleJewelFilter(query, i);
+      }
+      for (int i = FOUNDATION_NUM; 
+           status.Success() && i < query.effects.size(); ++i) {
+        CachedTreeIterator<Key> *forest = 
+          new CachedTreeIterator<Key>(iterators_.back().get());
+        iterators_.emplace_back(forest);
+        visit(i, forest, &pool_, StageScratch(i));
+        forest->Reset();
+        status = ApplySkillSplitter(query, i);
+      }
+      Release();
+      return status;
+    }
+
   private:
+    template <OutputSpec Spec>
+    void Format(const Query &query, const std::string &output_path) {
+      // Prepare formatter
+      ArmorSetFormatter<Spec, Key> formatter(output_path, data_, query, 
+                                             &plans_);
+      
+      int count = 0;
+      while (count < query.max_results && !output_iterators_.back()->empty() &&
+             !Failed()) {
+        formatter(**output_iterators_.back());
+	++count;
+        ++(*output_iterators_.back());
+      }
+    }
+
     void InitializeExtraArmors(const Query &query) {
-      data_.ClearExtraArmor();
+      data_->ClearExtraArmor();
       // Amulets
       for (const Armor &amulet : query.amulets) {
-        data_.AddExtraArmor(AMULET, amulet);
+        data_->AddExtraArmor(AMULET, amulet);
       }
     }
     
     // Returns a vector of newly created or nodes' indices.
     std::vector<int> ClassifyArmors(ArmorPart part,
                                     const Query &query) {
-      std::unordered_map<Signature, std::vector<int> > armor_map;
+      SignatureMap<std::vector<int>, Key> &armor_map = groups_;
+      armor_map.clear();
 
       std::vector<Effect> effects;
       int query_size = query.effects.size();
@@ -501,10 +654,10 @@ namespace monster_avengers {
         effects.push_back(query.effects[i]);
       }
       
-      for (int id : data_.ArmorIds(part)) {
-        const Armor &armor = data_.armor(id);
+      for (int id : data_->ArmorIds(part)) {
+        const Armor &armor = data_->armor(id);
         if (armor.type == query.weapon_type || BOTH == armor.type) {
-          Signature key(armor, effects);
+          Key key(armor, effects);
           
           // Rare blacklist
           if (GEAR != part && AMULET != part) {
@@ -518,105 +671,983 @@ namespace monster_avengers {
           // Weapon holes match
           if (GEAR == part && armor.holes != query.weapon_holes) continue;
           
-          auto it = armor_map.find(key);
-          if (armor_map.end() == it) {
-            armor_map[key] = {id};
-          } else {
-            it->second.push_back(id);
-          }
+          armor_map[key].push_back(id);
         }
       }
       
       std::vector<int> forest;
       forest.reserve(armor_map.size());
-      for (auto &item : armor_map) {
-        forest.push_back(pool_.MakeOR<ARMORS>(item.first, 
-                                              &item.second));
+      for (int i = 0; i < armor_map.size(); ++i) {
+        forest.push_back(pool_.template MakeOR<ARMORS>(armor_map.key(i), 
+                                                       &armor_map.value(i)));
       }
       return forest;
     }
 
-    std::vector<int> MergeForests(const std::vector<int> &left_ors, 
-                                  const std::vector<int> &right_ors, 
-                                  bool is_body = false) {
-      std::unordered_map<Signature, std::vector<int> > and_map;
-      for (int i : left_ors) {
-        const OR &left = pool_.Or(i);
-        for (int j : right_ors) {
-          const OR &right = pool_.Or(j);
-          Signature key = left.key;
-          if (is_body) {
-            key.BodyRefactor(right.key.multiplier() + 1);
+    // Picks the order to merge the part forests in, which minimizes the
+    // estimated number of ANDs created. A merged forest is estimated to
+    // have as many ORs as the product of its parts' ORs, capped by the
+    // number of keys within the range of its parts' keys. BODY always
+    // comes last for the torso up refactor.
+    // The estimated number of ANDs is written to ands.
+    std::array<int, PART_NUM> MergeOrder(
+        const std::array<std::vector<int>, PART_NUM> &part_forests,
+        double *ands) const {
+      const int parts = BODY;
+      std::array<std::array<int, Key::LANES>, PART_NUM> spans;
+      for (int part = 0; part < parts; ++part) {
+        for (int i = 0; i < Key::LANES; ++i) {
+          int low(0), high(0);
+          bool first = true;
+          for (int id : part_forests[part]) {
+            int points = pool_.Or(id).key.lanes[i];
+            if (first || points < low) low = points;
+            if (first || points > high) high = points;
+            first = false;
           }
-          key += right.key;
-          int id = pool_.MakeAnd(i, j);
-          auto it = and_map.find(key);
-          if (and_map.end() == it) {
-            and_map[key] = {id};
-          } else {
-            it->second.push_back(id);
+          spans[part][i] = high - low;
+        }
+      }
+
+      const int subsets = 1 << parts;
+      std::vector<double> size(subsets, 1.0);
+      std::vector<double> cost(subsets, 0.0);
+      std::vector<int> last(subsets, -1);
+      for (int subset = 1; subset < subsets; ++subset) {
+        double product = 1.0;
+        std::array<int, Key::LANES> span;
+        span.fill(1);
+        for (int part = 0; part < parts; ++part) {
+          if (0 == (subset & (1 << part))) continue;
+          product *= part_forests[part].size();
+          for (int i = 0; i < Key::LANES; ++i) span[i] += spans[part][i];
+        }
+        double keys = 1.0;
+        for (int i = 0; i < Key::LANES; ++i) keys *= span[i];
+        size[subset] = (std::min)(product, keys);
+
+        for (int part = 0; part < parts; ++part) {
+          if (0 == (subset & (1 << part))) continue;
+          int rest = subset ^ (1 << part);
+          double merge = 0 == rest ? 0.0 : 
+            cost[rest] + size[rest] * part_forests[part].size();
+          if (-1 == last[subset] || merge < cost[subset]) {
+            cost[subset] = merge;
+            last[subset] = part;
+          }
+        }
+      }
+
+      std::array<int, PART_NUM> order;
+      order[BODY] = BODY;
+      for (int step = parts - 1, subset = subsets - 1; step >= 0; --step) {
+        order[step] = last[subset];
+        subset ^= 1 << last[subset];
+      }
+      *ands = cost[subsets - 1] + size[subsets - 1] * part_forests[BODY].size();
+      return order;
+    }
+
+    // Where ExpansionIterator puts the armor at each depth of the tree
+    // built in merge_order_. The part merged last is at depth 0.
+    std::array<int, PART_NUM> ExpansionSlots() const {
+      std::array<int, PART_NUM> slots;
+      for (int step = 0; step < PART_NUM; ++step) {
+        slots[PART_NUM - 1 - step] = PART_NUM - 1 - merge_order_[step];
+      }
+      return slots;
+    }
+
+    typedef std::array<int, FOUNDATION_NUM> FoundationPoints;
+    // Points that are not below any other, by the first effect from
+    // high to low (and so by the second from low to high).
+    typedef std::vector<FoundationPoints> Frontier;
+
+    // Upper bounds that MergeForests() prunes the forests with.
+    struct MergeBounds {
+      int effects;
+      // Points of each foundation effect that the query requires.
+      FoundationPoints required;
+      // The most points of each foundation effect that jewels add in
+      // holes of 0 to 3 slots.
+      std::array<FoundationPoints, 4> hole_points;
+      // The points, jewels included, that the parts merged after each
+      // step of merge_order_ can add.
+      std::array<Frontier, PART_NUM> rest;
+    };
+
+    // The rest of each step is either the sum of the most points of
+    // every part left, or with join the exact frontier of what the
+    // parts left reach together. The latter is built from the last
+    // part back, so the first half of the merges is checked against
+    // all the combinations of the second half.
+    MergeBounds FoundationBounds(
+        const Query &query, 
+        const std::array<std::vector<int>, PART_NUM> &part_forests,
+        bool join) const {
+      MergeBounds bounds;
+      bounds.effects = (std::min)(static_cast<int>(query.effects.size()),
+                                  FOUNDATION_NUM);
+      bounds.required.fill(0);
+      for (auto &points : bounds.hole_points) points.fill(0);
+      for (int e = 0; e < bounds.effects; ++e) {
+        bounds.required[e] = query.effects[e].points;
+      }
+
+      // A hole can hold any jewels that fit, or none.
+      for (int slots = 1; slots <= 3; ++slots) {
+        bounds.hole_points[slots] = bounds.hole_points[slots - 1];
+        for (const Jewel &jewel : data_->jewels()) {
+          if (jewel.holes > slots) continue;
+          for (int e = 0; e < bounds.effects; ++e) {
+            int points = bounds.hole_points[slots - jewel.holes][e];
+            for (const Effect &effect : jewel.effects) {
+              if (query.effects[e].skill_id == effect.skill_id) {
+                points += effect.points;
+              }
+            }
+            bounds.hole_points[slots][e] = 
+              (std::max)(bounds.hole_points[slots][e], points);
+          }
+        }
+      }
+
+      // The body is scaled by at most one plus the number of parts
+      // with torso up armors.
+      int max_multiplier = 1;
+      for (int part = 0; part < BODY; ++part) {
+        for (int id : part_forests[part]) {
+          if (0 < pool_.Or(id).key.multiplier()) {
+            max_multiplier++;
+            break;
+          }
+        }
+      }
+
+      FoundationPoints zero;
+      zero.fill(0);
+      bounds.rest[PART_NUM - 1] = {zero};
+      for (int step = PART_NUM - 1; step > 0; --step) {
+        int part = merge_order_[step];
+        Frontier points;
+        for (int id : part_forests[part]) {
+          const Key key = pool_.Or(id).key;
+          FoundationPoints armor_points = zero;
+          for (int e = 0; e < bounds.effects; ++e) {
+            armor_points[e] = key.lanes[sig::EFFECTS_BEGIN + e] + 
+              JewelPoints(bounds, key, e);
+            if (BODY == part && armor_points[e] > 0) {
+              armor_points[e] *= max_multiplier;
+            }
+          }
+          points.push_back(armor_points);
+        }
+        // An empty part fails every merge anyway.
+        if (points.empty()) points.push_back(zero);
+
+        if (!join) {
+          FoundationPoints best = points[0];
+          for (const FoundationPoints &item : points) {
+            for (int e = 0; e < FOUNDATION_NUM; ++e) {
+              best[e] = (std::max)(best[e], item[e]);
+            }
           }
+          points = {best};
+        }
+        
+        Frontier sums;
+        sums.reserve(points.size() * bounds.rest[step].size());
+        for (const FoundationPoints &item : points) {
+          for (const FoundationPoints &rest : bounds.rest[step]) {
+            FoundationPoints sum;
+            for (int e = 0; e < FOUNDATION_NUM; ++e) {
+              sum[e] = item[e] + rest[e];
+            }
+            sums.push_back(sum);
+          }
+        }
+        bounds.rest[step - 1] = Pareto(std::move(sums));
+      }
+      return bounds;
+    }
+
+    static Frontier Pareto(Frontier points) {
+      std::sort(points.begin(), points.end(), 
+                [](const FoundationPoints &a, const FoundationPoints &b) {
+                  return a[0] > b[0] || (a[0] == b[0] && a[1] > b[1]);
+                });
+      Frontier frontier;
+      for (const FoundationPoints &item : points) {
+        if (frontier.empty() || item[1] > frontier.back()[1]) {
+          frontier.push_back(item);
+        }
+      }
+      return frontier;
+    }
+
+    // The most points of effect e that jewels in the holes of key add.
+    static int JewelPoints(const MergeBounds &bounds, const Key &key, 
+                           int e) {
+      int one(0), two(0), three(0);
+      sig::KeyHoles(key, &one, &two, &three);
+      int points = one * bounds.hole_points[1][e] + 
+        two * bounds.hole_points[2][e] + three * bounds.hole_points[3][e];
+      key.BodyHoles(&one, &two, &three);
+      if (0 < one + two + three) {
+        points += key.multiplier() * 
+          (one * bounds.hole_points[1][e] + two * bounds.hole_points[2][e] +
+           three * bounds.hole_points[3][e]);
+      }
+      return points;
+    }
+
+    // Whether key, merged at step, can still reach the points of the
+    // foundation effects with some point of the rest frontier.
+    static bool Reachable(const MergeBounds &bounds, const Key &key, 
+                          int step) {
+      FoundationPoints needed;
+      needed.fill(std::numeric_limits<int>::min());
+      for (int e = 0; e < bounds.effects; ++e) {
+        needed[e] = bounds.required[e] - key.lanes[sig::EFFECTS_BEGIN + e] - 
+          JewelPoints(bounds, key, e);
+      }
+      // The last point that reaches the first effect has the most of
+      // the second among those that do.
+      const Frontier &rest = bounds.rest[step];
+      auto it = std::partition_point(
+          rest.begin(), rest.end(), [&needed](const FoundationPoints &item) {
+            return item[0] >= needed[0];
+          });
+      return rest.begin() != it && (it - 1)->at(1) >= needed[1];
+    }
+
+    // The left ORs are split into contiguous chunks, one per worker
+    // of worker_pool_, and each worker groups the pairs of its chunk
+    // on its own. The groups are then merged in chunk order, which
+    // keeps the first appearance order of the keys and the pair order
+    // in each group, and the ANDs are created group by group. So the
+    // ORs and ANDs created do not depend on the number of workers.
+    // With bounds, the pairs that can not reach the foundation effects
+    // any more are dropped. Every pair kept is an AND, so the merge
+    // fails before it creates any node once the pairs kept do not fit
+    // in the node budget, and a worker stops grouping as soon as its
+    // own do not.
+    Status MergeForests(const std::vector<int> &left_ors, 
+                        const std::vector<int> &right_ors, 
+                        std::vector<int> *forest,
+                        bool is_body = false, 
+                        const MergeBounds *bounds = nullptr,
+                        int step = 0) {
+      const size_t width = right_ors.size();
+      const size_t nodes_left = pool_.NodesLeft();
+      std::atomic<bool> over_budget(false);
+      const int workers = static_cast<int>(
+          (std::max)(static_cast<size_t>(1), 
+                     (std::min)({static_cast<size_t>(threads_), 
+                                 left_ors.size(),
+                                 left_ors.size() * width / MERGE_GRAIN})));
+      if (merge_groups_.size() < workers) merge_groups_.resize(workers);
+
+      // The groups hold the pairs as l * width + r, for left_ors[l]
+      // and right_ors[r], which may not fit in an int.
+      auto group = [this, &left_ors, &right_ors, width, workers, 
+                    is_body, bounds, step, nodes_left, 
+                    &over_budget](int worker) {
+        SignatureMap<std::vector<size_t>, Key> &and_map = 
+          merge_groups_[worker];
+        and_map.clear();
+        size_t begin = left_ors.size() * worker / workers;
+        size_t end = left_ors.size() * (worker + 1) / workers;
+        size_t kept = 0;
+        for (size_t l = begin; l < end; ++l) {
+          if (over_budget) return;
+          const OR &left = pool_.Or(left_ors[l]);
+          size_t pair = l * width;
+          for (int j : right_ors) {
+            const OR &right = pool_.Or(j);
+            Key key = left.key;
+            if (is_body) {
+              key.BodyRefactor(right.key.multiplier() + 1);
+            }
+            key += right.key;
+            if (nullptr == bounds || Reachable(*bounds, key, step)) {
+              and_map[key].push_back(pair);
+              if (++kept > nodes_left) {
+                over_budget = true;
+                return;
+              }
+            }
+            pair++;
+          }
+        }
+      };
+      worker_pool_.Run(workers, group);
+      if (over_budget) return BudgetStatus();
+
+      SignatureMap<std::vector<size_t>, Key> &and_map = merge_groups_[0];
+      for (int worker = 1; worker < workers; ++worker) {
+        const SignatureMap<std::vector<size_t>, Key> &local = 
+          merge_groups_[worker];
+        for (int i = 0; i < local.size(); ++i) {
+          std::vector<size_t> &pairs = and_map[local.key(i)];
+          pairs.insert(pairs.end(), local.value(i).begin(), 
+                       local.value(i).end());
         }
       }
       
-      std::vector<int> forest;
-      forest.reserve(and_map.size());
-      for (auto &item : and_map) {
-        forest.push_back(pool_.MakeOR<ANDS>(item.first,
-                                            &item.second));
+      size_t nodes = and_map.size();
+      for (int i = 0; i < and_map.size(); ++i) {
+        nodes += and_map.value(i).size();
       }
-      return forest;
+      if (nodes > nodes_left) return BudgetStatus();
+
+      forest->clear();
+      forest->reserve(and_map.size());
+      for (int i = 0; i < and_map.size(); ++i) {
+        for (size_t pair : and_map.value(i)) {
+          merge_ands_.push_back(pool_.MakeAnd(left_ors[pair / width], 
+                                              right_ors[pair % width]));
+        }
+        forest->push_back(pool_.template MakeOR<ANDS>(and_map.key(i),
+                                                      &merge_ands_));
+      }
+      return Status(SUCCESS);
     }
 
     Status ApplyFoundation(const Query &query) {
+      std::vector<BasicTreeRoot<Key> > roots;
+      Status status = FoundationRoots(query, &roots);
+      if (!status.Success()) return status;
+      iterators_.emplace_back(new ListIterator<Key>(std::move(roots)));
+      return Status(SUCCESS);
+    }
+
+    // Writes the trees of the foundation to roots, after which
+    // split_plan_ is set. Fails if they do not fit in the node budget.
+    Status FoundationRoots(const Query &query, 
+                           std::vector<BasicTreeRoot<Key> > *roots) {
       iterators_.clear();
-      iterators_.emplace_back(new ListIterator(Foundation(query)));
+      std::array<std::vector<int>, PART_NUM> part_forests;
+      for (int part = HEAD; part < PART_NUM; ++part) {
+        part_forests[part] = 
+          std::move(ClassifyArmors(static_cast<ArmorPart>(part),
+                                   query));
+      }
+      double ands = 0.0;
+      merge_order_ = MergeOrder(part_forests, &ands);
+      // Small foundations are cheaper to merge than the frontiers are
+      // to build.
+      bool join = ands > JOIN_THRESHOLD;
+      Status status = Foundation(query, part_forests, join, roots);
+      if (!status.Success()) return status;
+      split_plan_ = SplitPlan(query, part_forests);
+      // The stages after would only add to the nodes.
+      if (pool_.OverBudget()) return BudgetStatus();
+      return Status(SUCCESS);
+    }
+
+    // Runs the stages after the foundation on query.parallel workers,
+    // each an engine of its own with its nodes, hole clients and
+    // splitter memory. The foundation is built here and copied to the
+    // workers, which run the stages over chunks of its trees and go
+    // back to the copy after each chunk. The node budget holds for
+    // each chunk. The query comes from clients, so there are no more
+    // workers than hardware threads, which they share. They share the
+    // capacity of the hole client cache of this engine as well.
+    Status ApplyParallelStages(const Query &query) {
+      std::shared_ptr<std::vector<BasicTreeRoot<Key> > > roots(
+          new std::vector<BasicTreeRoot<Key> >());
+      Status status = FoundationRoots(query, roots.get());
+      if (!status.Success()) return status;
+      int workers = (std::min)(query.parallel, threads_);
+      while (workers_.size() < workers) {
+        workers_.emplace_back(new ArmorUpEngine<Key>(data_));
+      }
+      for (int worker = 0; worker < workers; ++worker) {
+        ArmorUpEngine<Key> &engine = *workers_[worker];
+        engine.Release();
+        engine.pool_.CopyNodes(pool_);
+        engine.pool_.set_budget(pool_.budget());
+        engine.pool_.PushSnapshot();
+        engine.merge_order_ = merge_order_;
+        engine.split_plan_ = split_plan_;
+        engine.threads_ = (std::max)(1, threads_ / workers);
+        engine.hole_clients_.set_capacity(hole_clients_.capacity() / 
+                                          workers);
+      }
+      int chunks = static_cast<int>(
+          (std::min)(roots->size(), 
+                     static_cast<size_t>(workers * PARALLEL_CHUNKS)));
+      auto run = [this, query, roots, chunks]
+        (int worker, int chunk, 
+         const typename ParallelArmorSetIterator<Key>::Emit &emit) {
+        size_t begin = roots->size() * chunk / chunks;
+        size_t end = roots->size() * (chunk + 1) / chunks;
+        Status status = workers_[worker]->RunStages(
+            query, std::vector<BasicTreeRoot<Key> >(
+                roots->begin() + begin, roots->begin() + end), emit);
+        if (status.Success()) return true;
+        // Only the first failure is told.
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        if (!workers_failed_) {
+          workers_status_ = status;
+          workers_failed_ = true;
+        }
+        return false;
+      };
+      output_iterators_.emplace_back(
+          new ParallelArmorSetIterator<Key>(chunks, workers, query.ordered,
+                                            query.max_results, 
+                                            PARALLEL_QUEUE, run));
       return Status(SUCCESS);
     }
 
-    Status ApplySingleJewelFilter(const std::vector<Effect> &effects, 
-                                  int effect_id) {
-      TreeIterator *new_iter = 
-        new JewelFilterIterator(iterators_.back().get(),
-                                data_,
-                                &pool_,
-                                effect_id,
-                                effects);
+    // Runs the stages after the foundation over roots, on a worker of
+    // ApplyParallelStages(), and passes the armor sets to emit until it
+    // returns false. Fails if a stage fails or the nodes went over the
+    // budget, which the worker reports rather than exit from its
+    // thread.
+    Status RunStages(
+        const Query &query, std::vector<BasicTreeRoot<Key> > &&roots,
+        const typename ParallelArmorSetIterator<Key>::Emit &emit) {
+      pool_.RestoreSnapshot();
+      iterators_.emplace_back(new ListIterator<Key>(std::move(roots)));
+      Status status = ApplyStages(query);
+      if (status.Success()) {
+        BasicArmorSetIterator<Key> &output = *output_iterators_.back();
+        while (!output.empty() && !pool_.OverBudget() && emit(*output)) {
+          ++output;
+        }
+        status = CheckStatus();
+      }
+      output_iterators_.clear();
+      iterators_.clear();
+      return status;
+    }
+
+    // The stages after the foundation, up to the output. Stops at the
+    // first that fails, or once the pool is over the budget.
+    Status ApplyStages(const Query &query) {
+      for (int i = 0; i < FOUNDATION_NUM; ++i) {
+        if (pool_.OverBudget()) return BudgetStatus();
+        Status status = ApplySingleJewelFilter(query, i);
+        if (!status.Success()) return status;
+      }
+      Status status = ApplySkillSplitters(query);
+      if (!status.Success()) return status;
+      status = PrepareOutput();
+      if (!status.Success()) return status;
+      return ApplyDefenseFilter(query);
+    }
+
+    // Whether the last query went over the node budget, or failed on
+    // any of the workers.
+    inline bool Failed() const {
+      return pool_.OverBudget() || workers_failed_;
+    }
+
+    Status ApplySingleJewelFilter(const Query &query, int effect_id) {
+      BasicTreeIterator<Key> *new_iter = 
+        new JewelFilterIterator<Key>(iterators_.back().get(),
+                                     &pool_,
+                                     StageHoleClient(query, effect_id),
+                                     effect_id,
+                                     query.effects);
       iterators_.emplace_back(new_iter);
       return Status(SUCCESS);
     }
 
+    // The stages of split_plan_, after the foundation.
+    Status ApplySkillSplitters(const Query &query) {
+      int effect_id = FOUNDATION_NUM;
+      for (int skills : split_plan_) {
+        if (pool_.OverBudget()) return BudgetStatus();
+        Status status = ApplySkillSplitter(query, effect_id, skills);
+        if (!status.Success()) return status;
+        effect_id += skills;
+      }
+      return Status(SUCCESS);
+    }
+
     Status ApplySkillSplitter(const Query &query,
-                              int effect_id) {
-      TreeIterator *new_iter = 
-        new SkillSplitIterator(iterators_.back().get(),
-                               data_,
-                               &pool_,
-                               effect_id,
-                               query);
+                              int effect_id, int skills = 1) {
+      BasicTreeIterator<Key> *new_iter = 
+        new SkillSplitIterator<Key>(iterators_.back().get(),
+                                    *data_,
+                                    &pool_,
+                                    StageHoleClient(query, effect_id, 
+                                                    skills),
+                                    StageScratch(effect_id),
+                                    effect_id,
+                                    skills,
+                                    query);
       iterators_.emplace_back(new_iter);
       return Status(SUCCESS);
     }
 
+    // The number of skills that each stage after the foundation splits
+    // by. The trailing skills are folded into one stage while the
+    // product of the widths of their points stays within
+    // MULTI_SPLIT_BUCKETS. The stage then makes one generation of
+    // nodes instead of one per skill, but splits every tree into as
+    // many buckets.
+    std::vector<int> SplitPlan(
+        const Query &query,
+        const std::array<std::vector<int>, PART_NUM> &part_forests) const {
+      int max_groups(0), max_holes(0), max_multiplier(0);
+      HoleBounds(query, &max_groups, &max_holes, &max_multiplier);
+      int buckets = 1;
+      int folded = 0;
+      for (int i = query.effects.size() - 1; 
+           i >= FOUNDATION_NUM && folded < SplitScratch::MAX_SKILLS; --i) {
+        int width = PointsWidth(query.effects[i].skill_id, part_forests,
+                                max_multiplier);
+        if (0 < folded && buckets * width > MULTI_SPLIT_BUCKETS) break;
+        buckets *= width;
+        folded++;
+      }
+      std::vector<int> plan;
+      for (int i = FOUNDATION_NUM; i + folded < query.effects.size(); ++i) {
+        plan.push_back(1);
+      }
+      if (0 < folded) plan.push_back(folded);
+      return plan;
+    }
+
+    // The number of totals of points of skill_id that the armor sets
+    // of the part forests can have, at most.
+    int PointsWidth(int skill_id, 
+                    const std::array<std::vector<int>, PART_NUM> &part_forests,
+                    int max_multiplier) const {
+      int width = 1;
+      for (int part = HEAD; part < PART_NUM; ++part) {
+        int low = 1000;
+        int high = -1000;
+        for (int id : part_forests[part]) {
+          for (int armor_id : pool_.Or(id).daughters) {
+            int points = 0;
+            for (const Effect &effect : data_->armor(armor_id).effects) {
+              if (skill_id == effect.skill_id) {
+                points = effect.points;
+                break;
+              }
+            }
+            low = (std::min)(low, points);
+            high = (std::max)(high, points);
+          }
+        }
+        if (low <= high) {
+          width += (high - low) * (BODY == part ? max_multiplier : 1);
+        }
+      }
+      return width;
+    }
+
+    // The splitter memory of the stage of effect_id, kept for the next
+    // queries.
+    SplitScratch *StageScratch(int effect_id) {
+      while (split_scratch_.size() <= effect_id) {
+        split_scratch_.emplace_back(new SplitScratch());
+      }
+      return split_scratch_[effect_id].get();
+    }
+
+    // The hole client of the stage of effects [effect_id, effect_id +
+    // skills), with its tables filled up front when the query asks for
+    // it.
+    std::shared_ptr<BasicHoleClient<Key> > 
+    StageHoleClient(const Query &query, int effect_id, int skills = 1) {
+      std::vector<int> skill_ids;
+      for (int k = 0; k < skills; ++k) {
+        skill_ids.push_back(query.effects[effect_id + k].skill_id);
+      }
+      std::shared_ptr<BasicHoleClient<Key> > client = 
+        hole_clients_.Get(*data_, skill_ids, query.effects, query.skyline);
+      if (0 < query.precompute) {
+        int max_groups(0), max_holes(0), max_multiplier(0);
+        HoleBounds(query, &max_groups, &max_holes, &max_multiplier);
+        // The query comes from clients, so there are no more threads
+        // than hardware threads.
+        client->Precompute(max_groups, max_holes, max_multiplier, 
+                           (std::min)(query.precompute, threads_),
+                           &worker_pool_);
+      }
+      return client;
+    }
+
+    // Bounds on the holes of the armor sets of the query: the number of
+    // parts with holes, the total holes and the torso multiplier.
+    void HoleBounds(const Query &query, int *max_groups, int *max_holes, 
+                    int *max_multiplier) const {
+      *max_groups = 0;
+      *max_holes = 0;
+      *max_multiplier = 1;
+      for (int part = HEAD; part < PART_NUM; ++part) {
+        int holes = 0;
+        bool torso_up = false;
+        for (int id : data_->ArmorIds(static_cast<ArmorPart>(part))) {
+          const Armor &armor = data_->armor(id);
+          holes = (std::max)(holes, armor.holes);
+          if (armor.TorsoUp()) torso_up = true;
+        }
+        if (GEAR == part) holes = query.weapon_holes;
+        if (0 < holes) (*max_groups)++;
+        *max_holes += holes;
+        if (BODY != part && torso_up) (*max_multiplier)++;
+      }
+    }
+
     Status PrepareOutput() {
-      output_iterators_.emplace_back(new ExpansionIterator(iterators_.back().get(), 
-							   &pool_));
+      output_iterators_.emplace_back(
+          new BasicExpansionIterator<Key>(iterators_.back().get(), &pool_,
+                                          ExpansionSlots()));
       return Status(SUCCESS);
     }
 
     Status ApplyDefenseFilter(const Query &query) {
-      output_iterators_.emplace_back(new DefenseFilterIterator(output_iterators_.back().get(),
-							       &data_,
-							       query.defense));
+      output_iterators_.emplace_back(
+          new DefenseFilterIterator<Key>(output_iterators_.back().get(),
+                                         data_,
+                                         query.defense));
       return Status(SUCCESS);
     }
     
+    DataSet *data_;
+    BasicNodePool<Key> pool_;
+    // Scratch table that groups nodes by signature, reused (without
+    // freeing) by ClassifyArmors().
+    SignatureMap<std::vector<int>, Key> groups_;
+    // Scratch tables of the MergeForests() workers, which group pairs.
+    std::vector<SignatureMap<std::vector<size_t>, Key> > merge_groups_;
+    // Scratch list of the ANDs of a group, see MergeForests().
+    std::vector<int> merge_ands_;
+    // Number of hardware threads, which bounds the workers of
+    // MergeForests(), ApplyParallelStages() and the precomputation of
+    // the hole clients. A worker of ApplyParallelStages() only gets its
+    // share of them.
+    int threads_;
+    // The threads of MergeForests() and of the precomputation of the
+    // hole clients, reused by every merge and every wave.
+    WorkerPool worker_pool_;
+    // The order Foundation() merged the parts in.
+    std::array<int, PART_NUM> merge_order_;
+    // The skills of each stage after the foundation, see SplitPlan().
+    std::vector<int> split_plan_;
+    // Hole clients shared across queries.
+    HoleClientCache<Key> hole_clients_;
+    // Jewel plans shared by the formatters of every query.
+    JewelPlanCache<Key> plans_;
+    // Indexed by effect id, see StageScratch().
+    std::vector<std::unique_ptr<SplitScratch> > split_scratch_;
+    // The workers of ApplyParallelStages(), kept for the next queries.
+    std::vector<std::unique_ptr<ArmorUpEngine<Key> > > workers_;
+    // The first failure of the workers, which workers_failed_ tells
+    // without the lock.
+    mutable std::mutex workers_mutex_;
+    Status workers_status_;
+    std::atomic<bool> workers_failed_;
+    std::vector<std::unique_ptr<BasicTreeIterator<Key> > > iterators_;
+    std::vector<std::unique_ptr<BasicArmorSetIterator<Key> > > 
+    output_iterators_;
+  };
+
+  class ArmorUp {
+  public:
+    ArmorUp(const std::string &data_folder) 
+      : data_(data_folder), engines_(), node_budget_(0), 
+        status_(SUCCESS) {}
+
+    // Nodes that each query may create, or 0 for no limit. A query
+    // whose foundation does not fit has no results, and one that goes
+    // over after returns the results found until then. Either way
+    // status() is OVER_BUDGET.
+    void SetNodeBudget(size_t nodes) {
+      node_budget_ = nodes;
+      for (auto &engine : engines_) {
+        if (engine) engine->set_node_budget(nodes);
+      }
+    }
+
+    // The most nodes held at once by any engine so far.
+    size_t NodeHighWater() const {
+      size_t nodes = 0;
+      for (const auto &engine : engines_) {
+        if (engine) nodes = (std::max)(nodes, engine->NodeHighWater());
+      }
+      return nodes;
+    }
+
+    // The status of the last search. A query that no key layout can
+    // hold, or that fails on a worker, has no results.
+    Status status() const {
+      return status_;
+    }
+
+    void SearchCore(const Query &query) {
+      SearchEngine *engine = Engine(query);
+      if (nullptr != engine) status_ = engine->SearchCore(query);
+    }
+
+    template <OutputSpec Spec>
+    void Search(const Query &query, const std::string &output_path = "") {
+      // Optimize the Query
+      Query optimized_query = OptimizeQuery(query);
+
+      SearchEngine *engine = Engine(optimized_query);
+      if (nullptr == engine) return;
+      status_ = engine->SearchCore(optimized_query);
+      if (status_.Success()) {
+        engine->Format(Spec, optimized_query, output_path);
+        status_ = engine->CheckStatus();
+      }
+      engine->Release();
+    }
+
+    std::string SearchEncoded(const Query &query) {
+      // Optimize the Query
+      Query optimized_query = OptimizeQuery(query);
+
+      SearchEngine *engine = Engine(optimized_query);
+      if (nullptr == engine) return "";
+      std::string result;
+      status_ = engine->SearchCore(optimized_query);
+      if (status_.Success()) {
+        result = engine->Encode(optimized_query);
+        status_ = engine->CheckStatus();
+      }
+      engine->Release();
+      return result;
+    }
+
+    std::wstring SearchSerialized(const Query &query) {
+      // Optimize the Query
+      Query optimized_query = OptimizeQuery(query);
+
+      SearchEngine *engine = Engine(optimized_query);
+      if (nullptr == engine) return L"";
+      std::wstring result;
+      status_ = engine->SearchCore(optimized_query);
+      if (status_.Success()) {
+        result = engine->Serialize(optimized_query);
+        status_ = engine->CheckStatus();
+      }
+      engine->Release();
+      return result;
+    }
+
+    // Iterate is for speed test only.
+    void Iterate(const Query &input_query) {
+      // Optimize the Query
+      Query query = OptimizeQuery(input_query);
+
+      SearchEngine *engine = Engine(query);
+      if (nullptr != engine) engine->Iterate(query);
+    }
+    
+    // Tells for each skill not in the query whether adding it leaves
+    // any result. A skill whose query goes over the node budget is
+    // reported as such rather than failed, and status() is then
+    // OVER_BUDGET.
+    void Explore(const Query &input_query,
+                 const std::string output_path = "") {
+      Timer overall_timer;
+      overall_timer.Tic();
+      Timer timer;
+
+      ExploreFormatter formatter(output_path);
+      Status result(SUCCESS);
+      
+      for (int i = 1; i < data_.skill_systems().size(); ++i) {
+        timer.Tic();
+        if (input_query.HasSkill(i)) {
+          formatter.Push(i, false, false,
+                         data_.skill_system(i).name,
+                         timer.Toc());
+          continue;
+        }
+        
+        Query updated_query = input_query;
+        updated_query.effects.push_back({
+            i, data_.skill_system(i).LowestPositivePoints()});
+        Query query = OptimizeQuery(updated_query, false);
+        
+        SearchEngine *engine = Engine(query);
+        bool pass = false;
+        bool over_budget = false;
+        if (nullptr != engine) {
+          Status status = engine->Explore(query, &pass);
+          over_budget = OVER_BUDGET == status.name();
+          if (over_budget) result = status;
+        }
+
+        formatter.Push(i, pass, over_budget,
+                       data_.skill_system(i).name,
+                       timer.Toc());
+      }
+      status_ = result;
+      wprintf(L"Overall: %.4lf sec\n", overall_timer.Toc());
+    }
+
+    Query OptimizeQuery(const Query &query, bool verbose = true) {
+      std::vector<double> scores;
+      std::vector<int> indices;
+      for (int i = 0; i < query.effects.size(); ++i) {
+        const Effect &effect = query.effects[i];
+        indices.push_back(i);
+        scores.push_back(data_.EffectScore(effect));
+        if (verbose) {
+          wprintf(L"(%03d) %ls: %.5lf\n", 
+                  effect.skill_id,
+                  data_.skill_system(effect.skill_id).name.c_str(),
+                  scores.back());
+        }
+      }
+
+      std::sort(indices.begin(), indices.end(), 
+                [&scores](int a, int b) {
+                  return scores[a] < scores[b];
+                });
+      Query optimized = query;
+      optimized.effects.clear();
+      for (int i = 0; i < query.effects.size(); ++i) {
+        optimized.effects.push_back(query.effects[indices[i]]);
+      }
+      return optimized;
+    }
+
+    // Picks the smallest key layout that has a lane for every skill of
+    // the query, and whose lanes can not overflow on any combination
+    // of armors and jewels for it.
+    Status SelectLayout(const Query &query, KeyLayout *layout) const {
+      int skills = static_cast<int>(query.effects.size());
+      int points = PointsBound(query);
+      if (skills <= Signature::MAX_EFFECTS && 
+          points <= Signature::MAX_POINTS) {
+        *layout = SMALL_KEY;
+      } else if (skills <= LongSignature::MAX_EFFECTS && 
+                 points <= LongSignature::MAX_POINTS) {
+        *layout = LONG_KEY;
+      } else if (skills <= WideSignature::MAX_EFFECTS && 
+                 points <= WideSignature::MAX_POINTS) {
+        *layout = WIDE_KEY;
+      } else if (skills <= LongWideSignature::MAX_EFFECTS && 
+                 points <= LongWideSignature::MAX_POINTS) {
+        *layout = LONG_WIDE_KEY;
+      } else {
+        return Status(FAIL, "The query has more skills than any key "
+                      "layout can hold.");
+      }
+      return Status(SUCCESS);
+    }
+
+    void ListSkills() {
+      data_.PrintSkillSystems();
+    }
+
+    // ----- Debug -----
+    void Summarize() {
+      data_.Summarize();
+      for (int layout = SMALL_KEY; layout < KEY_LAYOUT_NUM; ++layout) {
+        if (engines_[layout]) engines_[layout]->Summarize();
+      }
+    } 
+
+  private:
+    // The engine of the layout picked by SelectLayout(), which is
+    // created on first use. Returns nullptr with status_ failed if no
+    // layout can hold the query.
+    SearchEngine *Engine(const Query &query) {
+      KeyLayout layout = SMALL_KEY;
+      status_ = SelectLayout(query, &layout);
+      if (!status_.Success()) return nullptr;
+      if (!engines_[layout]) {
+        switch (layout) {
+        case SMALL_KEY: 
+          engines_[layout].reset(new ArmorUpEngine<Signature>(&data_));
+          break;
+        case LONG_KEY: 
+          engines_[layout].reset(new ArmorUpEngine<LongSignature>(&data_));
+          break;
+        case WIDE_KEY: 
+          engines_[layout].reset(new ArmorUpEngine<WideSignature>(&data_));
+          break;
+        default:
+          engines_[layout].reset(
+              new ArmorUpEngine<LongWideSignature>(&data_));
+        }
+        engines_[layout]->set_node_budget(node_budget_);
+      }
+      return engines_[layout].get();
+    }
+
+    // An upper bound of the absolute points of any skill in any key
+    // created for the query: every part contributes the armor with
+    // the most points, and every slot the jewel with the most points
+    // per slot. The body and its slots count as many times as the
+    // largest torso up multiplier.
+    int PointsBound(const Query &query) const {
+      std::array<int, PART_NUM> holes;
+      std::array<bool, PART_NUM> torso_up;
+      holes.fill(0);
+      torso_up.fill(false);
+      std::vector<const Armor*> armors;
+      for (const Armor &armor : data_.armors()) armors.push_back(&armor);
+      for (const Armor &amulet : query.amulets) armors.push_back(&amulet);
+      for (const Armor *armor : armors) {
+        holes[armor->part] = (std::max)(holes[armor->part], armor->holes);
+        if (armor->TorsoUp()) torso_up[armor->part] = true;
+      }
+      int multiplier = 1;
+      int slots = 0;
+      for (int part = HEAD; part < PART_NUM; ++part) {
+        if (BODY != part) {
+          if (torso_up[part]) multiplier++;
+          slots += holes[part];
+        }
+      }
+      slots += multiplier * holes[BODY];
+
+      int result = 0;
+      for (const Effect &effect : query.effects) {
+        std::array<int, PART_NUM> armor_points;
+        armor_points.fill(0);
+        for (const Armor *armor : armors) {
+          for (const Effect &armor_effect : armor->effects) {
+            if (effect.skill_id == armor_effect.skill_id) {
+              armor_points[armor->part] = 
+                (std::max)(armor_points[armor->part], 
+                           std::abs(armor_effect.points));
+            }
+          }
+        }
+        int jewel_points = 0;
+        for (const Jewel &jewel : data_.jewels()) {
+          for (const Effect &jewel_effect : jewel.effects) {
+            if (effect.skill_id == jewel_effect.skill_id && 
+                0 < jewel.holes) {
+              // Rounded up points per slot.
+              jewel_points = 
+                (std::max)(jewel_points, 
+                           (std::abs(jewel_effect.points) + jewel.holes - 1) /
+                           jewel.holes);
+            }
+          }
+        }
+        int points = slots * jewel_points;
+        for (int part = HEAD; part < PART_NUM; ++part) {
+          points += (BODY == part ? multiplier : 1) * armor_points[part];
+        }
+        result = (std::max)(result, (std::max)(points, 
+                                               std::abs(effect.points)));
+      }
+      return result;
+    }
+    
     DataSet data_;
-    NodePool pool_;
-    std::vector<std::unique_ptr<TreeIterator> > iterators_;
-    std::vector<std::unique_ptr<ArmorSetIterator> > output_iterators_;
+    std::array<std::unique_ptr<SearchEngine>, KEY_LAYOUT_NUM> engines_;
+    size_t node_budget_;
+    Status status_;
   };
 }
 
 #endif  // _MONSTER_AVENGERS_ARMOR_UP_
-
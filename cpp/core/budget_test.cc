@@ -0,0 +1,90 @@
+#include <algorithm>
+
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "core/armor_up.h"
+#include "supp/search_lines.h"
+
+using namespace monster_avengers;
+
+// Checks that a query over the node budget stops building nodes: a
+// foundation that does not fit creates none of its merges, and the
+// stages after stop within a few nodes over. Either way the status is
+// OVER_BUDGET, and the results found are among those of the query
+// without a budget.
+//
+// Usage: budget_test [dataset folder]
+
+// Nodes that the stages after the foundation may add past the budget
+// before they stop: the AND and ORs of the split in progress.
+const size_t SLACK = 64;
+
+struct Outcome {
+  std::vector<std::string> lines;
+  Status status;
+  size_t high_water;
+};
+
+Outcome Search(const std::string &dataset, const std::wstring &text,
+               size_t budget) {
+  // A new engine, so that the high water is that of this query.
+  ArmorUp armor_up(dataset);
+  armor_up.SetNodeBudget(budget);
+  Status status(SUCCESS);
+  std::vector<std::string> lines = SearchLines(&armor_up, text, &status);
+  std::sort(lines.begin(), lines.end());
+  Outcome outcome{lines, status, armor_up.NodeHighWater()};
+  wprintf(L"budget %zu: high water %zu\n", budget, outcome.high_water);
+  return outcome;
+}
+
+int main(int argc, char **argv) {
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+  CHECK(2 <= argc);
+  const std::string dataset = argv[1];
+  const std::wstring all = L"(:max-results 100000)";
+
+  // Two skills, so the foundation makes all the nodes.
+  const std::wstring foundation = 
+    L"(:weapon-type \"melee\")"
+    L"(:weapon-holes 0)"
+    L"(:rare 8)"
+    L"(:max-rare 10)"
+    L"(:skill 5 20)"
+    L"(:skill 30 15)" + all;
+  Outcome full = Search(dataset, foundation, 0);
+  CHECK_SUCCESS(full.status);
+  CHECK(!full.lines.empty());
+  for (size_t budget : {full.high_water / 2, full.high_water / 8}) {
+    Outcome cut = Search(dataset, foundation, budget);
+    CHECK(OVER_BUDGET == cut.status.name());
+    CHECK(cut.lines.empty());
+    CHECK(cut.high_water <= budget);
+  }
+
+  // Two skill splitter stages after the foundation.
+  const std::wstring stages = 
+    L"(:weapon-type \"melee\")"
+    L"(:weapon-holes 3)"
+    L"(:rare 8)"
+    L"(:skill 51 10)"
+    L"(:skill 119 10)"
+    L"(:skill 47 10)"
+    L"(:skill 29 10)" + all;
+  full = Search(dataset, stages, 0);
+  CHECK_SUCCESS(full.status);
+  CHECK(!full.lines.empty());
+  for (const std::wstring &text : {stages, stages + L"(:parallel 2)"}) {
+    for (size_t budget : {full.high_water / 2, full.high_water / 8}) {
+      Outcome cut = Search(dataset, text, budget);
+      CHECK(OVER_BUDGET == cut.status.name());
+      CHECK(cut.lines.size() < full.lines.size());
+      CHECK(std::includes(full.lines.begin(), full.lines.end(),
+                          cut.lines.begin(), cut.lines.end()));
+      CHECK(cut.high_water <= budget + SLACK);
+    }
+  }
+
+  wprintf(L"PASS\n");
+  return 0;
+}
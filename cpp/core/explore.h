@@ -10,9 +10,10 @@
 
 namespace monster_avengers {
   
-  class CachedTreeIterator : public TreeIterator {
+  template <typename Key>
+  class CachedTreeIterator : public BasicTreeIterator<Key> {
   public:
-    explicit CachedTreeIterator(TreeIterator *base_iter) 
+    explicit CachedTreeIterator(BasicTreeIterator<Key> *base_iter) 
       : cache_(), current_(0) {
       while (!base_iter->empty()) {
         cache_.push_back(**base_iter);
@@ -20,74 +21,83 @@ namespace monster_avengers {
       }
     }
 
-    inline void operator++() override {
-      if (current_ < cache_.size()) current_++;
-    }
-
-    inline const TreeRoot &operator*() const override {
-      return cache_[current_];
+    size_t NextBatch(BasicTreeRoot<Key> *roots, size_t size) override {
+      size_t count = 0;
+      for (; count < size && current_ < cache_.size(); ++count) {
+        roots[count] = cache_[current_++];
+      }
+      return count;
     }
 
-    inline bool empty() const override {
-      return current_ >= cache_.size();
+    inline size_t size() const {
+      return cache_.size();
     }
 
-    inline void Reset() override {
+  protected:
+    void Rewind() override {
       current_ = 0;
     }
 
-    inline size_t size() const {
-      return cache_.size();
-    }
-
   private:
-    std::vector<TreeRoot> cache_;
+    std::vector<BasicTreeRoot<Key> > cache_;
     size_t current_;
   };
 
-  bool ExploreSkill(TreeIterator *iterator,
-                    const DataSet &data, 
-                    NodePool *pool, 
-                    int skill_id, 
-                    const std::vector<Effect> &previous_effects) {
+  // Tells in pass whether a tree of iterator, with its jewels, can
+  // also have the lowest positive points of skill_id. Fails if the pool
+  // goes over the budget before one is found.
+  template <typename Key>
+  Status ExploreSkill(BasicTreeIterator<Key> *iterator,
+                      const DataSet &data, 
+                      BasicNodePool<Key> *pool, 
+                      int skill_id, 
+                      const std::vector<Effect> &previous_effects,
+                      bool *pass) {
+    *pass = false;
     std::vector<Effect> effects = previous_effects;
     effects.emplace_back(skill_id, 
                          data.skill_system(skill_id).LowestPositivePoints());
     int effect_id = effects.size() - 1;
     
     // Construct the hole client
-    HoleClient hole_client(data, skill_id, effects);
+    BasicHoleClient<Key> hole_client(data, skill_id, effects);
 
     // Construct the splitter.
-    SkillSplitter splitter(data, pool, effect_id, skill_id);
+    SplitScratch scratch;
+    BasicSkillSplitter<Key> splitter(data, pool, effect_id, skill_id, 
+                                     &scratch);
 
-    Signature inverse_points(sig::InverseKey(effects.begin(), 
-                                             effects.end()));
+    Key inverse_points(sig::InverseKey<Key>(effects.begin(), 
+                                            effects.end()));
 
     int one(0), two(0), three(0), body_holes(0);
+    std::vector<uint64_t> survivors;
     
     iterator->Reset();
     while (!iterator->empty()) {
-      const TreeRoot &root = **iterator;
-      const OR &node = pool->Or(root.id);
+      const BasicTreeRoot<Key> &root = **iterator;
       int sub_max = splitter.Max(root);
-      Signature key0 = sig::AddPoints(node.key, effect_id, sub_max);
+      if (pool->OverBudget()) return BudgetStatus();
+      const Key root_key = pool->Or(root.id).key;
+      Key key0 = sig::AddPoints(root_key, effect_id, sub_max);
       
-      for (const Signature &jewel_key : root.jewel_keys) {
-        HoleClient::GetResidual(node.key, jewel_key,
-                                &one, &two, &three, &body_holes);
-        for (const Signature &new_key : 
-               hole_client.Query(one, two, three, 
-                                 body_holes, root.torso_multiplier)) {
-          Signature key1 = jewel_key + new_key;
-          if (sig::Satisfy(key0 | key1, inverse_points)) {
-            return true;
+      for (const Key &jewel_key : root.jewel_keys) {
+        BasicHoleClient<Key>::GetResidual(root_key, jewel_key,
+                                          &one, &two, &three, &body_holes);
+        sig::SatisfyBatch(key0 + jewel_key,
+                          hole_client.Query(one, two, three, body_holes,
+                                            root.torso_multiplier),
+                          inverse_points, &survivors);
+        for (uint64_t word : survivors) {
+          if (0 != word) {
+            *pass = true;
+            return Status(SUCCESS);
           }
         }
       }
       ++(*iterator);
     }
-    return false;
+    return Status(SUCCESS);
   }
   
 }  // namespace monster_avengers
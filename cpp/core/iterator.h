@@ -8,71 +8,222 @@
 
 namespace monster_avengers {
 
-  class TreeIterator {
+  // A stage of the search, which makes the roots of its trees in
+  // batches through NextBatch(). The stages read the roots of their
+  // base in batches of about as many as they are asked for, and the
+  // expansion, which makes many armor sets of a root, asks for batches
+  // that double from 1 to BATCH roots. So the first armor sets come
+  // without making the stages run ahead, and the rest with one virtual
+  // call per stage and batch.
+  //
+  // operator*() and operator++() read the roots one at a time, through
+  // batches that double from 1 to BATCH roots too.
+  template <typename Key>
+  class BasicTreeIterator {
   public:
-    virtual void operator++() = 0;
-    virtual const TreeRoot &operator*() const = 0;
-    virtual bool empty() const = 0;
-    virtual void Reset() = 0;
+    // Roots read from NextBatch() at once.
+    static const size_t BATCH = 16;
+
+    BasicTreeIterator() 
+      : batch_(BATCH, BasicTreeRoot<Key>(-1)), size_(0), current_(0),
+        wanted_(1), done_(false) {}
+
+    virtual ~BasicTreeIterator() {}
+
+    // Writes the next roots over roots[0, size), and returns how many
+    // it wrote, which is less than size only once there are no more.
+    virtual size_t NextBatch(BasicTreeRoot<Key> *roots, size_t size) = 0;
+
+    inline void operator++() {
+      Fill();
+      if (current_ < size_) current_++;
+    }
+
+    inline const BasicTreeRoot<Key> &operator*() {
+      Fill();
+      return batch_[current_];
+    }
+
+    inline bool empty() {
+      Fill();
+      return current_ >= size_;
+    }
+
+    // Starts over from the first root, for the stages that can.
+    inline void Reset() {
+      Rewind();
+      size_ = 0;
+      current_ = 0;
+      wanted_ = 1;
+      done_ = false;
+    }
+
+  protected:
+    virtual void Rewind() {}
+
+  private:
+    inline void Fill() {
+      if (current_ < size_ || done_) return;
+      size_ = NextBatch(batch_.data(), wanted_);
+      current_ = 0;
+      done_ = size_ < wanted_;
+      wanted_ = (std::min)(2 * wanted_, batch_.size());
+    }
+
+    std::vector<BasicTreeRoot<Key> > batch_;
+    size_t size_;
+    size_t current_;
+    size_t wanted_;
+    bool done_;
   };
 
-  class ArmorSetIterator {
+  typedef BasicTreeIterator<Signature> TreeIterator;
+
+  // The armor set counterpart of BasicTreeIterator. BaseIndex() is the
+  // OR id of the root that the armor set comes from.
+  template <typename Key>
+  class BasicArmorSetIterator {
   public:
-    virtual void operator++() = 0;
-    virtual const ArmorSet& operator*() const = 0;
-    virtual bool empty() const = 0;
-    virtual int BaseIndex() const = 0;
-    // virtual void Reset() = 0;
+    // Armor sets read from NextBatch() at once.
+    static const size_t BATCH = 16;
+
+    BasicArmorSetIterator() 
+      : batch_(BATCH), base_indices_(BATCH, -1), size_(0), current_(0),
+        wanted_(1), done_(false) {}
+
+    virtual ~BasicArmorSetIterator() {}
+
+    // Writes the next armor sets over sets[0, size) and the OR ids of
+    // their roots over base_indices[0, size), and returns how many it
+    // wrote, which is less than size only once there are no more.
+    virtual size_t NextBatch(BasicArmorSet<Key> *sets, int *base_indices,
+                             size_t size) = 0;
+
+    inline void operator++() {
+      Fill();
+      if (current_ < size_) current_++;
+    }
+
+    inline const BasicArmorSet<Key> &operator*() {
+      Fill();
+      return batch_[current_];
+    }
+
+    inline bool empty() {
+      Fill();
+      return current_ >= size_;
+    }
+
+    inline int BaseIndex() {
+      Fill();
+      return base_indices_[current_];
+    }
+
+  private:
+    inline void Fill() {
+      if (current_ < size_ || done_) return;
+      size_ = NextBatch(batch_.data(), base_indices_.data(), wanted_);
+      current_ = 0;
+      done_ = size_ < wanted_;
+      wanted_ = (std::min)(2 * wanted_, batch_.size());
+    }
+
+    std::vector<BasicArmorSet<Key> > batch_;
+    std::vector<int> base_indices_;
+    size_t size_;
+    size_t current_;
+    size_t wanted_;
+    bool done_;
   };
+
+  typedef BasicArmorSetIterator<Signature> ArmorSetIterator;
   
-  class ExpansionIterator : public ArmorSetIterator {
+  template <typename Key>
+  class BasicExpansionIterator : public BasicArmorSetIterator<Key> {
   public:
-    ExpansionIterator(TreeIterator *base_iter, 
-                     const NodePool *pool)
-      : base_iter_(base_iter), pool_(pool), top_(-1) {
-      if (!base_iter_->empty()) {
-        int or_id = (**base_iter).id;
-        armor_set_.jewel_keys = (**base_iter).jewel_keys;
-        while (-1 != or_id) {
-          const OR &or_node = pool_->Or(or_id);
-          if (ANDS == or_node.tag) {
-            const AND &and_node = pool_->And(or_node.daughters[0]);
-            top_++;
-            stack_[top_].or_id = or_id;
-            stack_[top_].and_id = 0;
-            stack_[top_].armor_or_id = and_node.left;
-            stack_[top_].armor_seq = 0;
-            armor_set_.ids[top_] = pool_->Or(and_node.left).daughters[0];
-            or_id = and_node.right;
-          } else {
-            top_++;
-            stack_[top_].or_id = -1;
-            stack_[top_].and_id = -1;
-            stack_[top_].armor_or_id = or_id;
-            stack_[top_].armor_seq = 0;
-            armor_set_.ids[top_] = pool_->Or(or_id).daughters[0];
-            or_id = -1;
-          }
-        }
+    typedef BasicOR<Key> OR;
+    typedef BasicAND<Key> AND;
+
+    // slots[depth] is where the armor at depth of the tree goes in the
+    // armor set. The default suits the tree merged in part order, which
+    // has the last part at depth 0. The roots are expanded as they are
+    // reached, see BasicNodePool::Expand(), until the pool goes over
+    // the budget.
+    BasicExpansionIterator(BasicTreeIterator<Key> *base_iter, 
+                           BasicNodePool<Key> *pool,
+                           const std::array<int, PART_NUM> &slots = 
+                           DepthSlots())
+      : base_iter_(base_iter), pool_(pool), slots_(slots), top_(-1),
+        roots_(BasicTreeIterator<Key>::BATCH, BasicTreeRoot<Key>(-1)),
+        root_size_(0), root_(0), wanted_(1), roots_done_(false), 
+        root_id_(-1) {}
+
+    size_t NextBatch(BasicArmorSet<Key> *sets, int *base_indices,
+                     size_t size) override {
+      size_t count = 0;
+      while (count < size && (0 <= top_ || Descend())) {
+        sets[count].ids = armor_set_.ids;
+        sets[count].jewel_keys = armor_set_.jewel_keys;
+        base_indices[count] = root_id_;
+        count++;
+        Advance();
       }
+      return count;
     }
 
-    void operator++() override {
-      if (-1 >= top_) return;
+    static std::array<int, PART_NUM> DepthSlots() {
+      std::array<int, PART_NUM> slots;
+      for (int depth = 0; depth < PART_NUM; ++depth) {
+        slots[depth] = depth;
+      }
+      return slots;
+    }
+    
+  private:
+    // Moves to the first armor set of the next root, and returns false
+    // if there are no more. A root has many armor sets, so the roots
+    // are read in batches that double from 1 to BATCH, which keeps the
+    // stages below from running ahead for the first armor sets.
+    bool Descend() {
+      if (root_ >= root_size_) {
+        if (roots_done_) return false;
+        root_size_ = base_iter_->NextBatch(roots_.data(), wanted_);
+        root_ = 0;
+        roots_done_ = root_size_ < wanted_;
+        wanted_ = (std::min)(2 * wanted_, roots_.size());
+        if (0 == root_size_) return false;
+      }
+      const BasicTreeRoot<Key> &root = roots_[root_++];
+      int or_id = pool_->Expand(root.id);
+      if (-1 == or_id) {
+        // The pool went over the budget, which ends the armor sets.
+        roots_done_ = true;
+        root_ = root_size_;
+        return false;
+      }
+      root_id_ = root.id;
+      armor_set_.jewel_keys = root.jewel_keys;
+      Push(or_id);
+      return true;
+    }
+
+    // Moves to the next armor set of the tree, and leaves top_ at -1
+    // after the last.
+    void Advance() {
       {
         const OR &armor_or = pool_->Or(stack_[top_].armor_or_id);
         if ((++stack_[top_].armor_seq) < armor_or.daughters.size()) {
-          armor_set_.ids[top_] = armor_or.daughters[stack_[top_].armor_seq];
+          armor_set_.ids[slots_[top_]] = armor_or.daughters[stack_[top_].armor_seq];
           return;
         } 
       }
       
       top_--;
-      int or_id = stack_[top_].or_id;
+      int or_id = -1;
       while (0 <= top_) {
         const OR &armor_or = pool_->Or(stack_[top_].armor_or_id);
         if ((++stack_[top_].armor_seq) < armor_or.daughters.size()) {
-          armor_set_.ids[top_] = armor_or.daughters[stack_[top_].armor_seq];
+          armor_set_.ids[slots_[top_]] = armor_or.daughters[stack_[top_].armor_seq];
           or_id = pool_->OrAnd(stack_[top_].or_id, stack_[top_].and_id).right;
           break;
         }
@@ -82,27 +233,17 @@ namespace monster_avengers {
             pool_->OrAnd(stack_[top_].or_id, stack_[top_].and_id);
           stack_[top_].armor_or_id = and_node.left;
           stack_[top_].armor_seq = 0;
-          armor_set_.ids[top_] = pool_->Or(and_node.left).daughters[0];
+          armor_set_.ids[slots_[top_]] = pool_->Or(and_node.left).daughters[0];
           or_id = and_node.right;
           break;
         }
         top_--;
       }
-      
-      if (-1 >= top_) {
-        if (!base_iter_->empty()) {
-          ++(*base_iter_);
-          if (!base_iter_->empty()) {
-            or_id = (**base_iter_).id;
-            armor_set_.jewel_keys = (**base_iter_).jewel_keys;
-          } else {
-            or_id = -1;
-          }
-        } else {
-          or_id = -1;
-        }
-      }
-      
+      Push(or_id);
+    }
+
+    // Descends from or_id to its first armor set.
+    void Push(int or_id) {
       while (-1 != or_id) {
         const OR &or_node = pool_->Or(or_id);
         if (ANDS == or_node.tag) {
@@ -112,7 +253,7 @@ namespace monster_avengers {
           stack_[top_].and_id = 0;
           stack_[top_].armor_or_id = and_node.left;
           stack_[top_].armor_seq = 0;
-          armor_set_.ids[top_] = pool_->Or(and_node.left).daughters[0];
+          armor_set_.ids[slots_[top_]] = pool_->Or(and_node.left).daughters[0];
           or_id = and_node.right;
         } else {
           top_++;
@@ -120,27 +261,12 @@ namespace monster_avengers {
           stack_[top_].and_id = -1;
           stack_[top_].armor_or_id = or_id;
           stack_[top_].armor_seq = 0;
-          armor_set_.ids[top_] = pool_->Or(or_id).daughters[0];
+          armor_set_.ids[slots_[top_]] = pool_->Or(or_id).daughters[0];
           or_id = -1;
         }
       }
-      
-      return;
     }
 
-    inline const ArmorSet& operator*() const override {
-      return armor_set_;
-    }
-
-    inline bool empty() const override {
-      return -1 >= top_;
-    }
-
-    inline int BaseIndex() const override {
-      return (**base_iter_).id;
-    }
-    
-  private:
     struct StackElement {
       int or_id;
       int and_id;
@@ -148,12 +274,23 @@ namespace monster_avengers {
       int armor_seq;
     };
     
-    TreeIterator *base_iter_;
-    const NodePool *pool_;
+    BasicTreeIterator<Key> *base_iter_;
+    BasicNodePool<Key> *pool_;
+    std::array<int, PART_NUM> slots_;
     std::array<StackElement, PART_NUM> stack_;
     int top_;
-    ArmorSet armor_set_;
+    BasicArmorSet<Key> armor_set_;
+    // The roots read from the base, of which [root_, root_size_) are
+    // not expanded yet.
+    std::vector<BasicTreeRoot<Key> > roots_;
+    size_t root_size_;
+    size_t root_;
+    size_t wanted_;
+    bool roots_done_;
+    int root_id_;
   };
+
+  typedef BasicExpansionIterator<Signature> ExpansionIterator;
 }
 
 #endif  // _MONSTER_AVENGERS_ITERATOR_
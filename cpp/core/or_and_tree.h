@@ -4,59 +4,289 @@
 #include <algorithm>
 #include <vector>
 #include <array>
+#include <limits>
 #include <unordered_map>
 #include "data/data_set.h"
 #include "utils/jewels_query.h"
+#include "utils/key_arena.h"
 
 namespace monster_avengers {
   
   enum ORTag {
     ANDS = 0,
-    ARMORS
+    ARMORS,
+    // Stands for a split of another OR that is only built when needed,
+    // see BasicNodePool::MakeLazy().
+    LAZY
   };
 
-  struct OR {
-    Signature key;
-    ORTag tag;
+  template <typename Key>
+  class BasicSkillSplitter;
+
+  // The memory of a BasicSkillSplitter. Every stage keeps one for the
+  // splitters it makes, so that a warm stage splits without heap
+  // allocation. A splitter starts by emptying it.
+  struct SplitScratch {
+    // The most skills that a splitter splits by at once.
+    static const int MAX_SKILLS = 4;
+
+    // Points of each skill of a splitter.
+    typedef std::array<int, MAX_SKILLS> Points;
+
+    // The fewest and the most points of each skill under an OR.
+    struct Range {
+      Points min;
+      Points max;
+    };
+
+    // The memo entry of an OR. The range only holds for the multiplier
+    // it was computed with if there is a body armor below the OR.
+    // window is where the split memo of the OR starts in windows, or
+    // -1 before it is needed. next is the entry of the OR for another
+    // multiplier in body_entries, or -1.
+    struct Entry {
+      Range range;
+      int multiplier;
+      int window;
+      int next;
+    };
+
+    SplitScratch() 
+      : armor_points(), is_body(), entries(), body_entries(), windows(), 
+        daughters(), lazy_ors() {}
+
+    inline void Clear() {
+      entries.clear();
+      body_entries.clear();
+      windows.clear();
+      daughters.clear();
+      lazy_ors.clear();
+    }
+
+    // The points of each skill of every armor, MAX_SKILLS per armor,
+    // and whether it is a body armor.
+    std::vector<int> armor_points;
+    std::vector<bool> is_body;
+    // Indexed by OR id.
+    std::vector<Entry> entries;
+    // The entries of the ORs with a body armor below them for the
+    // multipliers after the first, so that roots with different torso
+    // multipliers do not evict each other.
+    std::vector<Entry> body_entries;
+    // The split memo of the ORs, one slot per points in their range.
+    std::vector<int> windows;
+    // The daughters of the ORs being split, with those of the deeper
+    // ORs on top.
     std::vector<int> daughters;
+    // The result of Split().
+    std::vector<int> lazy_ors;
+  };
+
+  // The daughters of an OR node, which stay where they are until the
+  // node is discarded.
+  class DaughterList {
+  public:
+    DaughterList(const int *begin, int size) : begin_(begin), size_(size) {}
+
+    inline const int *begin() const {
+      return begin_;
+    }
+
+    inline const int *end() const {
+      return begin_ + size_;
+    }
+
+    inline int size() const {
+      return size_;
+    }
+
+    inline bool empty() const {
+      return 0 == size_;
+    }
 
-    OR() = default;
-      
-    OR(Signature key_, ORTag tag_, 
-       std::vector<int> *daughters_) :
-      key(key_),
-      tag(tag_) {
-      daughters.swap(*daughters_);
+    inline int operator[](int i) const {
+      return begin_[i];
     }
+
+  private:
+    const int *begin_;
+    int size_;
+  };
+
+  // An OR node as seen through BasicNodePool::Or(). The key is a copy,
+  // so it stays valid while nodes are added, and so do the daughters.
+  template <typename Key>
+  struct BasicOR {
+    Key key;
+    ORTag tag;
+    DaughterList daughters;
   };
 
-  struct AND {
-    Signature key;
+  typedef BasicOR<Signature> OR;
+
+  template <typename Key>
+  struct BasicAND {
     int left;
     int right;
 
-    AND() = default;
+    BasicAND() = default;
     
-    AND(int left_, int right_) 
+    BasicAND(int left_, int right_) 
       : left(left_), right(right_) {}
   };
 
-  class NodePool {
+  typedef BasicAND<Signature> AND;
+
+  // The OR and AND nodes of all the trees, whose keys are of the
+  // BasicSignature layout Key.
+  //
+  // The ORs are stored by field: keys, tags and daughter lists in
+  // parallel arrays, with all the daughters in one arena. The arena is
+  // made of blocks that are never reallocated, so the daughters of a
+  // node do not move while nodes are added. The pool also holds the
+  // jewel keys of the trees, see jewel_keys(). Snapshots truncate all
+  // of them and keep the memory for the nodes to come.
+  //
+  // A LAZY OR has the key of the split it stands for, and its
+  // daughters hold the record of the split. Expand() builds the split
+  // with the splitter of the stage that made the node.
+  template <typename Key>
+  class BasicNodePool {
   public:
+    typedef BasicOR<Key> OR;
+    typedef BasicAND<Key> AND;
+
+    // Daughters per arena block, unless a node has more.
+    static const size_t BLOCK_SIZE = 1 << 16;
+
     struct Snapshot {
-      Snapshot(size_t or_size_, size_t and_size_)
-        : or_size(or_size_), and_size(and_size_) {}
+      Snapshot(size_t or_size_, size_t and_size_, 
+               size_t block_, size_t block_size_, size_t expanded_,
+               size_t jewel_key_size_)
+        : or_size(or_size_), and_size(and_size_), 
+          block(block_), block_size(block_size_), expanded(expanded_),
+          jewel_key_size(jewel_key_size_) {}
       size_t or_size;
       size_t and_size;
+      size_t block;
+      size_t block_size;
+      size_t expanded;
+      size_t jewel_key_size;
     };
     
-    NodePool() : or_pool_(), and_pool_(), snapshots_() {}
+    BasicNodePool() 
+      : keys_(), tags_(), daughters_(), daughter_sizes_(), and_pool_(), 
+        blocks_(), block_(0), snapshots_(), budget_(0), 
+        or_high_water_(0), and_high_water_(0), node_high_water_(0),
+        intern_table_(), 
+        intern_size_(0), intern_hits_(0), splitters_(), expanded_(),
+        lazy_nodes_(0), lazy_expansions_(0), jewel_keys_() {}
     
-    // Returns the index of the newly created OR node.
+    // Returns the index of the newly created OR node. The daughters
+    // are copied, and the list is left empty.
+    template <ORTag Tag>
+    int MakeOR(Key key, std::vector<int> *daughters) {
+      int id = MakeOR<Tag>(key, daughters->data(), daughters->size());
+      daughters->clear();
+      return id;
+    }
+
     template <ORTag Tag>
-    int MakeOR(Signature key, std::vector<int> *daughters) {
-      or_pool_.emplace_back(key, Tag, daughters);
-      return or_pool_.size() - 1;
+    int MakeOR(Key key, const int *daughters, int size) {
+      keys_.push_back(key);
+      tags_.push_back(Tag);
+      daughters_.push_back(Allocate(daughters, size));
+      daughter_sizes_.push_back(size);
+      return keys_.size() - 1;
+    }
+
+    // Same as MakeOR(), but returns the existing node if one has the
+    // same tag, key and daughters.
+    template <ORTag Tag>
+    int InternOR(Key key, std::vector<int> *daughters) {
+      int id = InternOR<Tag>(key, daughters->data(), daughters->size());
+      daughters->clear();
+      return id;
+    }
+
+    template <ORTag Tag>
+    int InternOR(Key key, const int *daughters, int size) {
+      if (intern_table_.size() < 2 * (intern_size_ + 1)) {
+        Rehash((std::max)(static_cast<size_t>(1024), 
+                          intern_table_.size() * 2));
+      }
+      size_t mask = intern_table_.size() - 1;
+      size_t slot = InternHash(Tag, key, daughters, size) & mask;
+      while (-1 != intern_table_[slot]) {
+        int id = intern_table_[slot];
+        if (Tag == tags_[id] && key == keys_[id] && 
+            size == daughter_sizes_[id] &&
+            std::equal(daughters, daughters + size, daughters_[id])) {
+          intern_hits_++;
+          return id;
+        }
+        slot = (slot + 1) & mask;
+      }
+      int id = MakeOR<Tag>(key, daughters, size);
+      intern_table_[slot] = id;
+      intern_size_++;
+      return id;
+    }
+
+    // Number of InternOR() calls that found an existing node.
+    inline size_t InternHits() const {
+      return intern_hits_;
+    }
+
+    // Returns a LAZY OR with key that stands for the armor sets under
+    // source with exactly points[k] of the skill of effect_id + k, for
+    // each of the skills.
+    int MakeLazy(Key key, int source, int effect_id, int multiplier,
+                 const int *points, int skills) {
+      // The record is followed by the points. Its last field is the
+      // expansion, see Expand().
+      int record[LAZY_RECORD + SplitScratch::MAX_SKILLS] = 
+        {source, effect_id, multiplier, -1};
+      std::copy(points, points + skills, record + LAZY_RECORD);
+      lazy_nodes_++;
+      return MakeOR<LAZY>(key, record, LAZY_RECORD + skills);
+    }
+
+    // The OR that the LAZY OR id stands for, built on the first call.
+    // Other ORs stand for themselves. Returns -1 if the pool goes over
+    // the budget first, and the LAZY OR stays unexpanded.
+    int Expand(int id) {
+      if (LAZY != tags_[id]) return id;
+      // The record stays where it is while the split adds nodes.
+      int *record = daughters_[id];
+      if (-1 != record[3]) return record[3];
+      CHECK(record[1] < static_cast<int>(splitters_.size()) && 
+            nullptr != splitters_[record[1]]);
+      record[3] = splitters_[record[1]]->Expand(record[0], 
+                                                record + LAZY_RECORD, 
+                                                record[2]);
+      if (-1 == record[3]) return -1;
+      expanded_.push_back(id);
+      lazy_expansions_++;
+      return record[3];
+    }
+
+    // The splitter that expands the LAZY ORs of effect_id, which has
+    // to outlive them or be unset before they are expanded.
+    void set_splitter(int effect_id, BasicSkillSplitter<Key> *splitter) {
+      if (splitters_.size() <= effect_id) {
+        splitters_.resize(effect_id + 1, nullptr);
+      }
+      splitters_[effect_id] = splitter;
+    }
+
+    // Number of LAZY ORs made, and of those expanded.
+    inline size_t LazyNodes() const {
+      return lazy_nodes_;
+    }
+
+    inline size_t LazyExpansions() const {
+      return lazy_expansions_;
     }
 
     int MakeAnd(int left, int right) {
@@ -64,273 +294,638 @@ namespace monster_avengers {
       return and_pool_.size() - 1;
     }
     
-    inline const OR &Or(int id) const {
-      return or_pool_[id];
+    inline OR Or(int id) const {
+      return OR{keys_[id], static_cast<ORTag>(tags_[id]), 
+          DaughterList(daughters_[id], daughter_sizes_[id])};
     }
 
     inline const AND &And(int id) const {
       return and_pool_[id];
     }
 
-    inline const OR &AndLeftOr(int and_id) const {
-      return or_pool_[and_pool_[and_id].left];
+    inline OR AndLeftOr(int and_id) const {
+      return Or(and_pool_[and_id].left);
     }
 
     inline const AND &OrAnd(int or_id, int and_id) const {
-      return and_pool_[or_pool_[or_id].daughters[and_id]];
+      return and_pool_[daughters_[or_id][and_id]];
     }
 
     inline size_t OrSize() const {
-      return or_pool_.size();
+      return keys_.size();
     }
 
     inline size_t AndSize() const {
       return and_pool_.size();
     }
 
+    // The most ORs and ANDs held at once.
+    inline size_t OrHighWater() const {
+      return (std::max)(or_high_water_, keys_.size());
+    }
+
+    inline size_t AndHighWater() const {
+      return (std::max)(and_high_water_, and_pool_.size());
+    }
+
+    // The most ORs and ANDs held at once, together.
+    inline size_t NodeHighWater() const {
+      return (std::max)(node_high_water_, keys_.size() + and_pool_.size());
+    }
+
+    // Nodes the pool may hold before OverBudget(), or 0 for no limit.
+    // The pool does not refuse nodes, so the builders check it as they
+    // go and stop within a few nodes over.
+    inline void set_budget(size_t nodes) {
+      budget_ = nodes;
+    }
+
+    inline size_t budget() const {
+      return budget_;
+    }
+
+    inline bool OverBudget() const {
+      return 0 < budget_ && keys_.size() + and_pool_.size() > budget_;
+    }
+
+    // Nodes that may still be added within the budget.
+    inline size_t NodesLeft() const {
+      if (0 == budget_) return std::numeric_limits<size_t>::max();
+      size_t nodes = keys_.size() + and_pool_.size();
+      return nodes < budget_ ? budget_ - nodes : 0;
+    }
+
+    // Bytes held by the pool, free capacity included.
+    size_t MemoryBytes() const {
+      size_t bytes = keys_.capacity() * sizeof(Key) + 
+        tags_.capacity() * sizeof(uint8_t) + 
+        daughters_.capacity() * sizeof(int *) + 
+        daughter_sizes_.capacity() * sizeof(int) + 
+        and_pool_.capacity() * sizeof(AND);
+      for (const std::vector<int> &block : blocks_) {
+        bytes += block.capacity() * sizeof(int);
+      }
+      return bytes;
+    }
+
     inline void PushSnapshot() {
-      snapshots_.emplace_back(or_pool_.size(), and_pool_.size());
+      snapshots_.emplace_back(keys_.size(), and_pool_.size(), block_, 
+                              blocks_.empty() ? 0 : blocks_[block_].size(),
+                              expanded_.size(), jewel_keys_.size());
     }
 
     inline void PopSnapshot() {
-      or_pool_.resize(snapshots_.back().or_size);
-      and_pool_.resize(snapshots_.back().and_size);
+      RestoreSnapshot();
       snapshots_.pop_back();
     }
     
     inline void RestoreSnapshot() {
-      or_pool_.resize(snapshots_.back().or_size);
-      and_pool_.resize(snapshots_.back().and_size);
+      const Snapshot &snapshot = snapshots_.back();
+      Truncate(snapshot.or_size, snapshot.and_size, snapshot.block, 
+               snapshot.block_size, snapshot.expanded);
+      jewel_keys_.Truncate(snapshot.jewel_key_size);
+    }
+
+    // Discards all the nodes and snapshots, and keeps the memory for
+    // the nodes to come.
+    inline void Clear() {
+      snapshots_.clear();
+      Truncate(0, 0, 0, 0, 0);
+      jewel_keys_.Clear();
+    }
+
+    // Replaces the nodes with copies of those of other, under the same
+    // ids. The LAZY ORs of other need its splitters, so it must have
+    // none. The jewel keys are not copied.
+    void CopyNodes(const BasicNodePool &other) {
+      Clear();
+      for (size_t id = 0; id < other.OrSize(); ++id) {
+        CHECK(LAZY != other.tags_[id]);
+        keys_.push_back(other.keys_[id]);
+        tags_.push_back(other.tags_[id]);
+        daughters_.push_back(Allocate(other.daughters_[id], 
+                                      other.daughter_sizes_[id]));
+        daughter_sizes_.push_back(other.daughter_sizes_[id]);
+      }
+      and_pool_.assign(other.and_pool_.begin(), other.and_pool_.end());
+    }
+
+    // The jewel keys of the trees made from the nodes, which go with
+    // the nodes on Clear() and RestoreSnapshot().
+    inline BasicKeyArena<Key> *jewel_keys() {
+      return &jewel_keys_;
+    }
+
+    inline const BasicKeyArena<Key> &jewel_keys() const {
+      return jewel_keys_;
     }
 
   private:
-    std::vector<OR> or_pool_;
+    // The fields of a LAZY OR before its points: source, effect id,
+    // multiplier and expansion.
+    static const int LAZY_RECORD = 4;
+
+    void Truncate(size_t or_size, size_t and_size, size_t block, 
+                  size_t block_size, size_t expanded) {
+      // The LAZY ORs expanded since may have kept the expansion.
+      for (size_t i = expanded; i < expanded_.size(); ++i) {
+        if (expanded_[i] < or_size) daughters_[expanded_[i]][3] = -1;
+      }
+      expanded_.resize(expanded);
+      or_high_water_ = OrHighWater();
+      and_high_water_ = AndHighWater();
+      node_high_water_ = NodeHighWater();
+      keys_.resize(or_size);
+      tags_.resize(or_size);
+      daughters_.resize(or_size);
+      daughter_sizes_.resize(or_size);
+      and_pool_.resize(and_size);
+      block_ = block;
+      if (!blocks_.empty()) blocks_[block_].resize(block_size);
+      // Forget the discarded nodes.
+      if (0 < intern_size_) Rehash(intern_table_.size());
+    }
+
+    inline uint64_t InternHash(ORTag tag, const Key &key, const int *daughters,
+                               size_t size) const {
+      uint64_t hash = sig::Hash(key) ^ (static_cast<uint64_t>(tag) << 63);
+      for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<uint32_t>(daughters[i])) * 
+          0x100000001b3ULL;
+      }
+      return hash ^ (hash >> 29);
+    }
+
+    // Rebuilds the intern table with the given number of slots, a
+    // power of 2, dropping the nodes that are gone.
+    void Rehash(size_t slots) {
+      std::vector<int> old_table(slots, -1);
+      old_table.swap(intern_table_);
+      intern_size_ = 0;
+      size_t mask = slots - 1;
+      for (int id : old_table) {
+        if (-1 == id || id >= keys_.size()) continue;
+        size_t slot = InternHash(static_cast<ORTag>(tags_[id]), keys_[id],
+                                 daughters_[id], daughter_sizes_[id]) & mask;
+        while (-1 != intern_table_[slot]) slot = (slot + 1) & mask;
+        intern_table_[slot] = id;
+        intern_size_++;
+      }
+    }
+
+    int *Allocate(const int *daughters, size_t size) {
+      if (blocks_.empty()) {
+        blocks_.emplace_back();
+        blocks_.back().reserve((std::max)(BLOCK_SIZE, size));
+      }
+      if (blocks_[block_].size() + size > blocks_[block_].capacity()) {
+        // Blocks after the current one only hold discarded nodes.
+        block_++;
+        if (blocks_.size() == block_) blocks_.emplace_back();
+        blocks_[block_].clear();
+        if (blocks_[block_].capacity() < size) {
+          std::vector<int>().swap(blocks_[block_]);
+        }
+        blocks_[block_].reserve((std::max)(BLOCK_SIZE, size));
+      }
+      std::vector<int> &block = blocks_[block_];
+      int *begin = block.data() + block.size();
+      block.insert(block.end(), daughters, daughters + size);
+      return begin;
+    }
+
+    std::vector<Key> keys_;
+    std::vector<uint8_t> tags_;
+    std::vector<int *> daughters_;
+    std::vector<int> daughter_sizes_;
     std::vector<AND> and_pool_;
+    std::vector<std::vector<int> > blocks_;
+    size_t block_;
     std::vector<Snapshot> snapshots_;
+    size_t budget_;
+    size_t or_high_water_;
+    size_t and_high_water_;
+    size_t node_high_water_;
+    // Open addressing table of the ORs made by InternOR().
+    std::vector<int> intern_table_;
+    size_t intern_size_;
+    size_t intern_hits_;
+    // Indexed by effect id.
+    std::vector<BasicSkillSplitter<Key> *> splitters_;
+    // The LAZY ORs in the order they were expanded.
+    std::vector<int> expanded_;
+    size_t lazy_nodes_;
+    size_t lazy_expansions_;
+    BasicKeyArena<Key> jewel_keys_;
   };
+
+  template <typename Key>
+  const size_t BasicNodePool<Key>::BLOCK_SIZE;
+
+  typedef BasicNodePool<Signature> NodePool;
+
+  // The status of a query whose pool went over the budget.
+  inline Status BudgetStatus() {
+    return Status(OVER_BUDGET, "The query went over the node budget.");
+  }
   
-  struct TreeRoot {
+  template <typename Key>
+  struct BasicTreeRoot {
     int id; // OR node id
-    std::vector<Signature> jewel_keys;
+    BasicKeyList<Key> jewel_keys;
     int torso_multiplier;
     
-    TreeRoot(int id_) : id(id_), jewel_keys(), torso_multiplier(1) {}
-    TreeRoot(int id_, const OR &node) : 
+    BasicTreeRoot(int id_) : id(id_), jewel_keys(), torso_multiplier(1) {}
+    BasicTreeRoot(int id_, const BasicOR<Key> &node) : 
       id(id_), jewel_keys(), 
       torso_multiplier(node.key.multiplier()) {}
   };
 
-  struct TempOr {
-    int id;
-    int points;
-
-    TempOr(int id_, int points_) 
-      : id(id_), points(points_) {}
-  };
+  typedef BasicTreeRoot<Signature> TreeRoot;
 
-  class SkillSplitter {
+  // Splits the trees of a stage by the points of the skills of the
+  // stage, which are those of a run of effects. Split() only finds the
+  // points that the armor sets of a tree can have, and leaves a LAZY OR
+  // for each. The pool expands them through Expand() when they are
+  // descended into.
+  template <typename Key>
+  class BasicSkillSplitter {
   public:
-    SkillSplitter(const DataSet &data,
-                  NodePool *pool,
-                  int effect_id,
-                  int skill_id) 
-      : pool_(pool), effect_id_(effect_id) {
-      armor_points_.resize(data.armors().size());
-      is_body_.resize(data.armors().size());
+    typedef BasicOR<Key> OR;
+    typedef BasicAND<Key> AND;
+    typedef SplitScratch::Points Points;
+    typedef SplitScratch::Range Range;
+
+    BasicSkillSplitter(const DataSet &data,
+                       BasicNodePool<Key> *pool,
+                       int effect_id,
+                       int skill_id,
+                       SplitScratch *scratch) 
+      : pool_(pool), effect_id_(effect_id), skills_(1), scratch_(scratch),
+        armor_points_(scratch->armor_points), is_body_(scratch->is_body) {
+      Initialize(data, &skill_id);
+    }
+
+    // Splits by the skills of effects[effect_id, effect_id + skills).
+    BasicSkillSplitter(const DataSet &data,
+                       BasicNodePool<Key> *pool,
+                       const std::vector<Effect> &effects,
+                       int effect_id,
+                       int skills,
+                       SplitScratch *scratch) 
+      : pool_(pool), effect_id_(effect_id), skills_(skills), 
+        scratch_(scratch), armor_points_(scratch->armor_points), 
+        is_body_(scratch->is_body) {
+      CHECK(0 < skills && skills <= SplitScratch::MAX_SKILLS);
+      int skill_ids[SplitScratch::MAX_SKILLS];
+      for (int k = 0; k < skills_; ++k) {
+        skill_ids[k] = effects[effect_id + k].skill_id;
+      }
+      Initialize(data, skill_ids);
+    }
+
+    // The most points of the first skill that the armor sets of root
+    // can have.
+    inline int Max(const BasicTreeRoot<Key> &root) {
+      return Bounds(root).max[0];
+    }
+
+    // The fewest and the most points of each skill that the armor sets
+    // of root can have. Subtrees shared by several roots are only
+    // visited once, see RangeOr().
+    // The range is empty if the pool went over the budget.
+    inline Range Bounds(const BasicTreeRoot<Key> &root) {
+      int source = pool_->Expand(root.id);
+      if (-1 == source) return EmptyRange();
+      bool body = false;
+      return RangeOr(source, root.torso_multiplier, &body);
+    }
+
+    // Returns a LAZY OR for each points of at least sub_min that the
+    // armor sets of root can have, in the order of the points of the
+    // first skill. With accept, only the splits whose key it accepts
+    // are kept. The list is valid until the next call, and stops short
+    // if the pool goes over the budget.
+    inline const std::vector<int> &Split(const BasicTreeRoot<Key> &root, 
+                                         int sub_min) {
+      Points sub_mins;
+      sub_mins.fill(sub_min);
+      return Split(root, sub_mins, [](const Key &key) { return true; });
+    }
+
+    template <typename Accept>
+    const std::vector<int> &Split(const BasicTreeRoot<Key> &root, 
+                                  const Points &sub_min, Accept accept) {
+      std::vector<int> &result = scratch_->lazy_ors;
+      result.clear();
+      int source = pool_->Expand(root.id);
+      if (-1 == source) return result;
+      int multiplier = root.torso_multiplier;
+      bool body = false;
+      Range range = RangeOr(source, multiplier, &body);
+      for (int k = 0; k < skills_; ++k) {
+        range.min[k] = (std::max)(range.min[k], sub_min[k]);
+      }
+      int size = Volume(range);
+      Points points;
+      for (int index = 0; index < size && !pool_->OverBudget(); ++index) {
+        Decode(range, index, &points);
+        if (!Reachable(source, points, multiplier)) continue;
+        Key key = pool_->Or(source).key;
+        for (int k = 0; k < skills_; ++k) {
+          key = sig::AddPoints(key, effect_id_ + k, points[k]);
+        }
+        if (!accept(key)) continue;
+        result.push_back(pool_->MakeLazy(key, source, effect_id_, 
+                                         multiplier, points.data(), 
+                                         skills_));
+      }
+      return result;
+    }
+
+    // The OR of the armor sets under source with exactly the points,
+    // as promised by Split(), or -1 if the pool went over the budget.
+    inline int Expand(int source, const int *points, int multiplier) {
+      Points target;
+      std::copy(points, points + skills_, target.begin());
+      int id = SplitOr(source, target, multiplier);
+      CHECK(-1 != id || pool_->OverBudget());
+      return id;
+    }
+    
+  private:
+    typedef SplitScratch::Entry Entry;
+
+    static const int UNSET = -2;
+    static const int ANY_MULTIPLIER = -1;
+    // The states of a split memo slot besides the OR of the split, or
+    // -1 if it is empty.
+    static const int UNKNOWN = -3;
+    static const int UNBUILT = -2;
+
+    void Initialize(const DataSet &data, const int *skill_ids) {
+      scratch_->Clear();
+      armor_points_.assign(data.armors().size() * SplitScratch::MAX_SKILLS,
+                           0);
+      is_body_.assign(data.armors().size(), false);
       int i = 0;
       for (const Armor &armor : data.armors()) {
-        armor_points_[i] = 0;
         is_body_[i] = armor.part == BODY;
-        for (const Effect &effect : armor.effects) {
-          if (effect.skill_id == skill_id) {
-            armor_points_[i] = effect.points;
-            break;
+        for (int k = 0; k < skills_; ++k) {
+          for (const Effect &effect : armor.effects) {
+            if (effect.skill_id == skill_ids[k]) {
+              armor_points_[i * SplitScratch::MAX_SKILLS + k] = 
+                effect.points;
+              break;
+            }
           }
         }
         i++;
       }
     }
 
-    inline int Max(const TreeRoot &root) const {
-      return MaxOr(root.id, root.torso_multiplier);
+    inline int ArmorPoints(int armor_id, int multiplier, int k) const {
+      int points = armor_points_[armor_id * SplitScratch::MAX_SKILLS + k];
+      if (is_body_[armor_id] && multiplier > 1) {
+        points *= multiplier;
+      }
+      return points;
     }
 
-    inline std::vector<int> Split(const TreeRoot &root, int sub_min) {
-      std::vector<TempOr> temp_ors;
-      std::vector<int> result;
-      SplitOr(root.id, sub_min, &temp_ors, 
-              root.torso_multiplier);
-      for (TempOr &item : temp_ors) {
-        result.push_back(item.id);
+    inline bool HasPoints(int armor_id, int multiplier, 
+                          const Points &points) const {
+      for (int k = 0; k < skills_; ++k) {
+        if (ArmorPoints(armor_id, multiplier, k) != points[k]) return false;
       }
-      return result;
+      return true;
     }
-    
-  private:
-    typedef std::unordered_map<int, std::vector<int> > PointsIdListMap;
-    
-    int MaxArmorOr(int or_id, int multiplier) const {
-      int result = -1000;
-      for (int armor_id : pool_->Or(or_id).daughters) {
-        int points = armor_points_[armor_id];
-        if (is_body_[armor_id] && multiplier > 1) {
-          points *= multiplier;
-        }
-        if (points > result) {
-          result = points;
-        }
+
+    // The number of points in range, 0 if it is empty.
+    inline int Volume(const Range &range) const {
+      int size = 1;
+      for (int k = 0; k < skills_; ++k) {
+        if (range.max[k] < range.min[k]) return 0;
+        size *= range.max[k] - range.min[k] + 1;
       }
-      return result;
+      return size;
     }
 
-    int MaxAnd(int and_id, int multiplier) const {
-      const AND &node = pool_->And(and_id);
-      const OR &right_node = pool_->Or(node.right);
-      return MaxArmorOr(node.left, multiplier) + 
-        (ANDS == right_node.tag ? MaxOr(node.right, multiplier) : 
-         MaxArmorOr(node.right, multiplier));
+    // The range of no points, which any other range widens.
+    static inline Range EmptyRange() {
+      Range range;
+      range.min.fill(1000);
+      range.max.fill(-1000);
+      return range;
     }
-    
-    int MaxOr(int or_id, int multiplier) const {
-      int result = -1000;
-      for (int and_id : pool_->Or(or_id).daughters) {
-        int tmp = MaxAnd(and_id, multiplier);
-        if (tmp > result) {
-          result = tmp;
-        }
+
+    // The points at index of range, with the first skill the slowest.
+    inline void Decode(const Range &range, int index, Points *points) const {
+      for (int k = skills_ - 1; k >= 0; --k) {
+        int width = range.max[k] - range.min[k] + 1;
+        (*points)[k] = range.min[k] + index % width;
+        index /= width;
       }
-      return result;
     }
 
-    int SplitArmorOr(int or_id, PointsIdListMap *new_armors, 
-                     int multiplier) {
-      int result_max = -1000;
-      for (int armor_id : pool_->Or(or_id).daughters) {
-        int points = armor_points_[armor_id];
-        if (is_body_[armor_id] && multiplier > 1) {
-          points *= multiplier;
-        }
-        if (points > result_max) {
-          result_max = points;
-        }
-        auto it = new_armors->find(points);
-        if (new_armors->end() != it) {
-          it->second.push_back(armor_id);
-        } else {
-          (*new_armors)[points] = {armor_id};
-        }
+    // The entry of or_id for multiplier, or nullptr if there is none
+    // yet. The pointer is valid until the next entry is added.
+    inline Entry *FindEntry(int or_id, int multiplier) {
+      Entry *entry = &scratch_->entries[or_id];
+      if (UNSET == entry->multiplier) return nullptr;
+      while (ANY_MULTIPLIER != entry->multiplier && 
+             multiplier != entry->multiplier) {
+        if (-1 == entry->next) return nullptr;
+        entry = &scratch_->body_entries[entry->next];
       }
-      return result_max;
-    }
-
-    int SplitArmorOr(int or_id, std::vector<TempOr> *new_armors, 
-                     int sub_min, int multiplier) {
-      PointsIdListMap temp_map;
-      int result_max = -1000;
-      const OR &node = pool_->Or(or_id);
-      for (int armor_id : node.daughters) {
-        int points = armor_points_[armor_id];
-        if (is_body_[armor_id] && multiplier > 1) {
-          points *= multiplier;
-        }
-        if (points > result_max) {
-          result_max = points;
+      return entry;
+    }
+
+    inline void AddEntry(int or_id, const Range &range, int multiplier) {
+      Entry &head = scratch_->entries[or_id];
+      if (UNSET == head.multiplier) {
+        head = Entry{range, multiplier, -1, -1};
+        return;
+      }
+      scratch_->body_entries.push_back(Entry{range, multiplier, -1, 
+                                             head.next});
+      head.next = static_cast<int>(scratch_->body_entries.size()) - 1;
+    }
+
+    // Nodes never change once made, and the pool is only truncated
+    // after the stage is gone, so an entry stays valid for the life of
+    // the splitter. The memo grows with the pool to cover new nodes.
+    // An OR with a body armor below it keeps an entry per multiplier.
+    Range RangeOr(int or_id, int multiplier, bool *body) {
+      std::vector<Entry> &entries = scratch_->entries;
+      if (or_id >= entries.size()) {
+        entries.resize(pool_->OrSize(), Entry{Range(), UNSET, -1, -1});
+      }
+      const Entry *entry = FindEntry(or_id, multiplier);
+      if (nullptr != entry) {
+        if (ANY_MULTIPLIER != entry->multiplier) *body = true;
+        return entry->range;
+      }
+      const OR node = pool_->Or(or_id);
+      bool below = false;
+      Range result = EmptyRange();
+      if (ARMORS == node.tag) {
+        for (int armor_id : node.daughters) {
+          if (is_body_[armor_id]) below = true;
+          for (int k = 0; k < skills_; ++k) {
+            int points = ArmorPoints(armor_id, multiplier, k);
+            result.min[k] = (std::min)(result.min[k], points);
+            result.max[k] = (std::max)(result.max[k], points);
+          }
         }
-        auto it = temp_map.find(points);
-        if (temp_map.end() != it) {
-          it->second.push_back(armor_id);
-        } else {
-          temp_map[points] = {armor_id};
+      } else {
+        for (int and_id : node.daughters) {
+          const AND &and_node = pool_->And(and_id);
+          Range left = RangeOr(and_node.left, multiplier, &below);
+          Range right = RangeOr(and_node.right, multiplier, &below);
+          for (int k = 0; k < skills_; ++k) {
+            result.min[k] = (std::min)(result.min[k], 
+                                       left.min[k] + right.min[k]);
+            result.max[k] = (std::max)(result.max[k], 
+                                       left.max[k] + right.max[k]);
+          }
         }
       }
+      AddEntry(or_id, result, below ? multiplier : ANY_MULTIPLIER);
+      if (below) *body = true;
+      return result;
+    }
+
+    // The index in windows of the split memo slot of (or_id, points),
+    // or -1 if no armor set under or_id can have the points.
+    inline int Slot(int or_id, const Points &points, int multiplier) {
+      bool body = false;
+      Range range = RangeOr(or_id, multiplier, &body);
+      int offset = 0;
+      for (int k = 0; k < skills_; ++k) {
+        if (points[k] < range.min[k] || points[k] > range.max[k]) return -1;
+        offset = offset * (range.max[k] - range.min[k] + 1) + 
+          points[k] - range.min[k];
+      }
+      Entry *entry = FindEntry(or_id, multiplier);
+      if (-1 == entry->window) {
+        entry->window = scratch_->windows.size();
+        scratch_->windows.resize(entry->window + Volume(range),
+                                 static_cast<int>(UNKNOWN));
+      }
+      return entry->window + offset;
+    }
 
-      // node may be invalid below due to MakeOR<ARMORS>().
-      Signature key = node.key;
-      
-      for (auto &item : temp_map) {
-        int new_or_id = pool_->MakeOR<ARMORS>(sig::AddPoints(key,
-                                                             effect_id_,
-                                                             item.first),
-                                              &item.second);
-        new_armors->emplace_back(new_or_id, item.first);
+    // Whether an armor set under or_id has exactly the points.
+    bool Reachable(int or_id, const Points &points, int multiplier) {
+      int slot = Slot(or_id, points, multiplier);
+      if (-1 == slot) return false;
+      if (UNKNOWN != scratch_->windows[slot]) {
+        return -1 != scratch_->windows[slot];
       }
-      
-      return result_max;
-    }
-
-
-    void SplitAnd(int and_id, int sub_min, 
-                  PointsIdListMap *new_ands, int multiplier) {
-      PointsIdListMap split_armors;
-      const AND &node = pool_->And(and_id);
-      int left_max = SplitArmorOr(node.left, &split_armors, multiplier);
-      std::vector<TempOr> split_right;
-      const OR &right_node = pool_->Or(node.right);
-      int right_max = (ANDS == right_node.tag) ?
-        SplitOr(node.right, sub_min - left_max,
-                &split_right, multiplier) :
-        SplitArmorOr(node.right, &split_right, 
-                     sub_min - left_max, multiplier);
-
-      // Note(breakds), node may already have been invalid as the
-      // above code may trigger reallocation of vector in pool_.
-      
-      Signature left_key = pool_->Or(pool_->And(and_id).left).key;
-      for (auto &left_item : split_armors) {
-        if (right_max + left_item.first >= sub_min) {
-          int left_or_id = 
-            pool_->MakeOR<ARMORS>(sig::AddPoints(left_key,
-                                                 effect_id_,
-                                                 left_item.first),
-                                  &left_item.second);
-          for (auto &right_item : split_right) {
-            int points = left_item.first + right_item.points;
-            if (points >= sub_min) {
-              int new_and_id = pool_->MakeAnd(left_or_id,
-                                              right_item.id);
-              auto it = new_ands->find(points);
-              if (new_ands->end() != it) {
-                it->second.push_back(new_and_id);
-              } else {
-                (*new_ands)[points] = {new_and_id};
-              }
+
+      const OR node = pool_->Or(or_id);
+      bool result = false;
+      if (ARMORS == node.tag) {
+        for (int armor_id : node.daughters) {
+          if (HasPoints(armor_id, multiplier, points)) {
+            result = true;
+            break;
+          }
+        }
+      } else {
+        Points rest;
+        for (int and_id : node.daughters) {
+          const AND &and_node = pool_->And(and_id);
+          for (int armor_id : pool_->Or(and_node.left).daughters) {
+            for (int k = 0; k < skills_; ++k) {
+              rest[k] = points[k] - ArmorPoints(armor_id, multiplier, k);
+            }
+            if (Reachable(and_node.right, rest, multiplier)) {
+              result = true;
+              break;
             }
           }
+          if (result) break;
         }
       }
+      scratch_->windows[slot] = result ? UNBUILT : -1;
+      return result;
     }
 
-    int SplitOr(int or_id, int sub_min, 
-                std::vector<TempOr> *result, int multiplier) {
-      PointsIdListMap new_ands;
-      for (int and_id : pool_->Or(or_id).daughters) {
-        SplitAnd(and_id, sub_min, &new_ands, multiplier);
+    // The OR of the armor sets under or_id with exactly the points, or
+    // -1 if there are none. Also -1 once the pool is over the budget,
+    // in which case the split is left unbuilt.
+    int SplitOr(int or_id, const Points &points, int multiplier) {
+      if (!Reachable(or_id, points, multiplier)) return -1;
+      int slot = Slot(or_id, points, multiplier);
+      if (UNBUILT != scratch_->windows[slot]) {
+        return scratch_->windows[slot];
       }
-
-      int result_max = -1000;
-      if (!new_ands.empty()) {
-        Signature key = pool_->Or(or_id).key;
-        for (auto &item : new_ands) {
-          result->emplace_back(pool_->MakeOR<ANDS>(sig::AddPoints(key,
-                                                                  effect_id_,
-                                                                  item.first),
-                                                   &item.second),
-                               item.first);
-          if (item.first > result_max) {
-            result_max = item.first;
+      if (pool_->OverBudget()) return -1;
+
+      // The splits below push and pop their daughters on top of those
+      // of this OR.
+      const OR node = pool_->Or(or_id);
+      Key key = node.key;
+      for (int k = 0; k < skills_; ++k) {
+        key = sig::AddPoints(key, effect_id_ + k, points[k]);
+      }
+      std::vector<int> &daughters = scratch_->daughters;
+      size_t begin = daughters.size();
+      int id = -1;
+      if (ARMORS == node.tag) {
+        for (int armor_id : node.daughters) {
+          if (HasPoints(armor_id, multiplier, points)) {
+            daughters.push_back(armor_id);
+          }
+        }
+        id = pool_->template InternOR<ARMORS>(key, daughters.data() + begin,
+                                              daughters.size() - begin);
+      } else {
+        Points left_points;
+        Points right_points;
+        for (int and_id : node.daughters) {
+          const AND and_node = pool_->And(and_id);
+          bool body = false;
+          Range left = RangeOr(and_node.left, multiplier, &body);
+          int size = Volume(left);
+          for (int index = 0; index < size && !pool_->OverBudget(); 
+               ++index) {
+            Decode(left, index, &left_points);
+            for (int k = 0; k < skills_; ++k) {
+              right_points[k] = points[k] - left_points[k];
+            }
+            if (!Reachable(and_node.right, right_points, multiplier)) {
+              continue;
+            }
+            int left_id = SplitOr(and_node.left, left_points, multiplier);
+            if (-1 == left_id) continue;
+            int right_id = SplitOr(and_node.right, right_points, multiplier);
+            if (-1 == right_id) break;
+            daughters.push_back(pool_->MakeAnd(left_id, right_id));
           }
         }
+        if (pool_->OverBudget()) {
+          daughters.resize(begin);
+          return -1;
+        }
+        id = pool_->template InternOR<ANDS>(key, daughters.data() + begin,
+                                            daughters.size() - begin);
       }
-      return result_max;
+      daughters.resize(begin);
+      scratch_->windows[slot] = id;
+      return id;
     }
-
     
-    
-    NodePool *pool_;
-    std::vector<int> armor_points_;
-    std::vector<bool> is_body_;
+    BasicNodePool<Key> *pool_;
     int effect_id_;
+    int skills_;
+    SplitScratch *scratch_;
+    std::vector<int> &armor_points_;
+    std::vector<bool> &is_body_;
   };
+
+  typedef BasicSkillSplitter<Signature> SkillSplitter;
   
 }  // namespace monster_avengers
 
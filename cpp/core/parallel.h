@@ -0,0 +1,341 @@
+#ifndef _MONSTER_AVENGERS_PARALLEL_
+#define _MONSTER_AVENGERS_PARALLEL_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "iterator.h"
+
+namespace monster_avengers {
+
+  // Hands out the chunks [0, chunks) to workers. Every worker starts
+  // with a contiguous run of chunks, which it takes from the front,
+  // and once it is out of chunks it steals from the back of the runs
+  // of the others.
+  class ChunkScheduler {
+  public:
+    ChunkScheduler(int chunks, int workers) : shards_(workers) {
+      for (int worker = 0; worker < workers; ++worker) {
+        for (int chunk = chunks * worker / workers;
+             chunk < chunks * (worker + 1) / workers; ++chunk) {
+          shards_[worker].chunks.push_back(chunk);
+        }
+      }
+    }
+
+    // Returns false once every chunk has been handed out.
+    bool Next(int worker, int *chunk) {
+      {
+        Shard &own = shards_[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.chunks.empty()) {
+          *chunk = own.chunks.front();
+          own.chunks.pop_front();
+          return true;
+        }
+      }
+      for (size_t i = 1; i < shards_.size(); ++i) {
+        Shard &victim = shards_[(worker + i) % shards_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.chunks.empty()) {
+          *chunk = victim.chunks.back();
+          victim.chunks.pop_back();
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    struct Shard {
+      std::mutex mutex;
+      std::deque<int> chunks;
+    };
+
+    std::vector<Shard> shards_;
+  };
+
+  // The armor sets of chunks of work run by a pool of threads. Each
+  // thread is a worker, which runs the chunks that ChunkScheduler
+  // hands it, or with ordered the chunks in order, with run(worker,
+  // chunk, emit). run passes every armor set
+  // of the chunk to emit, and stops if emit returns false. It returns
+  // false to stop all the workers.
+  //
+  // The armor sets are streamed through a queue of about capacity
+  // sets in the order they are found. With ordered, each chunk streams
+  // them through a queue of its own instead, which the reader drains in
+  // the order of the chunks. A worker that gets ahead of the reader
+  // waits once the queue of its chunk has capacity sets, and does not
+  // start a chunk more than 2 * workers chunks after the one being
+  // read, so that the sets held stay bounded. Either way the workers
+  // stop once limit sets have been read. The jewel keys of the
+  // armor sets are in the pools of the workers, so they travel with the
+  // sets. The reader copies the keys of the sets it hands out to an
+  // arena of its own, which only holds those of the last NextBatch():
+  // the sets are valid until the next call.
+  template <typename Key>
+  class ParallelArmorSetIterator : public BasicArmorSetIterator<Key> {
+  public:
+    typedef std::function<bool(const BasicArmorSet<Key> &)> Emit;
+    typedef std::function<bool(int, int, const Emit &)> Run;
+
+    // Armor sets that a worker queues at once.
+    static const size_t BATCH = 32;
+
+    ParallelArmorSetIterator(int chunks, int workers, bool ordered,
+                             size_t limit, size_t capacity, Run run)
+      : scheduler_(chunks, workers), run_(run), ordered_(ordered),
+        limit_(limit), capacity_(capacity), window_(2 * workers), 
+        stop_(false), running_(workers), queue_(), chunk_sets_(chunks),
+        chunk_done_(chunks, false), next_chunk_(0), chunk_(0), index_(0),
+        read_(0), reading_(), jewel_keys_(), threads_() {
+      for (int worker = 0; worker < workers; ++worker) {
+        threads_.emplace_back(&ParallelArmorSetIterator::Work, this,
+                              worker);
+      }
+    }
+
+    ~ParallelArmorSetIterator() {
+      Stop();
+      for (std::thread &thread : threads_) thread.join();
+    }
+
+    // The roots are in the pools of the workers, so the base indices
+    // are -1.
+    size_t NextBatch(BasicArmorSet<Key> *sets, int *base_indices,
+                     size_t size) override {
+      jewel_keys_.Clear();
+      size_t count = 0;
+      for (; count < size && Proceed(&sets[count]); ++count) {
+        base_indices[count] = -1;
+      }
+      return count;
+    }
+
+  private:
+    // Armor sets with their jewel keys, which the lists of the sets
+    // index until the reader hands them out.
+    struct Batch {
+      std::vector<BasicArmorSet<Key> > sets;
+      std::vector<Key> keys;
+
+      void Add(const BasicArmorSet<Key> &armor_set) {
+        sets.push_back(armor_set);
+        sets.back().jewel_keys = 
+          BasicKeyList<Key>(nullptr, keys.size(), armor_set.jewel_keys.size());
+        keys.insert(keys.end(), armor_set.jewel_keys.begin(), 
+                    armor_set.jewel_keys.end());
+      }
+
+      // Moves the armor sets and keys of other to the end.
+      void Take(Batch *other) {
+        for (BasicArmorSet<Key> &armor_set : other->sets) {
+          armor_set.jewel_keys = 
+            BasicKeyList<Key>(nullptr, keys.size() + 
+                              armor_set.jewel_keys.offset(),
+                              armor_set.jewel_keys.size());
+          sets.push_back(std::move(armor_set));
+        }
+        keys.insert(keys.end(), other->keys.begin(), other->keys.end());
+        other->Clear();
+      }
+
+      void Clear() {
+        sets.clear();
+        keys.clear();
+      }
+    };
+
+    void Work(int worker) {
+      Batch chunk_sets;
+      int chunk = 0;
+      while (!stop_ && NextChunk(worker, &chunk)) {
+        bool go_on = true;
+        if (ordered_) {
+          // No chunk needs more than limit sets.
+          size_t found = 0;
+          go_on = run_(worker, chunk, [this, chunk, &chunk_sets, &found]
+                       (const BasicArmorSet<Key> &armor_set) {
+                         if (stop_) return false;
+                         chunk_sets.Add(armor_set);
+                         return ++found < limit_ && 
+                           (chunk_sets.sets.size() < BATCH || 
+                            PublishChunk(chunk, &chunk_sets));
+                       });
+          PublishChunk(chunk, &chunk_sets);
+          std::lock_guard<std::mutex> lock(mutex_);
+          chunk_done_[chunk] = true;
+          produced_.notify_all();
+        } else {
+          go_on = run_(worker, chunk, [this, &chunk_sets]
+                       (const BasicArmorSet<Key> &armor_set) {
+                         if (stop_) return false;
+                         chunk_sets.Add(armor_set);
+                         return chunk_sets.sets.size() < BATCH || 
+                           Publish(&chunk_sets);
+                       });
+          Publish(&chunk_sets);
+        }
+        if (!go_on) Stop();
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_--;
+      produced_.notify_all();
+    }
+
+    // Returns false once there are no more chunks for worker, or the
+    // workers are to stop.
+    bool NextChunk(int worker, int *chunk) {
+      if (!ordered_) return scheduler_.Next(worker, chunk);
+      std::unique_lock<std::mutex> lock(mutex_);
+      consumed_.wait(lock, [this]() {
+          return stop_ || next_chunk_ < chunk_ + window_;
+        });
+      if (stop_ || next_chunk_ >= chunk_sets_.size()) return false;
+      *chunk = static_cast<int>(next_chunk_++);
+      return true;
+    }
+
+    // Moves the armor sets into the queue of chunk once it has room,
+    // and returns false if the workers are to stop instead.
+    bool PublishChunk(int chunk, Batch *armor_sets) {
+      if (armor_sets->sets.empty()) return !stop_;
+      std::unique_lock<std::mutex> lock(mutex_);
+      Batch &queue = chunk_sets_[chunk];
+      consumed_.wait(lock, [this, &queue]() {
+          return stop_ || queue.sets.size() < capacity_;
+        });
+      if (!stop_) {
+        queue.Take(armor_sets);
+        produced_.notify_all();
+      }
+      armor_sets->Clear();
+      return !stop_;
+    }
+
+    // Moves the armor sets into the queue once it has room, and returns
+    // false if the workers are to stop instead.
+    bool Publish(Batch *armor_sets) {
+      if (armor_sets->sets.empty()) return !stop_;
+      std::unique_lock<std::mutex> lock(mutex_);
+      consumed_.wait(lock, [this]() {
+          return stop_ || queue_.sets.size() < capacity_;
+        });
+      if (!stop_) {
+        queue_.Take(armor_sets);
+        produced_.notify_one();
+      }
+      armor_sets->Clear();
+      return !stop_;
+    }
+
+    // Moves the next armor set of reading_ to armor_set, with its
+    // jewel keys copied to jewel_keys_.
+    void Hand(BasicArmorSet<Key> *armor_set) {
+      *armor_set = std::move(reading_.sets[index_++]);
+      armor_set->jewel_keys = jewel_keys_.Append(
+          reading_.keys.data() + armor_set->jewel_keys.offset(),
+          armor_set->jewel_keys.size());
+      read_++;
+    }
+
+    // Moves the next armor set to armor_set, and returns false if
+    // there are no more.
+    bool Proceed(BasicArmorSet<Key> *armor_set) {
+      if (read_ >= limit_) {
+        Stop();
+        return false;
+      }
+      if (index_ < reading_.sets.size()) {
+        Hand(armor_set);
+        return true;
+      }
+      bool found = false;
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (ordered_) {
+        while (chunk_ < chunk_sets_.size()) {
+          Batch &queue = chunk_sets_[chunk_];
+          if (!queue.sets.empty()) {
+            // Take the whole queue of the chunk, which frees it for its
+            // worker.
+            reading_.Clear();
+            std::swap(reading_, queue);
+            found = true;
+          } else if (chunk_done_[chunk_]) {
+            queue = Batch();
+            chunk_++;
+          } else if (0 == running_) {
+            // A stopped worker may have left the chunk undone.
+            break;
+          } else {
+            produced_.wait(lock);
+            continue;
+          }
+          consumed_.notify_all();
+          if (found) break;
+        }
+      } else {
+        produced_.wait(lock, [this]() {
+            return !queue_.sets.empty() || 0 == running_;
+          });
+        if (!queue_.sets.empty()) {
+          // Take the whole queue, which frees it for the workers.
+          reading_.Clear();
+          std::swap(reading_, queue_);
+          found = true;
+          consumed_.notify_all();
+        }
+      }
+      if (!found) return false;
+      index_ = 0;
+      Hand(armor_set);
+      return true;
+    }
+
+    void Stop() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+      consumed_.notify_all();
+      produced_.notify_all();
+    }
+
+    ChunkScheduler scheduler_;
+    Run run_;
+    bool ordered_;
+    size_t limit_;
+    size_t capacity_;
+    size_t window_;
+    std::atomic<bool> stop_;
+    // Guards the members up to the reader's own.
+    std::mutex mutex_;
+    std::condition_variable produced_;
+    std::condition_variable consumed_;
+    int running_;
+    Batch queue_;
+    // The queues of the chunks, with ordered.
+    std::vector<Batch> chunk_sets_;
+    std::vector<bool> chunk_done_;
+    // The chunk to start next, with ordered.
+    size_t next_chunk_;
+    // The reader's own, but for chunk_ which the workers read under
+    // the lock: the chunk being read with ordered, and the index in
+    // reading_.
+    size_t chunk_;
+    size_t index_;
+    size_t read_;
+    // The armor sets taken from a queue.
+    Batch reading_;
+    // The jewel keys of the armor sets of the last NextBatch().
+    BasicKeyArena<Key> jewel_keys_;
+    std::vector<std::thread> threads_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_PARALLEL_
@@ -0,0 +1,90 @@
+#include <algorithm>
+
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "core/armor_up.h"
+#include "supp/search_lines.h"
+
+using namespace monster_avengers;
+
+// Checks the parallel search against the search on the calling
+// thread: the same armor sets in the same order with (:ordered 1), the
+// same armor sets in any order without, and max-results honored. A
+// query that no key layout can hold fails either way, without results.
+//
+// Usage: parallel_test [dataset folder]
+
+// The engine runs at most one worker per hardware thread.
+const int WORKERS = 3;
+
+int main(int argc, char **argv) {
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+  CHECK(2 <= argc);
+  ArmorUp armor_up(argv[1]);
+
+  const std::vector<std::wstring> texts = {
+    L"(:weapon-type \"melee\")"
+    L"(:weapon-holes 0)"
+    L"(:rare 8)"
+    L"(:max-rare 10)"
+    L"(:skill 5 20)"
+    L"(:skill 30 15)"
+    L"(:skill 41 10)",
+    L"(:weapon-type \"range\")"
+    L"(:weapon-holes 1)"
+    L"(:rare 8)"
+    L"(:skill 9 10)"
+    L"(:skill 52 10)"
+    L"(:skill 56 10)",
+    // Two skill splitter stages, where the second expands the LAZY
+    // roots of the first.
+    L"(:weapon-type \"melee\")"
+    L"(:weapon-holes 3)"
+    L"(:rare 8)"
+    L"(:skill 51 10)"
+    L"(:skill 119 10)"
+    L"(:skill 47 10)"
+    L"(:skill 29 10)"};
+
+  const std::wstring all = L"(:max-results 100000)";
+  const std::wstring parallel =
+    L"(:parallel " + std::to_wstring(WORKERS) + L")";
+
+  for (const std::wstring &text : texts) {
+    std::vector<std::string> serial = SearchLines(&armor_up, text + all);
+    CHECK(!serial.empty());
+
+    std::vector<std::string> ordered =
+      SearchLines(&armor_up, text + all + parallel + L"(:ordered 1)");
+    CHECK(serial == ordered);
+
+    std::vector<std::string> unordered =
+      SearchLines(&armor_up, text + all + parallel);
+    std::sort(serial.begin(), serial.end());
+    std::sort(unordered.begin(), unordered.end());
+    CHECK(serial == unordered);
+
+    std::vector<std::string> limited =
+      SearchLines(&armor_up, text + L"(:max-results 10)" + parallel);
+    CHECK(limited.size() == (std::min)(static_cast<size_t>(10),
+                                       serial.size()));
+    for (const std::string &line : limited) {
+      CHECK(std::binary_search(serial.begin(), serial.end(), line));
+    }
+  }
+
+  std::wstring too_many = L"(:weapon-type \"melee\")";
+  for (int skill = 1; skill <= LongWideSignature::MAX_EFFECTS + 1; ++skill) {
+    too_many += L"(:skill " + std::to_wstring(skill) + L" 10)";
+  }
+  for (const std::wstring &text : {too_many, too_many + parallel}) {
+    Query query;
+    CHECK_SUCCESS(Query::Parse(text, &query));
+    CHECK(armor_up.SearchEncoded(query).empty());
+    CHECK(!armor_up.status().Success());
+  }
+  CHECK(!SearchLines(&armor_up, texts[0] + all).empty());
+
+  wprintf(L"PASS\n");
+  return 0;
+}
@@ -0,0 +1,144 @@
+#include <algorithm>
+
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "utils/signature.h"
+#include "utils/signature_table.h"
+#include "utils/jewels_query.h"
+#include "core/armor_up.h"
+#include "supp/search_lines.h"
+
+using namespace monster_avengers;
+
+// Checks the skyline mode of HoleClient, (:skyline 1): every key that
+// it drops from an answer is dominated by a key that it keeps with the
+// same holes, and a search finds the same armor sets with it as
+// without. Only the jewels that the armor sets come with may differ.
+//
+// Usage: skyline_test [dataset folder]
+
+// Holes of the layouts checked, which keeps the answers of 6 skills
+// small enough to check every dropped key.
+const int MAX_HOLES = 10;
+
+// Returns the number of keys dropped from the answer of the layout.
+size_t CheckAnswer(const std::vector<Signature> &full,
+                   const std::vector<Signature> &skyline) {
+  SignatureSet all;
+  for (const Signature &key : full) all.insert(key);
+  SignatureSet kept;
+  for (const Signature &key : skyline) {
+    CHECK(1 == all.count(key));
+    kept.insert(key);
+  }
+  size_t dropped = 0;
+  for (const Signature &key : full) {
+    if (1 == kept.count(key)) continue;
+    bool dominated = false;
+    for (const Signature &other : skyline) {
+      if (sig::SameHoles(other, key) && sig::Dominates(other, key)) {
+        dominated = true;
+        break;
+      }
+    }
+    CHECK(dominated);
+    dropped++;
+  }
+  return dropped;
+}
+
+void CheckClient(const DataSet &data, const std::vector<Effect> &effects) {
+  HoleClient full(data, effects);
+  HoleClient skyline(data, effects, true);
+  size_t keys = 0;
+  size_t dropped = 0;
+  for (int k = 0; k < HoleClient::MAX_THREES; ++k) {
+    for (int j = 0; j < HoleClient::MAX_TWOS; ++j) {
+      for (int i = 0; i < HoleClient::MAX_ONES; ++i) {
+        if (i + 2 * j + 3 * k > MAX_HOLES) continue;
+        // Without and with a torso up armor piece.
+        for (int multiplier = 1; multiplier <= 2; ++multiplier) {
+          const std::vector<Signature> &answer =
+            full.Query(i, j, k, multiplier - 1, multiplier);
+          keys += answer.size();
+          dropped += CheckAnswer(answer, skyline.Query(i, j, k,
+                                                       multiplier - 1,
+                                                       multiplier));
+        }
+      }
+    }
+  }
+  wprintf(L"%zu skills: %zu of %zu keys dropped\n", effects.size(),
+          dropped, keys);
+}
+
+// The armor sets of the encoded results of lines, sorted, without the
+// jewels: the lists nested in the list of a piece are dropped.
+std::vector<std::string> ArmorSets(const std::vector<std::string> &lines) {
+  std::vector<std::string> armor_sets;
+  for (const std::string &line : lines) {
+    std::string armor_set;
+    int depth = 0;
+    for (char c : line) {
+      if ('(' == c) depth++;
+      if (depth < 3) armor_set += c;
+      if (')' == c) depth--;
+    }
+    armor_sets.push_back(armor_set);
+  }
+  std::sort(armor_sets.begin(), armor_sets.end());
+  return armor_sets;
+}
+
+int main(int argc, char **argv) {
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+  CHECK(2 <= argc);
+
+  {
+    DataSet data(argv[1]);
+    // The skills of the 6 skills query in core/test.cc.
+    Query query;
+    CHECK_SUCCESS(Query::Parse(L"(:skill 25 15)"
+                               L"(:skill 1 10)"
+                               L"(:skill 40 15)"
+                               L"(:skill 41 10)"
+                               L"(:skill 36 10)"
+                               L"(:skill 30 10)",
+                               &query));
+    for (int skills = 3; skills <= 6; ++skills) {
+      CheckClient(data, std::vector<Effect>(query.effects.begin(),
+                                            query.effects.begin() + skills));
+    }
+  }
+
+  ArmorUp armor_up(argv[1]);
+  const std::vector<std::wstring> texts = {
+    L"(:weapon-type \"melee\")"
+    L"(:weapon-holes 3)"
+    L"(:rare 8)"
+    L"(:skill 51 10)"
+    L"(:skill 119 10)"
+    L"(:skill 47 10)"
+    L"(:skill 29 10)",
+    // 5 skills, where the skyline drops keys.
+    L"(:weapon-type \"melee\")"
+    L"(:weapon-holes 3)"
+    L"(:skill 41 10)"
+    L"(:skill 36 10)"
+    L"(:skill 30 10)"
+    L"(:skill 40 15)"
+    L"(:skill 25 10)"};
+
+  const std::wstring all = L"(:max-results 100000)";
+  for (const std::wstring &text : texts) {
+    std::vector<std::string> full = 
+      ArmorSets(SearchLines(&armor_up, text + all));
+    std::vector<std::string> skyline =
+      ArmorSets(SearchLines(&armor_up, text + all + L"(:skyline 1)"));
+    CHECK(!full.empty());
+    CHECK(full == skyline);
+  }
+
+  wprintf(L"PASS\n");
+  return 0;
+}
@@ -0,0 +1,180 @@
+#include <cstdlib>
+#include <new>
+
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "core/armor_up.h"
+#include "supp/timer.h"
+
+using namespace monster_avengers;
+
+// BasicSkillSplitter::Max() with and without the memo, and Split()
+// with the heap allocations it makes, on the forest that reaches each
+// skill splitter stage of the 6 skills query in core/test.cc. The
+// query runs twice, and the second run splits with warm scratch.
+//
+// Usage: splitter_bench [dataset folder]
+
+namespace {
+  size_t allocations = 0;
+
+  // The most points of skill_id that the armor sets under or_id can
+  // have, walking every subtree again as Max() did before its memo.
+  int PlainMax(const DataSet &data, const NodePool &pool, int or_id,
+               int skill_id, int multiplier) {
+    const OR &node = pool.Or(or_id);
+    int result = -1000;
+    if (ARMORS == node.tag) {
+      for (int armor_id : node.daughters) {
+        const Armor &armor = data.armors()[armor_id];
+        int points = 0;
+        for (const Effect &effect : armor.effects) {
+          if (effect.skill_id == skill_id) {
+            points = effect.points;
+            break;
+          }
+        }
+        if (BODY == armor.part && multiplier > 1) points *= multiplier;
+        result = (std::max)(result, points);
+      }
+    } else {
+      for (int and_id : node.daughters) {
+        const AND &and_node = pool.And(and_id);
+        result = (std::max)(result, 
+                            PlainMax(data, pool, and_node.left, skill_id,
+                                     multiplier) +
+                            PlainMax(data, pool, and_node.right, skill_id,
+                                     multiplier));
+      }
+    }
+    return result;
+  }
+
+  // Times Max() over the forest of the stage of effect_id with and
+  // without the memo, and Split() into every total with the expansion
+  // of the splits.
+  void ProfileStage(const DataSet &data, int effect_id, int skill_id,
+                    CachedTreeIterator<Signature> *forest, NodePool *pool,
+                    SplitScratch *scratch) {
+    // Leave the expansion of the roots out of the timing.
+    for (; !forest->empty(); ++(*forest)) {
+      pool->Expand((**forest).id);
+    }
+    forest->Reset();
+    SplitScratch memoized_scratch;
+    SkillSplitter memoized(data, pool, effect_id, skill_id, 
+                           &memoized_scratch);
+    Timer timer;
+    int64_t plain_sum = 0;
+    timer.Tic();
+    for (; !forest->empty(); ++(*forest)) {
+      plain_sum += PlainMax(data, *pool, pool->Expand((**forest).id), 
+                            skill_id, (**forest).torso_multiplier);
+    }
+    double plain_time = timer.Toc();
+    int64_t memoized_sum = 0;
+    forest->Reset();
+    timer.Tic();
+    for (; !forest->empty(); ++(*forest)) {
+      memoized_sum += memoized.Max(**forest);
+    }
+    double memoized_time = timer.Toc();
+    CHECK(plain_sum == memoized_sum);
+    wprintf(L"Stage %d: %lld roots, Max() %.4lf sec, "
+            L"memoized %.4lf sec\n", effect_id, forest->size(), plain_time,
+            memoized_time);
+
+    forest->Reset();
+    size_t before = allocations;
+    timer.Tic();
+    {
+      SkillSplitter splitter(data, pool, effect_id, skill_id, scratch);
+      pool->set_splitter(effect_id, &splitter);
+      for (; !forest->empty(); ++(*forest)) {
+        for (int lazy_id : splitter.Split(**forest, -1000)) {
+          pool->Expand(lazy_id);
+        }
+      }
+      pool->set_splitter(effect_id, nullptr);
+    }
+    double split_time = timer.Toc();
+    wprintf(L"Stage %d: Split() %.4lf sec, %lld allocations\n", effect_id,
+            split_time, allocations - before);
+  }
+}  // namespace
+
+// Every replaceable form of operator new counts, and every form of
+// operator delete frees what they malloc, so that no pair mixes the
+// allocators.
+namespace {
+  void *CountedMalloc(size_t size) {
+    allocations++;
+    void *pointer = std::malloc(0 == size ? 1 : size);
+    if (nullptr == pointer) throw std::bad_alloc();
+    return pointer;
+  }
+}  // namespace
+
+void *operator new(size_t size) {
+  return CountedMalloc(size);
+}
+
+void *operator new[](size_t size) {
+  return CountedMalloc(size);
+}
+
+void operator delete(void *pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+  std::free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept {
+  std::free(pointer);
+}
+
+int main(int argc, char **argv) {
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+  CHECK(2 <= argc);
+
+  Query query;
+  CHECK_SUCCESS(Query::Parse(L"(:weapon-type \"melee\")" 
+                             L"(:weapon-holes 2)"
+                             L"(:skill 25 15)"
+                             L"(:skill 1 10)"
+                             L"(:skill 40 15)"
+                             L"(:skill 41 10)"
+                             L"(:skill 36 10)" 
+                             L"(:skill 30 10)" 
+                             L"(:amulet 2 (1 4 30 10))",
+                             &query));
+
+  ArmorUp armor_up(argv[1]);
+  Query optimized = armor_up.OptimizeQuery(query, false);
+  KeyLayout layout;
+  CHECK_SUCCESS(armor_up.SelectLayout(optimized, &layout));
+  CHECK(SMALL_KEY == layout);
+
+  DataSet data(argv[1]);
+  ArmorUpEngine<Signature> engine(&data);
+  for (int run = 0; run < 2; ++run) {
+    wprintf(L"Run %d\n", run);
+    CHECK_SUCCESS(engine.VisitSplitterStages(
+        optimized, [&data, &optimized](int effect_id, 
+                                       CachedTreeIterator<Signature> *forest,
+                                       NodePool *pool, 
+                                       SplitScratch *scratch) {
+          ProfileStage(data, effect_id, 
+                       optimized.effects[effect_id].skill_id, forest, pool,
+                       scratch);
+        }));
+  }
+  
+  return 0;
+}
@@ -19,6 +19,8 @@ int main(int argc, char **argv) {
     timer.Tic();
     armor_up.Explore(query, argv[3]);
     double duration = timer.Toc();
+    Status status = armor_up.status();
+    if (!status.Success()) Log(WARNING, L"%s", status.message().c_str());
     wprintf(L"Computation: %.4lf seconds.\n", duration);
   }
   return 0;
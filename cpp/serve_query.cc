@@ -15,6 +15,8 @@ int main(int argc, char **argv) {
     Query query;
     CHECK_SUCCESS(Query::ParseFile(argv[2], &query));
     armor_up.Search<LISP>(query, argv[3]);
+    Status status = armor_up.status();
+    if (!status.Success()) Log(WARNING, L"%s", status.message().c_str());
   }
   return 0;
 }
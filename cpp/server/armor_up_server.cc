@@ -34,6 +34,14 @@ public:
         throw 0;
       }
       std::wstring answer = std::move(armor_up->SearchSerialized(query));
+      Status status = armor_up->status();
+      if (!status.Success()) {
+        Log(WARNING, L"%s: %s", status.message().c_str(),
+            query_cache_.c_str());
+        // A query that could not be searched has no answer, otherwise
+        // answer with what was found within the budget.
+        if (answer.empty()) return "\"" + status.message() + "\"";
+      }
       content.assign(answer.begin(), answer.end());
     } catch (int e) {
       content = "\"Query Format Error!\"";
@@ -47,7 +55,7 @@ public:
 
 int main(int argc, char **argv) {
   if (argc < 2) {
-    Log(FATAL, L"Please call the command as: armor_up_server [dataset folder] [port]");
+    Log(FATAL, L"Please call the command as: armor_up_server [dataset folder] [port] [node budget]");
   }
 
   int port = 8887;
@@ -60,6 +68,18 @@ int main(int argc, char **argv) {
       _exit(-1);
     }
   }
+
+  // Nodes that one query may create, no limit by default.
+  size_t node_budget = 0;
+
+  if (argc >= 4) {
+    try {
+      node_budget = std::stoull(argv[3]);
+    } catch (std::invalid_argument&) {
+      Log(FATAL, L"Invalid node budget %s.", argv[3]);
+      _exit(-1);
+    }
+  }
   
   Log(INFO, L"Starting Server.");
 
@@ -70,6 +90,7 @@ int main(int argc, char **argv) {
 
   // Initialize the armor up engine.
   armor_up.reset(new ArmorUp(argv[1]));
+  armor_up->SetNodeBudget(node_budget);
 
   Log(INFO, L"armor up!");
 
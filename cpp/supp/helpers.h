@@ -56,7 +56,9 @@ namespace monster_avengers {
 
   enum StatusName {
     SUCCESS = 0,
-    FAIL = 1
+    FAIL = 1,
+    // The search went over the node budget, see ArmorUp::SetNodeBudget().
+    OVER_BUDGET = 2
   };
   
   class Status {
@@ -77,6 +79,10 @@ namespace monster_avengers {
       return SUCCESS == name_;
     }
 
+    inline StatusName name() const {
+      return name_;
+    }
+
     const std::string &message() {
       return error_message_;
     }
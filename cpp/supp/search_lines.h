@@ -0,0 +1,41 @@
+#ifndef _MONSTER_AVENGERS_SEARCH_LINES_
+#define _MONSTER_AVENGERS_SEARCH_LINES_
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utils/query.h"
+#include "core/armor_up.h"
+#include "supp/timer.h"
+
+namespace monster_avengers {
+
+  // Searches the query of text and returns the encoded armor sets, one
+  // line each in the order found, and prints their count and the time
+  // taken. The status of the search goes to status if given, and must
+  // be a success otherwise. For the tests.
+  std::vector<std::string> SearchLines(ArmorUp *armor_up,
+                                       const std::wstring &text,
+                                       Status *status = nullptr) {
+    Query query;
+    CHECK_SUCCESS(Query::Parse(text, &query));
+    Timer timer;
+    timer.Tic();
+    std::istringstream encoded(armor_up->SearchEncoded(query));
+    double duration = timer.Toc();
+    if (nullptr == status) {
+      CHECK_SUCCESS(armor_up->status());
+    } else {
+      *status = armor_up->status();
+    }
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(encoded, line)) lines.push_back(line);
+    wprintf(L"%zu results in %.4lf sec\n", lines.size(), duration);
+    return lines;
+  }
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_SEARCH_LINES_
@@ -15,22 +15,31 @@
 
 namespace monster_avengers {
 
-  template <OutputSpec Spec>
+  // How the formatters of query pick the jewels of an armor set.
+  template <typename Key>
+  typename BasicJewelSolver<Key>::Strategy SolverStrategy(const Query &query) {
+    return query.fewest_jewels ? BasicJewelSolver<Key>::KNAPSACK_FEWEST : 
+      BasicJewelSolver<Key>::KNAPSACK;
+  }
+
+  template <OutputSpec Spec, typename Key = Signature>
   class ArmorSetFormatter {
   public:
-    virtual void operator()(const ArmorSet &armor_set) = 0;
+    virtual void operator()(const BasicArmorSet<Key> &armor_set) = 0;
   };
 
-  template <>
-  class ArmorSetFormatter<SCREEN> {
+  template <typename Key>
+  class ArmorSetFormatter<SCREEN, Key> {
   public:
     ArmorSetFormatter(const std::string &unused_path,
                       const DataSet *data,
-                      const Query &query)
-      : solver_(*data, query.effects), 
+                      const Query &query,
+                      JewelPlanCache<Key> *plans = nullptr)
+      : solver_(*data, query.effects, plans, 
+                SolverStrategy<Key>(query)), 
         data_(data) {}
 
-    void operator()(const ArmorSet &armor_set) {
+    void operator()(const BasicArmorSet<Key> &armor_set) {
       ArmorResult result(*data_, solver_, armor_set);
       wprintf(L"---------- ArmorSet (defense %d) ----------\n", 
               result.defense);
@@ -113,18 +122,20 @@ namespace monster_avengers {
       }
     }
 
-    const JewelSolver solver_;
+    const BasicJewelSolver<Key> solver_;
     const DataSet *data_;
   };
 
 
-  template <>
-  class ArmorSetFormatter<LISP> {
+  template <typename Key>
+  class ArmorSetFormatter<LISP, Key> {
   public:
     ArmorSetFormatter(const std::string file_name, 
                       const DataSet *data,
-                      const Query &query)
-      : solver_(*data, query.effects), 
+                      const Query &query,
+                      JewelPlanCache<Key> *plans = nullptr)
+      : solver_(*data, query.effects, plans, 
+                SolverStrategy<Key>(query)), 
         data_(data) {
       output_stream_.reset(new std::wofstream(file_name));
       if (!output_stream_->good()) {
@@ -134,28 +145,30 @@ namespace monster_avengers {
       output_stream_->imbue(LOCALE_UTF8);
     }
 
-    void operator()(const ArmorSet &armor_set) {
+    void operator()(const BasicArmorSet<Key> &armor_set) {
       ToFile(armor_set);
     }
 
   private:
     // Output to specified file.
-    void ToFile(const ArmorSet &armor_set) {
+    void ToFile(const BasicArmorSet<Key> &armor_set) {
       (*output_stream_) << ArmorResult(*data_, solver_, armor_set) << "\n";
     }
 
     std::unique_ptr<std::wofstream> output_stream_;
-    const JewelSolver solver_;
+    const BasicJewelSolver<Key> solver_;
     const DataSet *data_;
   };
 
-  template <>
-  class ArmorSetFormatter<JSON> {
+  template <typename Key>
+  class ArmorSetFormatter<JSON, Key> {
   public:
     ArmorSetFormatter(const std::string file_name, 
                       const DataSet *data,
-                      const Query &query)
-      : solver_(*data, query.effects), 
+                      const Query &query,
+                      JewelPlanCache<Key> *plans = nullptr)
+      : solver_(*data, query.effects, plans, 
+                SolverStrategy<Key>(query)), 
         data_(data) {
       output_stream_.reset(new std::wofstream(file_name));
       if (!output_stream_->good()) {
@@ -165,33 +178,36 @@ namespace monster_avengers {
       output_stream_->imbue(LOCALE_UTF8);
     }
 
-    void operator()(const ArmorSet &armor_set) {
+    void operator()(const BasicArmorSet<Key> &armor_set) {
       ToFile(armor_set);
     }
 
   private:
     // Output to specified file.
-    void ToFile(const ArmorSet &armor_set) {
+    void ToFile(const BasicArmorSet<Key> &armor_set) {
       lisp::Object result = 
         JsonArmorResult(*data_, solver_, armor_set).Format();
       result.OutputJson(output_stream_.get());
     }
 
     std::unique_ptr<std::wofstream> output_stream_;
-    const JewelSolver solver_;
+    const BasicJewelSolver<Key> solver_;
     const DataSet *data_;
   };
 
-  class ResultSerializer {
+  template <typename Key>
+  class BasicResultSerializer {
   public:
-    ResultSerializer(const DataSet *data,
-                     const Query &query)
-      : solver_(*data, query.effects), 
+    BasicResultSerializer(const DataSet *data,
+                          const Query &query,
+                      JewelPlanCache<Key> *plans = nullptr)
+      : solver_(*data, query.effects, plans, 
+                SolverStrategy<Key>(query)), 
         data_(data) {
       result_ = lisp::Object::List();
     }
     
-    void Add(const ArmorSet &armor_set) {
+    void Add(const BasicArmorSet<Key> &armor_set) {
       result_.Push(JsonArmorResult(*data_,
                                    solver_,
                                    armor_set).Format());
@@ -206,11 +222,13 @@ namespace monster_avengers {
 
   private:
 
-    const JewelSolver solver_;
+    const BasicJewelSolver<Key> solver_;
     const DataSet *data_;
     lisp::Object result_;
   };
 
+  typedef BasicResultSerializer<Signature> ResultSerializer;
+
   class ExploreFormatter {
   public:
     ExploreFormatter(const std::string &file_name) 
@@ -225,17 +243,20 @@ namespace monster_avengers {
       }
     }
 
-    void Push(int skill_id, bool pass, const LanguageText &name, 
-              double duration) {
+    // A skill that went over the node budget is neither passed nor
+    // failed.
+    void Push(int skill_id, bool pass, bool over_budget, 
+              const LanguageText &name, double duration) {
       if (to_screen_) {
         wprintf(L"%.4lf sec, (%03d) %ls %s\n",
                 duration,
                 skill_id,
                 name.c_str(),
-                pass ? "[PASS]" : "[fail]");
+                over_budget ? "[over budget]" : pass ? "[PASS]" : "[fail]");
       } else {
         (*output_stream_) << "(" << skill_id << " "
-                          << (pass ? ":PASS" : ":FAIL") << ")\n";
+                          << (over_budget ? ":OVER-BUDGET" : 
+                              pass ? ":PASS" : ":FAIL") << ")\n";
         output_stream_->flush();
       }
     }
@@ -246,13 +267,17 @@ namespace monster_avengers {
   };
 
 
-  class EncodeFormatter {
+  template <typename Key>
+  class BasicEncodeFormatter {
   public:
-    EncodeFormatter(const DataSet *data,
-		    const Query &query)
-      : data_(data), solver_(*data, query.effects) {}
+    BasicEncodeFormatter(const DataSet *data,
+                         const Query &query,
+                         JewelPlanCache<Key> *plans = nullptr)
+      : data_(data), solver_(*data, query.effects, plans, 
+                             SolverStrategy<Key>(query)) {}
     
-    void operator()(const ArmorSet &armor_set, std::string *output) {
+    void operator()(const BasicArmorSet<Key> &armor_set, 
+                    std::string *output) {
       EncodedArmorSet encoded(*data_, solver_, armor_set);
       *output += "(";
 	
@@ -311,8 +336,10 @@ namespace monster_avengers {
     }
     
     const DataSet *data_;
-    const JewelSolver solver_;
+    const BasicJewelSolver<Key> solver_;
   };
+
+  typedef BasicEncodeFormatter<Signature> EncodeFormatter;
 }  // namespace monster_avengers
 
 
@@ -0,0 +1,206 @@
+#include <unordered_map>
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "utils/signature.h"
+#include "utils/signature_table.h"
+#include "utils/jewels_query.h"
+#include "supp/helpers.h"
+#include "supp/timer.h"
+
+using namespace monster_avengers;
+
+// HoleClient tables built with sorted flat vectors (radix sort and
+// linear merges) against the hash set version they replaced, over
+// every (i, j, k) up to MAX_ONES/TWOS/THREES that fits in the given
+// number of holes. The skills are those of the 6 skills query in
+// core/test.cc, taken 3 and 6 at a time. Also checks that the tables
+// of Precompute() are the ones that Query() calculates on demand.
+//
+// Usage: hole_client_bench [dataset folder] [max holes, default 15]
+
+// The tables as HoleClient used to build them: every product is
+// inserted key by key into a hash set.
+class HashSetTables {
+public:
+  HashSetTables(const DataSet &data, const std::vector<Effect> &effects) {
+    std::vector<int> skill_ids;
+    for (const Effect &effect : effects) skill_ids.push_back(effect.skill_id);
+    bool valid = false;
+    for (const Jewel &jewel : data.jewels()) {
+      Signature key(jewel, skill_ids, effects, &valid);
+      if (valid) jewel_keys_[jewel.holes].insert(key);
+    }
+    answers_[0].insert(Signature());
+    for (int holes = 1; holes <= 3; ++holes) {
+      fixed_[holes][0].insert(Signature());
+    }
+  }
+
+  const SignatureSet &Calculate(int i, int j, int k) {
+    if (0 == k) return Calculate(i, j);
+    SignatureSet &answer = answers_[(k * HoleClient::MAX_TWOS + j) * 
+                                    HoleClient::MAX_ONES + i];
+    if (!answer.empty()) return answer;
+    SetProduct(Calculate(i, j), Fixed(3, k), &answer);
+    SetUnion(Calculate(i + 1, j + 1, k - 1), &answer);
+    return answer;
+  }
+
+private:
+  const SignatureSet &Fixed(int holes, int i) {
+    SignatureSet &answer = fixed_[holes][i];
+    if (!answer.empty()) return answer;
+    SetProduct(Fixed(holes, i - 1), jewel_keys_[holes], &answer);
+    return answer;
+  }
+
+  const SignatureSet &Calculate(int i) {
+    SignatureSet &answer = answers_[i];
+    if (!answer.empty()) return answer;
+    SetUnion(Fixed(1, i), &answer);
+    SetUnion(Calculate(i - 1), &answer);
+    return answer;
+  }
+
+  const SignatureSet &Calculate(int i, int j) {
+    if (0 == j) return Calculate(i);
+    SignatureSet &answer = answers_[j * HoleClient::MAX_ONES + i];
+    if (!answer.empty()) return answer;
+    SetProduct(Calculate(i), Fixed(2, j), &answer);
+    SetUnion(Calculate(i + 2, j - 1), &answer);
+    return answer;
+  }
+
+  void SetProduct(const SignatureSet &a, const SignatureSet &b,
+                  SignatureSet *c) {
+    for (const Signature &key_a : a) {
+      for (const Signature &key_b : b) {
+        c->insert(key_a + key_b);
+      }
+    }
+  }
+
+  void SetUnion(const SignatureSet &input, SignatureSet *base) {
+    for (const Signature &key : input) base->insert(key);
+  }
+
+  std::array<SignatureSet, 4> jewel_keys_;
+  std::array<std::array<SignatureSet, HoleClient::MAX_ONES>, 4> fixed_;
+  std::unordered_map<int, SignatureSet> answers_;
+};
+
+void Compare(const DataSet &data, const std::vector<Effect> &effects,
+             int max_holes) {
+  Timer timer;
+  HashSetTables hash_set(data, effects);
+  size_t hash_set_keys = 0;
+  timer.Tic();
+  for (int k = 0; k < HoleClient::MAX_THREES; ++k) {
+    for (int j = 0; j < HoleClient::MAX_TWOS; ++j) {
+      for (int i = 0; i < HoleClient::MAX_ONES; ++i) {
+        if (i + 2 * j + 3 * k > max_holes) continue;
+        hash_set_keys += hash_set.Calculate(i, j, k).size();
+      }
+    }
+  }
+  double hash_set_time = timer.Toc();
+
+  HoleClient sorted(data, effects);
+  size_t sorted_keys = 0;
+  timer.Tic();
+  for (int k = 0; k < HoleClient::MAX_THREES; ++k) {
+    for (int j = 0; j < HoleClient::MAX_TWOS; ++j) {
+      for (int i = 0; i < HoleClient::MAX_ONES; ++i) {
+        if (i + 2 * j + 3 * k > max_holes) continue;
+        sorted_keys += sorted.Query(i, j, k, 0, 1).size();
+      }
+    }
+  }
+  double sorted_time = timer.Toc();
+
+  CHECK(hash_set_keys == sorted_keys);
+  for (int k = 0; 3 * k <= max_holes && k < HoleClient::MAX_THREES; ++k) {
+    const SignatureSet &expected = hash_set.Calculate(0, 0, k);
+    for (const Signature &key : sorted.Query(0, 0, k, 0, 1)) {
+      CHECK(1 == expected.count(key));
+    }
+  }
+
+  wprintf(L"%d skills, %lld keys: hash set %.4lf sec, sorted %.4lf sec, "
+          L"%.2lfx\n", effects.size(), sorted_keys, hash_set_time, 
+          sorted_time, hash_set_time / sorted_time);
+}
+
+// Every layout that Precompute() covers, with and without a torso
+// multiplier, answers the same keys in the same order as a client
+// that calculates them on demand.
+void ComparePrecompute(const DataSet &data, const std::vector<Effect> &effects,
+                       int max_holes, bool skyline) {
+  const int max_groups = 7;
+  const int threads = 4;
+  HoleClient eager(data, effects, skyline);
+  HoleClient lazy(data, effects, skyline);
+  WorkerPool pool;
+  Timer timer;
+  timer.Tic();
+  eager.Precompute(max_groups, max_holes, HoleClient::MAX_MULTIPLIER,
+                   threads, &pool);
+  double eager_time = timer.Toc();
+  int layouts = 0;
+  for (int k = 0; k < HoleClient::MAX_THREES; ++k) {
+    for (int j = 0; j < HoleClient::MAX_TWOS; ++j) {
+      for (int i = 0; i < HoleClient::MAX_ONES; ++i) {
+        if (i + j + k > max_groups || i + 2 * j + 3 * k > max_holes) {
+          continue;
+        }
+        CHECK(lazy.Query(i, j, k, 0, 1) == eager.Query(i, j, k, 0, 1));
+        layouts++;
+        for (int multiplier = 2; multiplier <= HoleClient::MAX_MULTIPLIER;
+             ++multiplier) {
+          for (int extra = 1; extra <= 3; ++extra) {
+            CHECK(lazy.Query(i, j, k, extra, multiplier) == 
+                  eager.Query(i, j, k, extra, multiplier));
+            layouts++;
+          }
+        }
+      }
+    }
+  }
+  wprintf(L"%d skills, skyline %d: %d layouts precomputed in %.4lf sec "
+          L"on %d threads, same as on demand\n", effects.size(), skyline, 
+          layouts, eager_time, threads);
+}
+
+int main(int argc, char **argv) {
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+  CHECK(2 <= argc);
+  DataSet data(argv[1]);
+  int max_holes = 3 <= argc ? atoi(argv[2]) : 15;
+
+  Query query;
+  CHECK_SUCCESS(Query::Parse(L"(:weapon-type \"melee\")"
+                             L"(:weapon-holes 2)"
+                             L"(:skill 25 15)"
+                             L"(:skill 1 10)"
+                             L"(:skill 40 15)"
+                             L"(:skill 41 10)"
+                             L"(:skill 36 10)"
+                             L"(:skill 30 10)",
+                             &query));
+
+  wprintf(L"all (i, j, k) with i + 2j + 3k <= %d\n", max_holes);
+  Compare(data, std::vector<Effect>(query.effects.begin(), 
+                                    query.effects.begin() + 3),
+          max_holes);
+  Compare(data, query.effects, max_holes);
+
+  // The tables of 6 skills grow too fast to precompute them all.
+  for (bool skyline : {false, true}) {
+    ComparePrecompute(data, std::vector<Effect>(query.effects.begin(), 
+                                                query.effects.begin() + 3),
+                      max_holes, skyline);
+    ComparePrecompute(data, query.effects, (std::min)(max_holes, 6), 
+                      skyline);
+  }
+  return 0;
+}
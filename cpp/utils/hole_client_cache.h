@@ -0,0 +1,177 @@
+#ifndef _MONSTER_AVENGERS_HOLE_CLIENT_CACHE_
+#define _MONSTER_AVENGERS_HOLE_CLIENT_CACHE_
+
+#include <algorithm>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "data/data_set.h"
+#include "utils/jewels_query.h"
+
+namespace monster_avengers {
+
+  // HoleClientCache keeps the hole clients of recent queries, so that
+  // queries that share skills reuse the jewel tables instead of
+  // building them again.
+  //
+  // A hole client only depends on the skills it is built for, the
+  // ordered skills of the query (which decide the lanes of the keys)
+  // and the skyline flag, not on the required points. Clients are
+  // evicted in least recently used order once their memory exceeds
+  // the capacity. The memory of a client is measured once it is built,
+  // and again whenever a client is handed out while something besides
+  // the cache still holds it, as only those grow: their tables keep
+  // growing while they are being queried. The capacity is enforced
+  // whenever a client is handed out. Evicted clients stay alive as long
+  // as an iterator still holds them.
+  template <typename Key>
+  class HoleClientCache {
+  public:
+    typedef std::shared_ptr<BasicHoleClient<Key> > ClientPtr;
+
+    static const size_t DEFAULT_CAPACITY = 256 << 20;  // 256 MB
+
+    explicit HoleClientCache(size_t capacity = DEFAULT_CAPACITY)
+      : capacity_(capacity), entries_(), index_(), held_(), total_(0),
+        hits_(0), misses_(0) {}
+
+    ClientPtr Get(const DataSet &data, int skill_id, 
+                  const std::vector<Effect> &effects, bool skyline) {
+      return Get(data, std::vector<int>({skill_id}), effects, skyline);
+    }
+
+    // The client of the jewels of any of skill_ids.
+    ClientPtr Get(const DataSet &data, const std::vector<int> &skill_ids,
+                  const std::vector<Effect> &effects, bool skyline) {
+      std::vector<int> id;
+      id.push_back(skyline ? 1 : 0);
+      id.push_back(skill_ids.size());
+      id.insert(id.end(), skill_ids.begin(), skill_ids.end());
+      for (const Effect &effect : effects) {
+        id.push_back(effect.skill_id);
+      }
+
+      auto it = index_.find(id);
+      if (index_.end() != it) {
+        hits_++;
+        entries_.splice(entries_.begin(), entries_, it->second);
+      } else {
+        misses_++;
+        entries_.emplace_front();
+        Entry &entry = entries_.front();
+        entry.id = id;
+        entry.client.reset(new BasicHoleClient<Key>(data, skill_ids, 
+                                                    effects, skyline));
+        entry.bytes = entry.client->MemoryBytes();
+        total_ += entry.bytes;
+        index_[id] = entries_.begin();
+      }
+      ClientPtr client = entries_.front().client;
+      if (!entries_.front().held) {
+        entries_.front().held = true;
+        held_.push_back(entries_.begin());
+      }
+      Measure();
+      Evict();
+      return client;
+    }
+
+    void Clear() {
+      entries_.clear();
+      index_.clear();
+      held_.clear();
+      total_ = 0;
+    }
+
+    // The memory of the clients as measured by the last Get().
+    size_t MemoryBytes() const {
+      return total_;
+    }
+
+    inline size_t capacity() const {
+      return capacity_;
+    }
+
+    // Takes effect from the next Get().
+    void set_capacity(size_t capacity) {
+      capacity_ = capacity;
+    }
+
+    inline size_t size() const {
+      return entries_.size();
+    }
+
+    inline size_t hits() const {
+      return hits_;
+    }
+
+    inline size_t misses() const {
+      return misses_;
+    }
+
+  private:
+    struct Entry {
+      Entry() : id(), client(), bytes(0), held(false) {}
+
+      std::vector<int> id;
+      ClientPtr client;
+      // The memory of the client when it was last measured.
+      size_t bytes;
+      // Whether the client is in held_.
+      bool held;
+    };
+    typedef typename std::list<Entry>::iterator EntryIter;
+
+    // Measures the clients of held_ again, and drops those that only
+    // the cache holds any more, which stop growing.
+    void Measure() {
+      size_t i = 0;
+      while (i < held_.size()) {
+        Entry &entry = *held_[i];
+        size_t bytes = entry.client->MemoryBytes();
+        total_ = total_ - entry.bytes + bytes;
+        entry.bytes = bytes;
+        if (1 == entry.client.use_count()) {
+          entry.held = false;
+          held_[i] = held_.back();
+          held_.pop_back();
+        } else {
+          ++i;
+        }
+      }
+    }
+
+    // Drops the least recently used clients until the cache fits in
+    // the capacity. The most recent one is always kept.
+    void Evict() {
+      while (total_ > capacity_ && 1 < entries_.size()) {
+        Entry &entry = entries_.back();
+        total_ -= entry.bytes;
+        if (entry.held) {
+          EntryIter last = std::prev(entries_.end());
+          held_.erase(std::find(held_.begin(), held_.end(), last));
+        }
+        index_.erase(entry.id);
+        entries_.pop_back();
+      }
+    }
+
+    size_t capacity_;
+    std::list<Entry> entries_;
+    std::map<std::vector<int>, EntryIter> index_;
+    // The clients that were handed out, and that something besides the
+    // cache may still hold and grow.
+    std::vector<EntryIter> held_;
+    // The sum of the bytes of the entries.
+    size_t total_;
+    size_t hits_;
+    size_t misses_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_HOLE_CLIENT_CACHE_
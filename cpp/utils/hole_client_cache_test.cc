@@ -0,0 +1,170 @@
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "utils/signature.h"
+#include "utils/jewels_query.h"
+#include "utils/hole_client_cache.h"
+#include "supp/helpers.h"
+
+using namespace monster_avengers;
+
+// Checks the bookkeeping of HoleClientCache and JewelPlanCache: hits
+// and misses, least recently used eviction, the memory capacity of
+// the former and the plan capacity of the latter.
+//
+// Usage: hole_client_cache_test [dataset folder]
+
+typedef HoleClientCache<Signature> ClientCache;
+typedef JewelPlanCache<Signature> PlanCache;
+
+void HoleClientCacheTest(const DataSet &data) {
+  Query query;
+  CHECK_SUCCESS(Query::Parse(L"(:skill 36 10)"
+                             L"(:skill 41 10)"
+                             L"(:skill 40 15)",
+                             &query));
+  const std::vector<Effect> &effects = query.effects;
+  const int a = effects[0].skill_id;
+  const int b = effects[1].skill_id;
+  const int c = effects[2].skill_id;
+
+  // A client is shared by the queries of the same skills, ordered
+  // skills and skyline flag.
+  ClientCache cache;
+  ClientCache::ClientPtr client_a = cache.Get(data, a, effects, false);
+  CHECK(client_a == cache.Get(data, a, effects, false));
+  CHECK(1 == cache.hits() && 1 == cache.misses());
+  CHECK(client_a != cache.Get(data, a, effects, true));
+  std::vector<Effect> reversed(effects.rbegin(), effects.rend());
+  CHECK(client_a != cache.Get(data, a, reversed, false));
+  CHECK(client_a != cache.Get(data, std::vector<int>({a, b}), effects,
+                              false));
+  CHECK(4 == cache.size());
+  CHECK(1 == cache.hits() && 4 == cache.misses());
+  cache.Clear();
+  CHECK(0 == cache.size() && 0 == cache.MemoryBytes());
+
+  // The memory of fresh clients, which only hold their jewel keys.
+  ClientCache::ClientPtr client_b = cache.Get(data, b, effects, false);
+  ClientCache::ClientPtr client_c = cache.Get(data, c, effects, false);
+  const size_t memory_a = client_a->MemoryBytes();
+  const size_t memory_b = client_b->MemoryBytes();
+  const size_t memory_c = client_c->MemoryBytes();
+  CHECK(0 < memory_a && 0 < memory_b && 0 < memory_c);
+
+  // Room for all three but one byte: the least recently used client
+  // goes, and only that one.
+  {
+    ClientCache lru(memory_a + memory_b + memory_c - 1);
+    lru.Get(data, a, effects, false);
+    lru.Get(data, b, effects, false);
+    lru.Get(data, a, effects, false);
+    CHECK(2 == lru.size() && 1 == lru.hits() && 2 == lru.misses());
+    lru.Get(data, c, effects, false);
+    CHECK(2 == lru.size());
+    CHECK(lru.MemoryBytes() == memory_a + memory_c);
+    lru.Get(data, a, effects, false);
+    lru.Get(data, c, effects, false);
+    CHECK(3 == lru.hits() && 3 == lru.misses());
+    lru.Get(data, b, effects, false);
+    CHECK(4 == lru.misses());
+  }
+
+  // Clients grow as they are queried, which is only noticed when the
+  // next client is handed out. The most recent client is always kept,
+  // even over the capacity.
+  {
+    ClientCache growing(memory_a + memory_b);
+    ClientCache::ClientPtr client = growing.Get(data, a, effects, false);
+    for (int i = 0; i <= 5; ++i) client->Query(i, 2, 2, 0, 1);
+    CHECK(client->MemoryBytes() > memory_a + memory_b);
+    CHECK(memory_a == growing.MemoryBytes());
+    CHECK(client == growing.Get(data, a, effects, false));
+    CHECK(1 == growing.size());
+    CHECK(client->MemoryBytes() == growing.MemoryBytes());
+    growing.Get(data, b, effects, false);
+    CHECK(1 == growing.size() && memory_b == growing.MemoryBytes());
+    // The evicted client is still held here.
+    CHECK(1 == client.use_count());
+    CHECK(!client->Query(0, 2, 2, 0, 1).empty());
+    CHECK(client != growing.Get(data, a, effects, false));
+    CHECK(1 == growing.hits() && 3 == growing.misses());
+  }
+
+  // A smaller capacity takes effect from the next client handed out.
+  {
+    ClientCache shrunk;
+    shrunk.Get(data, a, effects, false);
+    shrunk.Get(data, b, effects, false);
+    CHECK(2 == shrunk.size());
+    shrunk.set_capacity(memory_b);
+    CHECK(2 == shrunk.size());
+    shrunk.Get(data, b, effects, false);
+    CHECK(1 == shrunk.size() && memory_b == shrunk.MemoryBytes());
+  }
+
+  // A capacity of zero keeps just the most recent client.
+  {
+    ClientCache single(0);
+    single.Get(data, a, effects, false);
+    single.Get(data, b, effects, false);
+    single.Get(data, b, effects, false);
+    single.Get(data, a, effects, false);
+    CHECK(1 == single.size());
+    CHECK(1 == single.hits() && 3 == single.misses());
+  }
+  wprintf(L"HoleClientCache: PASS\n");
+}
+
+Signature PlanKey(int points) {
+  Signature key;
+  key.lanes[Signature::EFFECTS_BEGIN] = points;
+  return key;
+}
+
+PlanCache::JewelPlan Plan(int jewel_id) {
+  PlanCache::JewelPlan plan;
+  plan.first[jewel_id] = 1;
+  return plan;
+}
+
+void JewelPlanCacheTest() {
+  const uint64_t fingerprint = PlanCache::Fingerprint({36, 41, 40});
+  CHECK(fingerprint != PlanCache::Fingerprint({41, 36, 40}));
+
+  PlanCache cache(2);
+  CHECK(nullptr == cache.Find(fingerprint, PlanKey(1), 1));
+  cache.Insert(fingerprint, PlanKey(1), 1, Plan(1));
+  cache.Insert(fingerprint, PlanKey(2), 1, Plan(2));
+  // Inserting a plan that is already there changes nothing.
+  cache.Insert(fingerprint, PlanKey(2), 1, Plan(3));
+  CHECK(2 == cache.size());
+  const PlanCache::JewelPlan *plan = cache.Find(fingerprint, PlanKey(2), 1);
+  CHECK(nullptr != plan && Plan(2) == *plan);
+
+  // The key, the multiplier and the fingerprint all tell plans apart.
+  CHECK(nullptr == cache.Find(fingerprint, PlanKey(2), 2));
+  CHECK(nullptr == cache.Find(fingerprint + 1, PlanKey(2), 1));
+  CHECK(nullptr == cache.Find(fingerprint, PlanKey(3), 1));
+  CHECK(1 == cache.hits() && 4 == cache.misses());
+
+  // Key 1 is used last, so key 2 is evicted at the capacity.
+  CHECK(nullptr != cache.Find(fingerprint, PlanKey(1), 1));
+  cache.Insert(fingerprint, PlanKey(3), 1, Plan(3));
+  CHECK(2 == cache.size());
+  CHECK(nullptr == cache.Find(fingerprint, PlanKey(2), 1));
+  plan = cache.Find(fingerprint, PlanKey(1), 1);
+  CHECK(nullptr != plan && Plan(1) == *plan);
+  plan = cache.Find(fingerprint, PlanKey(3), 1);
+  CHECK(nullptr != plan && Plan(3) == *plan);
+  CHECK(4 == cache.hits() && 5 == cache.misses());
+  wprintf(L"JewelPlanCache: PASS\n");
+}
+
+int main(int argc, char **argv) {
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+  CHECK(2 <= argc);
+  DataSet data(argv[1]);
+  HoleClientCacheTest(data);
+  JewelPlanCacheTest();
+  return 0;
+}
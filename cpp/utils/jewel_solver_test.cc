@@ -0,0 +1,120 @@
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "utils/signature.h"
+#include "utils/jewels_query.h"
+#include "supp/helpers.h"
+#include "supp/timer.h"
+
+using namespace monster_avengers;
+
+// Differential test of the JewelSolver strategies. The keys are what
+// the hole client of the 6 skills query in core/test.cc produces for
+// a range of hole layouts, which is what the formatters solve.
+//
+// Usage: jewel_solver_test [dataset folder]
+
+const int SAMPLES = 5000;
+
+typedef JewelSolver::JewelPlan JewelPlan;
+
+int CountJewels(const JewelPlan &plan) {
+  int count = 0;
+  for (const auto &item : plan.first) count += item.second;
+  for (const auto &item : plan.second) count += item.second;
+  return count;
+}
+
+// The points of the jewels in plan, with the body jewels scaled.
+Signature PlanPoints(const DataSet &data, const std::vector<Effect> &effects,
+                     const JewelPlan &plan, int multiplier) {
+  std::vector<int> skill_ids;
+  for (const Effect &effect : effects) {
+    skill_ids.push_back(effect.skill_id);
+  }
+  bool valid = false;
+  Signature points;
+  for (const auto &item : plan.first) {
+    Signature key(data.jewel(item.first), skill_ids, effects, &valid);
+    for (int i = 0; i < item.second; ++i) points = points | key;
+  }
+  for (const auto &item : plan.second) {
+    Signature key(data.jewel(item.first), skill_ids, effects, &valid);
+    key *= multiplier;
+    for (int i = 0; i < item.second; ++i) points = points | key;
+  }
+  return points;
+}
+
+int main(int argc, char **argv) {
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+  CHECK(2 <= argc);
+  DataSet data(argv[1]);
+
+  Query query;
+  CHECK_SUCCESS(Query::Parse(L"(:weapon-type \"melee\")"
+                             L"(:weapon-holes 2)"
+                             L"(:skill 25 15)"
+                             L"(:skill 1 10)"
+                             L"(:skill 40 15)"
+                             L"(:skill 41 10)"
+                             L"(:skill 36 10)"
+                             L"(:skill 30 10)",
+                             &query));
+
+  HoleClient hole_client(data, query.effects);
+  JewelSolver backtrack(data, query.effects, nullptr, JewelSolver::BACKTRACK);
+  JewelSolver knapsack(data, query.effects, nullptr, JewelSolver::KNAPSACK);
+  JewelSolver fewest(data, query.effects, nullptr, 
+                     JewelSolver::KNAPSACK_FEWEST);
+
+  struct Layout {
+    int one, two, three, extra, multiplier;
+  };
+  const std::vector<Layout> layouts {
+    {3, 1, 1, 0, 1}, {6, 2, 1, 0, 1}, {2, 2, 2, 0, 1},
+    {4, 1, 0, 1, 2}, {3, 1, 1, 2, 3}, {5, 0, 1, 3, 2},
+  };
+
+  int keys = 0;
+  int saved = 0;
+  double backtrack_time = 0.0;
+  double knapsack_time = 0.0;
+  Timer timer;
+  for (const Layout &layout : layouts) {
+    const std::vector<Signature> &jewel_keys = 
+      hole_client.Query(layout.one, layout.two, layout.three, 
+                        layout.extra, layout.multiplier);
+    // The backtracking search is slow, so only a sample of the keys
+    // are solved.
+    const int step = std::max<int>(1, jewel_keys.size() / SAMPLES);
+    for (int i = 0; i < jewel_keys.size(); i += step) {
+      const Signature &key = jewel_keys[i];
+      timer.Tic();
+      JewelPlan expected = backtrack.Solve(key, layout.multiplier);
+      backtrack_time += timer.Toc();
+      timer.Tic();
+      JewelPlan plan = knapsack.Solve(key, layout.multiplier);
+      knapsack_time += timer.Toc();
+      // Without KNAPSACK_FEWEST the plans are the same.
+      CHECK(expected == plan);
+
+      // The fewest jewels plan has the points of the key, with no more
+      // jewels than the full one.
+      JewelPlan fewest_plan = fewest.Solve(key, layout.multiplier);
+      Signature points = PlanPoints(data, query.effects, fewest_plan,
+                                    layout.multiplier);
+      for (int i = sig::EFFECTS_BEGIN; i < Signature::LANES; ++i) {
+        CHECK(key.lanes[i] == points.lanes[i]);
+      }
+      CHECK(CountJewels(fewest_plan) <= CountJewels(plan));
+      saved += CountJewels(plan) - CountJewels(fewest_plan);
+      keys++;
+    }
+  }
+
+  wprintf(L"%d keys, %d jewels saved by the fewest jewels plans.\n", 
+          keys, saved);
+  wprintf(L"backtrack %.4lf sec, knapsack %.4lf sec.\n", 
+          backtrack_time, knapsack_time);
+  return 0;
+}
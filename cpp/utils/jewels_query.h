@@ -1,69 +1,244 @@
 #ifndef _MONSTER_AVENGERS_JEWELS_QUERY_
 #define _MONSTER_AVENGERS_JEWELS_QUERY_
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <deque>
+#include <limits>
+#include <list>
+#include <numeric>
 #include <vector>
 #include <utility>
-#include <unordered_set>
 #include <unordered_map>
 #include "utils/signature.h"
+#include "utils/signature_table.h"
+#include "utils/worker_pool.h"
 
 namespace monster_avengers {
 
   
-  class HoleClient {
+  template <typename Key>
+  class BasicHoleClient {
   public:
     const static int MAX_ONES = 24;
     const static int MAX_TWOS = 8;
     const static int MAX_THREES = 8;
+    const static int MAX_MULTIPLIER = 5;
 
-    HoleClient(const DataSet &data, 
+    // With skyline set, every answer only keeps the keys that are not
+    // dominated by another key using the same holes, i.e. the keys for
+    // which no other jewel combination of the same holes provides at
+    // least as many points on every skill. Whether an armor set can be
+    // completed with jewels does not change, but the answers (and so
+    // the jewel keys carried by the search results) are much smaller.
+    BasicHoleClient(const DataSet &data, 
                const std::vector<int> &skill_ids,
-               const std::vector<Effect> &effects)
-      : jewel_keys_() {
+               const std::vector<Effect> &effects,
+               bool skyline = false)
+      : jewel_keys_(), fixed_ready_(), answers_(), index_(), 
+        skyline_(skyline) {
       bool valid = false;
 
       for (const Jewel &jewel : data.jewels()) {
-        Signature key = Signature(jewel, skill_ids, 
+        Key key = Key(jewel, skill_ids, 
                                   effects, &valid);
         if (valid) {
-          jewel_keys_[jewel.holes].insert(key);
+          jewel_keys_[jewel.holes].push_back(key);
         }
       }
+
+      for (int holes = 1; holes <= 3; ++holes) {
+        SortUnique(&jewel_keys_[holes]);
+        if (skyline_) Skyline(&jewel_keys_[holes]);
+      }
       
-      buffer_[0].insert(Signature());
-      fixed_buffer_[1][0].insert(Signature());
-      fixed_buffer_[2][0].insert(Signature());
-      fixed_buffer_[3][0].insert(Signature());
+      Create(0)->push_back(Key());
+      fixed_buffer_[1][0].push_back(Key());
+      fixed_buffer_[2][0].push_back(Key());
+      fixed_buffer_[3][0].push_back(Key());
+      fixed_ready_.fill(1);
     }
     
-    HoleClient(const DataSet &data, 
-               const std::vector<Effect> &effects) 
-      : HoleClient(data, SkillIdsFromEffects(effects), effects) {}
+    BasicHoleClient(const DataSet &data, 
+               const std::vector<Effect> &effects,
+               bool skyline = false) 
+      : BasicHoleClient(data, SkillIdsFromEffects(effects), effects, 
+                        skyline) {}
     
-    HoleClient(const DataSet &data, int skill_id, 
-               const std::vector<Effect> &effects) 
-      : HoleClient(data, std::vector<int>({skill_id}), 
-                   effects) {}
+    BasicHoleClient(const DataSet &data, int skill_id, 
+               const std::vector<Effect> &effects,
+               bool skyline = false) 
+      : BasicHoleClient(data, std::vector<int>({skill_id}), 
+                   effects, skyline) {}
     
-    inline const std::unordered_set<Signature> &Query(Signature input) {
+    // The answers are sorted in Compare() order and have no
+    // duplicates, in a contiguous array that can be scanned with
+    // sig::SatisfyBatch().
+    inline const std::vector<Key> &Query(Key input) {
       int i(0), j(0), k(0);
       sig::KeyHoles(input, &i, &j, &k);
       return Calculate(i, j, k, input.BodyHoleSum(), input.multiplier());
     }
 
-    inline const std::unordered_set<Signature> &Query(int i, 
-                                                      int j, 
-                                                      int k,
-                                                      int extra,
-                                                      int multiplier) {
+    inline const std::vector<Key> &Query(int i, int j, int k,
+                                         int extra, int multiplier) {
       return Calculate(i, j, k, extra, multiplier);
     }
 
+    // Calculates every answer that an armor set with at most
+    // max_groups groups of holes, max_holes holes in total and a torso
+    // multiplier up to max_multiplier can ask for, instead of leaving
+    // it to the first Query() of each layout. A table only depends on
+    // smaller tables, so the tables are calculated in waves, each
+    // wave only depending on the ones before it, and the tables of one
+    // wave are spread over up to workers workers of pool. The answers
+    // are the same as the ones Query() calculates on demand, which it
+    // still does for any layout left out here.
+    void Precompute(int max_groups, int max_holes, int max_multiplier,
+                    int workers, WorkerPool *pool) {
+      std::unordered_map<int, int> depths;
+      std::vector<std::vector<Layout> > waves;
+      for (int k = 0; k < MAX_THREES; ++k) {
+        for (int j = 0; j < MAX_TWOS; ++j) {
+          for (int i = 0; i < MAX_ONES; ++i) {
+            if (i + j + k > max_groups || i + 2 * j + 3 * k > max_holes) {
+              continue;
+            }
+            Schedule(Layout::Answer(i, j, k), &depths, &waves);
+            for (int multiplier = 2; 
+                 multiplier <= (std::min)(max_multiplier, MAX_MULTIPLIER);
+                 ++multiplier) {
+              for (int extra = 1; extra <= 3; ++extra) {
+                Schedule(Layout::Answer(i, j, k, extra, multiplier), 
+                         &depths, &waves);
+              }
+            }
+          }
+        }
+      }
+
+      for (const std::vector<Layout> &wave : waves) {
+        // Allocate the outputs up front, so that the workers only read
+        // the index.
+        std::vector<std::vector<Key>*> outputs;
+        for (const Layout &layout : wave) {
+          outputs.push_back(0 < layout.holes ? 
+                            &fixed_buffer_[layout.holes][layout.i] :
+                            Create(layout.Id()));
+        }
+
+        std::atomic<int> next(0);
+        auto work = [this, &wave, &outputs, &next](int worker) {
+          for (int id = next++; id < wave.size(); id = next++) {
+            Fill(wave[id], outputs[id]);
+          }
+        };
+        pool->Run((std::min)(workers, static_cast<int>(wave.size())), work);
+
+        for (const Layout &layout : wave) {
+          if (0 < layout.holes) fixed_ready_[layout.holes] = layout.i + 1;
+        }
+      }
+    }
+
+    // The order of the answers: by sig::Hash() first, and by the bytes
+    // of the keys for keys that share a hash.
+    static inline int Compare(const Key &a, uint64_t hash_a,
+                              const Key &b, uint64_t hash_b) {
+      if (hash_a != hash_b) return hash_a < hash_b ? -1 : 1;
+      return memcmp(a.lanes, b.lanes, sizeof(a.lanes));
+    }
+
+    // Sorts keys in Compare() order and removes the duplicates. The
+    // keys are radix sorted by their hash, which leaves only runs of
+    // colliding hashes to be ordered by comparison.
+    static void SortUnique(std::vector<Key> *keys) {
+      const size_t n = keys->size();
+      if (2 > n) return;
+
+      typedef std::pair<uint64_t, uint32_t> Item;
+      std::vector<Item> items(n);
+      std::vector<Item> scratch(n);
+      for (size_t i = 0; i < n; ++i) {
+        items[i] = Item(sig::Hash((*keys)[i]), static_cast<uint32_t>(i));
+      }
+
+      size_t count[RADIX_BUCKETS];
+      for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+        std::fill(count, count + RADIX_BUCKETS, 0);
+        for (const Item &item : items) {
+          count[(item.first >> shift) & (RADIX_BUCKETS - 1)]++;
+        }
+        // Nothing to do if every hash has the same digit.
+        if (n == count[(items[0].first >> shift) & (RADIX_BUCKETS - 1)]) {
+          continue;
+        }
+        size_t offset = 0;
+        for (size_t &bucket : count) {
+          size_t size = bucket;
+          bucket = offset;
+          offset += size;
+        }
+        for (const Item &item : items) {
+          scratch[count[(item.first >> shift) & (RADIX_BUCKETS - 1)]++] = 
+            item;
+        }
+        items.swap(scratch);
+      }
+
+      std::vector<Key> sorted;
+      sorted.reserve(n);
+      for (size_t begin = 0; begin < n;) {
+        size_t end = begin + 1;
+        while (end < n && items[end].first == items[begin].first) ++end;
+        if (end - begin > 1) {
+          std::sort(items.begin() + begin, items.begin() + end,
+                    [keys](const Item &a, const Item &b) {
+                      return 0 > memcmp((*keys)[a.second].lanes, 
+                                        (*keys)[b.second].lanes, 
+                                        sizeof(Key));
+                    });
+        }
+        sorted.push_back((*keys)[items[begin].second]);
+        for (size_t i = begin + 1; i < end; ++i) {
+          const Key &key = (*keys)[items[i].second];
+          if (!(key == sorted.back())) sorted.push_back(key);
+        }
+        begin = end;
+      }
+      keys->swap(sorted);
+    }
+
+    // Merges the sorted unique keys of a and b into c, which is also
+    // sorted and unique.
+    static void Merge(const std::vector<Key> &a, const std::vector<Key> &b,
+                      std::vector<Key> *c) {
+      c->clear();
+      c->reserve(a.size() + b.size());
+      size_t i = 0;
+      size_t j = 0;
+      uint64_t hash_a = a.empty() ? 0 : sig::Hash(a[0]);
+      uint64_t hash_b = b.empty() ? 0 : sig::Hash(b[0]);
+      while (i < a.size() && j < b.size()) {
+        int order = Compare(a[i], hash_a, b[j], hash_b);
+        if (0 >= order) {
+          c->push_back(a[i]);
+          if (++i < a.size()) hash_a = sig::Hash(a[i]);
+        }
+        if (0 <= order) {
+          if (0 < order) c->push_back(b[j]);
+          if (++j < b.size()) hash_b = sig::Hash(b[j]);
+        }
+      }
+      c->insert(c->end(), a.begin() + i, a.end());
+      c->insert(c->end(), b.begin() + j, b.end());
+    }
+
     // Use the hole aligment from stuffed to stuff the original hole
     // aligment, and get the residual hole alignment.
-    static void GetResidual(const Signature &original, 
-                            const Signature &stuffed,
+    static void GetResidual(const Key &original, 
+                            const Key &stuffed,
                             int *i, int *j, int *k, int *extra) {
       sig::KeyHoles(original, i, j, k);
       int one(0), two(0), three(0);
@@ -109,20 +284,39 @@ namespace monster_avengers {
       *extra = original.BodyHoleSum() - stuffed.BodyHoleSum();
     }
 
-    // This is only for unit test purpose.
-    std::unordered_set<Signature> DFS(int i, int j, int k) {
-      std::array<std::vector<Signature>, 4> jewels;
-      for (int holes = 1; holes <= 3; ++holes) {
-        for (const Signature &key : jewel_keys_[holes]) {
-          jewels[holes].push_back(key);
+    // Approximate number of bytes held by the jewel keys and the
+    // answers calculated so far.
+    size_t MemoryBytes() const {
+      size_t total = 0;
+      for (const std::vector<Key> &keys : jewel_keys_) {
+        total += keys.capacity() * sizeof(Key);
+      }
+      for (const auto &row : fixed_buffer_) {
+        for (const std::vector<Key> &answer : row) {
+          total += answer.capacity() * sizeof(Key);
         }
       }
-      std::unordered_set<Signature> result;
-      DFS(i, j, k, 3, 0, Signature(), jewels, &result);
+      for (const std::vector<Key> &answer : answers_) {
+        total += sizeof(answer) + answer.capacity() * sizeof(Key);
+      }
+      return total + index_.size() * (sizeof(std::pair<int, int>) + 
+                                      sizeof(void*));
+    }
+
+    // This is only for unit test purpose.
+    BasicSignatureSet<Key> DFS(int i, int j, int k) {
+      BasicSignatureSet<Key> result;
+      DFS(i, j, k, 3, 0, Key(), jewel_keys_, &result);
       return result;
     }
 
   private:
+    // SetProduct() sorts the sums in blocks of at most this many keys,
+    // which bounds its scratch memory.
+    static const size_t PRODUCT_BLOCK = 1 << 16;
+    static const int RADIX_BITS = 8;
+    static const size_t RADIX_BUCKETS = 1 << RADIX_BITS;
+
     std::vector<int> SkillIdsFromEffects(const std::vector<Effect> &effects) {
       std::vector<int> skill_ids;
       for (const Effect &effect : effects) {
@@ -131,117 +325,264 @@ namespace monster_avengers {
       return skill_ids;
     }
 
-    inline void SetProduct(const std::unordered_set<Signature> &a,
-                    const std::unordered_set<Signature> &b,
-                    std::unordered_set<Signature> *c) {
-      for (const Signature &key_a : a) {
-        for (const Signature &key_b : b) {
-          c->insert(key_a + key_b);
-        }
+    // The memo index of the answer to Query(i, j, k, extra,
+    // multiplier).
+    static int LayoutIndex(int i, int j, int k, int extra, int multiplier) {
+      if (2 > multiplier || 0 == extra) {
+        return (k * MAX_TWOS + j) * MAX_ONES + i;
       }
+      return ((((multiplier - 1) * 3 + (extra - 1)) * MAX_THREES + k) * MAX_TWOS 
+              + j) * MAX_ONES + i;
     }
 
-    inline void SetUnion(const std::unordered_set<Signature> &input,
-                  std::unordered_set<Signature> *base) {
-      for (const Signature &key : input) {
-        base->insert(key);
-      }
+    // The memoized answer at index, or nullptr if it has not been
+    // calculated yet.
+    inline const std::vector<Key> *Find(int index) const {
+      auto it = index_.find(index);
+      return index_.end() == it ? nullptr : &answers_[it->second];
     }
 
-    const std::unordered_set<Signature> &CalculateFixed(int holes, int i) {
-      if (!fixed_buffer_[holes][i].empty()) {
-        return fixed_buffer_[holes][i];
-      }
-      SetProduct(CalculateFixed(holes, i - 1),
-                 jewel_keys_[holes],
-                 &fixed_buffer_[holes][i]);
-      return fixed_buffer_[holes][i];
+    // Allocates the answer at index. Answers live in a deque so that
+    // the references handed out stay valid while more are created.
+    inline std::vector<Key> *Create(int index) {
+      index_[index] = static_cast<int>(answers_.size());
+      answers_.emplace_back();
+      return &answers_.back();
     }
 
-    const std::unordered_set<Signature> &Calculate(int i) {
-      if (!buffer_[i].empty()) {
-        return buffer_[i];
+    // Sets c to the sorted unique sums of a key from a and a key from
+    // b. The rows of a are added to b a block at a time, and each
+    // sorted block is merged into c.
+    void SetProduct(const std::vector<Key> &a, const std::vector<Key> &b,
+                    std::vector<Key> *c) {
+      c->clear();
+      if (b.empty()) return;
+      const size_t rows = std::max<size_t>(1, PRODUCT_BLOCK / b.size());
+      std::vector<Key> block;
+      std::vector<Key> merged;
+      for (size_t begin = 0; begin < a.size(); begin += rows) {
+        const size_t end = std::min(a.size(), begin + rows);
+        block.resize((end - begin) * b.size());
+        Key *sum = block.data();
+        for (size_t row = begin; row < end; ++row) {
+          for (const Key &key_b : b) {
+            *(sum++) = a[row] + key_b;
+          }
+        }
+        SortUnique(&block);
+        if (c->empty()) {
+          c->swap(block);
+        } else {
+          Merge(*c, block, &merged);
+          c->swap(merged);
+        }
       }
+    }
 
-      buffer_[i] = CalculateFixed(1, i);
-      SetUnion(Calculate(i - 1),
-               &buffer_[i]);
-      return buffer_[i];
+    void SetUnion(const std::vector<Key> &input, std::vector<Key> *base) {
+      std::vector<Key> merged;
+      Merge(*base, input, &merged);
+      base->swap(merged);
     }
 
-    const std::unordered_set<Signature> &Calculate(int i, int j) {
-      int index = j * MAX_ONES + i;
-      
-      if (!buffer_[index].empty()) {
-        return buffer_[index];
+    // Removes the dominated keys from keys. The keys are ordered by
+    // holes, then by the points of the first skill and then by the
+    // total points, both descending. A key can then only be dominated
+    // by a key that comes before it, and it is enough to check it
+    // against the keys kept so far for the same holes.
+    void Skyline(std::vector<Key> *keys) {
+      const std::vector<Key> &input = *keys;
+      std::vector<int> totals(input.size(), 0);
+      for (int id = 0; id < input.size(); ++id) {
+        for (int lane = Key::EFFECTS_BEGIN; lane < Key::LANES; ++lane) {
+          totals[id] += input[id].lanes[lane];
+        }
       }
       
-      if (0 == j) {
-        return Calculate(i);
+      std::vector<int> order(input.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::sort(order.begin(), order.end(), 
+                [&input, &totals](int a, int b) {
+                  int holes = memcmp(input[a].lanes, input[b].lanes, 
+                                     Key::EFFECTS_BEGIN * 
+                                     sizeof(typename Key::LaneType));
+                  if (0 != holes) return holes < 0;
+                  const int first = Key::EFFECTS_BEGIN;
+                  if (input[a].lanes[first] != input[b].lanes[first]) {
+                    return input[a].lanes[first] > input[b].lanes[first];
+                  }
+                  if (totals[a] != totals[b]) return totals[a] > totals[b];
+                  return a < b;
+                });
+
+      // Ids of the keys kept so far, in sweep order.
+      std::vector<int> kept;
+      std::vector<bool> keep(input.size(), false);
+      size_t group_begin = 0;
+      for (int id : order) {
+        const Key &key = input[id];
+        if (group_begin < kept.size() && 
+            !sig::SameHoles(input[kept[group_begin]], key)) {
+          group_begin = kept.size();
+        }
+        bool dominated = false;
+        for (size_t i = group_begin; i < kept.size(); ++i) {
+          if (sig::Dominates(input[kept[i]], key)) {
+            dominated = true;
+            break;
+          }
+        }
+        if (!dominated) {
+          kept.push_back(id);
+          keep[id] = true;
+        }
       }
 
-      SetProduct(Calculate(i),
-                 CalculateFixed(2, j),
-                 &buffer_[index]);
-      SetUnion(Calculate(i + 2, j - 1),
-               &buffer_[index]);
-      
-      return buffer_[index];
+      if (kept.size() == input.size()) return;
+      // Compact in place, which keeps the Compare() order.
+      size_t size = 0;
+      for (size_t id = 0; id < keep.size(); ++id) {
+        if (keep[id]) (*keys)[size++] = (*keys)[id];
+      }
+      keys->resize(size);
     }
 
-    const std::unordered_set<Signature> &Calculate(int i, int j, int k) {
-      int index = (k * MAX_TWOS + j) * MAX_ONES + i;
-      if (!buffer_[index].empty()) {
-        return buffer_[index];
+    // A table of the recursion: either the answer to Query(i, j, k,
+    // extra, multiplier), or with holes > 0 the sums of exactly i
+    // jewels of that many holes.
+    struct Layout {
+      int holes;
+      int i, j, k;
+      int extra;
+      int multiplier;
+
+      static Layout Answer(int i, int j, int k, 
+                           int extra = 0, int multiplier = 1) {
+        if (2 > multiplier || 0 == extra) {
+          extra = 0;
+          multiplier = 1;
+        }
+        return {0, i, j, k, extra, multiplier};
       }
-        
-      if (0 == j && 0 == k) {
-        return Calculate(i);
+
+      static Layout Fixed(int holes, int i) {
+        return {holes, i, 0, 0, 0, 1};
       }
 
-      if (0 == k) {
-        return Calculate(i, j);
+      int Id() const {
+        if (0 < holes) return FIXED_ID_BEGIN + holes * MAX_ONES + i;
+        return LayoutIndex(i, j, k, extra, multiplier);
       }
+    };
 
-      SetProduct(Calculate(i, j), CalculateFixed(3, k),
-                 &buffer_[index]);
-      SetUnion(Calculate(i + 1, j + 1, k - 1),
-               &buffer_[index]);
-      return buffer_[index];
-    }
+    static const int FIXED_ID_BEGIN = 
+      MAX_ONES * MAX_TWOS * MAX_THREES * 3 * MAX_MULTIPLIER;
 
-    const std::unordered_set<Signature> &Calculate(int i, int j, int k, 
-                                                   int extra, int multiplier) {
-      const std::unordered_set<Signature> &base_answer = Calculate(i, j, k);
-      if (2 > multiplier || 0 == extra) {
-        return base_answer;
+    // The tables that Fill(layout) reads.
+    static std::vector<Layout> Dependencies(const Layout &layout) {
+      const int &i = layout.i;
+      const int &j = layout.j;
+      const int &k = layout.k;
+      if (0 < layout.holes) {
+        return {Layout::Fixed(layout.holes, i - 1)};
+      } else if (0 < layout.extra) {
+        return {Layout::Answer(i, j, k), 
+                Layout::Answer(1 == layout.extra ? 1 : 0, 
+                               2 == layout.extra ? 1 : 0,
+                               3 == layout.extra ? 1 : 0)};
+      } else if (0 < k) {
+        return {Layout::Answer(i, j, 0), Layout::Fixed(3, k),
+                Layout::Answer(i + 1, j + 1, k - 1)};
+      } else if (0 < j) {
+        return {Layout::Answer(i, 0, 0), Layout::Fixed(2, j),
+                Layout::Answer(i + 2, j - 1, 0)};
       }
+      return {Layout::Fixed(1, i), Layout::Answer(i - 1, 0, 0)};
+    }
 
-      int index = ((((multiplier -1) * 3 + (extra - 1)) * MAX_THREES + k) * MAX_TWOS 
-                   + j) * MAX_ONES + i;
+    bool Available(const Layout &layout) const {
+      if (0 < layout.holes) return layout.i < fixed_ready_[layout.holes];
+      return nullptr != Find(layout.Id());
+    }
+
+    // The table of layout, which must be available.
+    const std::vector<Key> &Table(const Layout &layout) const {
+      if (0 < layout.holes) return fixed_buffer_[layout.holes][layout.i];
+      return *Find(layout.Id());
+    }
 
-      if (!buffer_[index].empty()) {
-        return buffer_[index];
+    // Calculates the table of layout into output, from the tables of
+    // its dependencies which must all be available.
+    void Fill(const Layout &layout, std::vector<Key> *output) {
+      const std::vector<Layout> dependencies = Dependencies(layout);
+      if (0 < layout.holes) {
+        SetProduct(Table(dependencies[0]), jewel_keys_[layout.holes], 
+                   output);
+      } else if (0 < layout.extra) {
+        std::vector<Key> transformed;
+        for (Key key : Table(dependencies[1])) {
+          key.BodyRefactor(layout.multiplier);
+          transformed.push_back(key);
+        }
+        SortUnique(&transformed);
+        SetProduct(Table(dependencies[0]), transformed, output);
+      } else if (0 < layout.j || 0 < layout.k) {
+        SetProduct(Table(dependencies[0]), Table(dependencies[1]), output);
+        SetUnion(Table(dependencies[2]), output);
+      } else {
+        *output = Table(dependencies[0]);
+        SetUnion(Table(dependencies[1]), output);
+        // The two parts use different holes and are pruned already.
+        return;
       }
-      
-      const std::unordered_set<Signature> &extension = 
-        1 == extra ? Calculate(1, 0, 0) :
-        (2 == extra ? Calculate(0, 1, 0) : Calculate(0, 0, 1));
-      
-      std::unordered_set<Signature> transformed;
-      
-      for (Signature key : extension) {
-        key.BodyRefactor(multiplier);
-        transformed.insert(key);
+      if (skyline_) Skyline(output);
+    }
+
+    // Makes layout available, calculating its dependencies first.
+    const std::vector<Key> &Calculate(const Layout &layout) {
+      if (Available(layout)) return Table(layout);
+      for (const Layout &dependency : Dependencies(layout)) {
+        Calculate(dependency);
       }
-      
-      SetProduct(base_answer, transformed, &buffer_[index]);
-      return buffer_[index];
+      if (0 < layout.holes) {
+        Fill(layout, &fixed_buffer_[layout.holes][layout.i]);
+        fixed_ready_[layout.holes] = layout.i + 1;
+        return fixed_buffer_[layout.holes][layout.i];
+      }
+      std::vector<Key> *answer = Create(layout.Id());
+      Fill(layout, answer);
+      return *answer;
+    }
+
+    const std::vector<Key> &Calculate(int i, int j, int k, 
+                                      int extra, int multiplier) {
+      return Calculate(Layout::Answer(i, j, k, extra, multiplier));
+    }
+
+    // Appends layout and the dependencies that are not available yet
+    // to waves, each in the wave right after its last dependency.
+    // Returns the wave of layout plus one, or 0 if it is available.
+    int Schedule(const Layout &layout, 
+                 std::unordered_map<int, int> *depths,
+                 std::vector<std::vector<Layout> > *waves) const {
+      auto it = depths->find(layout.Id());
+      if (depths->end() != it) return it->second;
+      int depth = 0;
+      if (!Available(layout)) {
+        for (const Layout &dependency : Dependencies(layout)) {
+          depth = (std::max)(depth, Schedule(dependency, depths, waves));
+        }
+        if (waves->size() <= depth) waves->resize(depth + 1);
+        (*waves)[depth].push_back(layout);
+        depth++;
+      }
+      (*depths)[layout.Id()] = depth;
+      return depth;
     }
 
-    void DFS(int i, int j, int k, int holes, int id, Signature key,
-             const std::array<std::vector<Signature>, 4> &jewels,
-             std::unordered_set<Signature> *result) {
+    void DFS(int i, int j, int k, int holes, int id, Key key,
+             const std::array<std::vector<Key>, 4> &jewels,
+             BasicSignatureSet<Key> *result) {
       result->insert(key);
       if (0 == i + j + k) {
         return;
@@ -290,32 +631,70 @@ namespace monster_avengers {
     }
 
     
-    std::array<std::unordered_set<Signature>, 4> jewel_keys_;
-    std::array<std::array<std::unordered_set<Signature>, 
-                          MAX_ONES>, 4> fixed_buffer_;
-    std::array<std::unordered_set<Signature>, 
-               MAX_ONES * MAX_TWOS * MAX_THREES * 3 * 5> buffer_;
+    std::array<std::vector<Key>, 4> jewel_keys_;
+    std::array<std::array<std::vector<Key>, MAX_ONES>, 4> fixed_buffer_;
+    // fixed_buffer_[holes][i] is calculated for every i below
+    // fixed_ready_[holes].
+    std::array<int, 4> fixed_ready_;
+    // Answers to Calculate(), allocated on first use. index_ maps the
+    // LayoutIndex() of a query to its position in answers_.
+    std::deque<std::vector<Key> > answers_;
+    std::unordered_map<int, int> index_;
+    bool skyline_;
   };
 
+  template <typename Key>
+  const int BasicHoleClient<Key>::MAX_ONES;
+  template <typename Key>
+  const int BasicHoleClient<Key>::MAX_TWOS;
+  template <typename Key>
+  const int BasicHoleClient<Key>::MAX_THREES;
+  template <typename Key>
+  const int BasicHoleClient<Key>::MAX_MULTIPLIER;
+
+  typedef BasicHoleClient<Signature> HoleClient;
+
+  template <typename Key>
+  class JewelPlanCache;
 
-  class JewelSolver {
+
+  template <typename Key>
+  class BasicJewelSolver {
   public:
     typedef std::pair<std::unordered_map<int, int>, 
                       std::unordered_map<int, int> > JewelPlan;
 
+    enum Strategy {
+      // Memoized knapsack, see Knapsack().
+      KNAPSACK = 0,
+      // Memoized knapsack that may leave holes empty, and returns a
+      // plan with the fewest jewels.
+      KNAPSACK_FEWEST,
+      // The original depth first search, see Search(). Kept for
+      // differential testing.
+      BACKTRACK,
+    };
     
-    JewelSolver(const DataSet &data, 
-                const std::vector<Effect> &effects)
-      : jewel_keys_() {
+    // Plans are looked up in and added to plans, when given. It can be
+    // shared by the solvers of any queries.
+    BasicJewelSolver(const DataSet &data, 
+                const std::vector<Effect> &effects,
+                JewelPlanCache<Key> *plans = nullptr,
+                Strategy strategy = KNAPSACK)
+      : jewel_keys_(), plans_(plans), fingerprint_(0), strategy_(strategy) {
       bool valid = false;
       std::vector<int> skill_ids;
       for (const Effect &effect : effects) {
         skill_ids.push_back(effect.skill_id);
       }
+      // Plans of different strategies must not be mixed up.
+      skill_ids.push_back(-1 - strategy);
+      fingerprint_ = JewelPlanCache<Key>::Fingerprint(skill_ids);
+      skill_ids.pop_back();
       
       for (int i = 0; i < data.jewels().size(); ++i) {
         const Jewel &jewel = data.jewel(i);
-        Signature key = Signature(jewel, skill_ids, effects, &valid);
+        Key key = Key(jewel, skill_ids, effects, &valid);
         if (valid) {
           jewel_keys_[jewel.holes].push_back(key);
           jewel_ids_[jewel.holes].push_back(i);
@@ -323,34 +702,51 @@ namespace monster_avengers {
       }
     }
 
-    JewelPlan Solve(Signature key, int multiplier) const {
-      Signature target = sig::InverseKey(key);
+    JewelPlan Solve(Key key, int multiplier) const {
+      if (nullptr == plans_) return Plan(key, multiplier);
+      if (const JewelPlan *plan = plans_->Find(fingerprint_, key, 
+                                               multiplier)) {
+        return *plan;
+      }
+      JewelPlan plan = Plan(key, multiplier);
+      plans_->Insert(fingerprint_, key, multiplier, plan);
+      return plan;
+    }
+
+  private:
+    struct SearchCriteria {
+      int holes;
+      int num;
+      int multiplier;
+    };
+
+    JewelPlan Plan(Key key, int multiplier) const {
+      Key target = sig::InverseKey(key);
       int i(0), j(0), k(0);
       sig::KeyHoles(key, &i, &j, &k);
       std::vector<int> ids;
       std::vector<int> body_ids;
       
+      std::vector<SearchCriteria> criterias;
+      criterias.push_back({1, i, 1});
+      criterias.push_back({2, j, 1});
+      criterias.push_back({3, k, 1});
       if (multiplier > 1) {
         int a(0), b(0), c(0);
         key.BodyHoles(&a, &b, &c);
-        std::vector<SearchCriteria> criterias;
-        criterias.push_back({1, i, 1});
-        criterias.push_back({2, j, 1});
-        criterias.push_back({3, k, 1});
         criterias.push_back({1, a, multiplier});
         criterias.push_back({2, b, multiplier});
         criterias.push_back({3, c, multiplier});
+      }
+
+      if (BACKTRACK == strategy_) {
         CHECK(Search(criterias,
-                     5,  // top
+                     criterias.size() - 1,  // top
                      0,  // criteria_id
                      0,  // jewel_id
                      target, &ids, &body_ids));
       } else {
-        CHECK(Search({{1, i, 1}, {2, j, 1}, {3, k, 1}},
-                     2,  // top
-                     0,  // criteria_id
-                     0,  // jewel_id
-                     target, &ids, &body_ids));
+        CHECK(Knapsack(criterias, target, &ids, &body_ids));
       }
       
       JewelPlan result;
@@ -372,17 +768,209 @@ namespace monster_avengers {
       }
       return result;
     }
+    
+    // ----- Knapsack -----
 
-  private:
-    struct SearchCriteria {
-      int holes;
-      int num;
-      int multiplier;
+    static const int INFEASIBLE = -1;
+
+    // A state of Knapsack(): the criteria being filled, the jewel
+    // being considered for it, the jewels still to put in it, and the
+    // points still to reach.
+    struct KnapsackState {
+      int top;
+      int seq;
+      int left;
+      Key residual;
+
+      bool operator==(const KnapsackState &other) const {
+        return top == other.top && seq == other.seq && 
+          left == other.left && residual == other.residual;
+      }
     };
-    
+
+    struct KnapsackStateHash {
+      size_t operator()(const KnapsackState &state) const {
+        uint64_t packed = (static_cast<uint64_t>(state.top) << 40) ^ 
+          (static_cast<uint64_t>(state.seq) << 20) ^ state.left;
+        return static_cast<size_t>(sig::Hash(state.residual) ^ 
+                                   (packed * 0x9e3779b97f4a7c15ULL));
+      }
+    };
+
+    typedef std::array<int, Key::LANES> LaneBound;
+
+    // What one Knapsack() call works on. The jewels are scaled by the
+    // multiplier of their criteria. The highest and lowest points of
+    // one jewel from seq on are in upper/lower[top][seq], and those of
+    // the criterias below top, when filled, are in 
+    // below_upper/lower[top].
+    struct KnapsackContext {
+      const std::vector<SearchCriteria> *targets;
+      std::vector<std::vector<Key> > jewels;
+      std::vector<std::vector<LaneBound> > upper;
+      std::vector<std::vector<LaneBound> > lower;
+      std::vector<LaneBound> below_upper;
+      std::vector<LaneBound> below_lower;
+      std::unordered_map<KnapsackState, int, KnapsackStateHash> memo;
+    };
+
+    void Prepare(const std::vector<SearchCriteria> &targets, 
+                 KnapsackContext *context) const {
+      // Jewels can be left out with KNAPSACK_FEWEST, which is a jewel
+      // of no points.
+      const int floor = KNAPSACK_FEWEST == strategy_ ? 0 : 
+        std::numeric_limits<int>::max();
+      const int size = targets.size();
+      context->targets = &targets;
+      context->jewels.resize(size);
+      context->upper.resize(size);
+      context->lower.resize(size);
+      context->below_upper.assign(size + 1, LaneBound());
+      context->below_lower.assign(size + 1, LaneBound());
+      for (int top = 0; top < size; ++top) {
+        const SearchCriteria &target = targets[top];
+        std::vector<Key> &jewels = context->jewels[top];
+        for (Key jewel_key : jewel_keys_[target.holes]) {
+          if (target.multiplier > 1) jewel_key *= target.multiplier;
+          jewels.push_back(jewel_key);
+        }
+        LaneBound high, low;
+        high.fill(floor == 0 ? 0 : -floor);
+        low.fill(floor);
+        context->upper[top].assign(jewels.size() + 1, high);
+        context->lower[top].assign(jewels.size() + 1, low);
+        for (int seq = static_cast<int>(jewels.size()) - 1; seq >= 0; --seq) {
+          for (int i = sig::EFFECTS_BEGIN; i < Key::LANES; ++i) {
+            context->upper[top][seq][i] = 
+              std::max<int>(context->upper[top][seq + 1][i], 
+                            jewels[seq].lanes[i]);
+            context->lower[top][seq][i] = 
+              std::min<int>(context->lower[top][seq + 1][i], 
+                            jewels[seq].lanes[i]);
+          }
+        }
+        for (int i = sig::EFFECTS_BEGIN; i < Key::LANES; ++i) {
+          // A criteria without jewels fails on its own, so it is not
+          // bounded here.
+          int high_points = jewels.empty() ? 0 : context->upper[top][0][i];
+          int low_points = jewels.empty() ? 0 : context->lower[top][0][i];
+          context->below_upper[top + 1][i] = 
+            context->below_upper[top][i] + target.num * high_points;
+          context->below_lower[top + 1][i] = 
+            context->below_lower[top][i] + target.num * low_points;
+        }
+      }
+    }
+
+    // Whether the jewels left can bring the residual to zero, judged
+    // lane by lane.
+    bool Reachable(const KnapsackContext &context, 
+                   const KnapsackState &state) const {
+      const LaneBound &upper = context.upper[state.top][state.seq];
+      const LaneBound &lower = context.lower[state.top][state.seq];
+      const LaneBound &below_upper = context.below_upper[state.top];
+      const LaneBound &below_lower = context.below_lower[state.top];
+      for (int i = sig::EFFECTS_BEGIN; i < Key::LANES; ++i) {
+        int residual = state.residual.lanes[i];
+        if (residual + state.left * upper[i] + below_upper[i] < 0) {
+          return false;
+        }
+        if (residual + state.left * lower[i] + below_lower[i] > 0) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Makes the same choices as Search(), one at a time: either one
+    // more of the current jewel goes into the current criteria, or the
+    // jewel is skipped for the rest of it. Every state is solved once,
+    // so the work is bounded by criterias x jewels x holes x distinct
+    // residual points, where Search() is exponential in the holes.
+    // Taking the jewel is preferred, which gives the plan Search()
+    // finds.
+    bool Knapsack(const std::vector<SearchCriteria> &targets, Key target,
+                  std::vector<int> *ids, std::vector<int> *body_ids) const {
+      KnapsackContext context;
+      Prepare(targets, &context);
+      KnapsackState state{static_cast<int>(targets.size()) - 1, 0, 
+          targets.back().num, target};
+      int best = Fewest(&context, state);
+      if (INFEASIBLE == best) return false;
+
+      // Replay the choices.
+      while (0 < best) {
+        if (0 == state.left || 
+            state.seq >= context.jewels[state.top].size()) {
+          state.top--;
+          state.seq = 0;
+          state.left = targets[state.top].num;
+          continue;
+        }
+        KnapsackState taken = state;
+        taken.left--;
+        taken.residual = state.residual | 
+          context.jewels[state.top][state.seq];
+        int after = Fewest(&context, taken);
+        if (INFEASIBLE != after && after + 1 == best) {
+          const int &holes = targets[state.top].holes;
+          if (targets[state.top].multiplier > 1) {
+            body_ids->push_back(jewel_ids_[holes][state.seq]);
+          } else {
+            ids->push_back(jewel_ids_[holes][state.seq]);
+          }
+          state = taken;
+          best = after;
+        } else {
+          state.seq++;
+        }
+      }
+      return true;
+    }
+
+    // The fewest jewels that complete state, or INFEASIBLE. Unless the
+    // strategy is KNAPSACK_FEWEST every criteria has to be filled, and
+    // any complete plan will do.
+    int Fewest(KnapsackContext *context, const KnapsackState &state) const {
+      const std::vector<SearchCriteria> &targets = *context->targets;
+      if (0 == state.left || 
+          state.seq >= context->jewels[state.top].size()) {
+        if (0 < state.left && KNAPSACK_FEWEST != strategy_) {
+          return INFEASIBLE;
+        }
+        if (0 == state.top) return state.residual.IsZero() ? 0 : INFEASIBLE;
+        return Fewest(context, {state.top - 1, 0, targets[state.top - 1].num, 
+                state.residual});
+      }
+
+      if (!Reachable(*context, state)) return INFEASIBLE;
+
+      auto it = context->memo.find(state);
+      if (context->memo.end() != it) return it->second;
+
+      int best = INFEASIBLE;
+      KnapsackState taken = state;
+      taken.left--;
+      taken.residual = state.residual | context->jewels[state.top][state.seq];
+      int take = Fewest(context, taken);
+      if (INFEASIBLE != take) best = take + 1;
+      if (INFEASIBLE == best || KNAPSACK_FEWEST == strategy_) {
+        KnapsackState skipped = state;
+        skipped.seq++;
+        int skip = Fewest(context, skipped);
+        if (INFEASIBLE != skip && (INFEASIBLE == best || skip < best)) {
+          best = skip;
+        }
+      }
+      context->memo[state] = best;
+      return best;
+    }
+
+    // ----- Backtracking -----
+
     bool Search(const std::vector<SearchCriteria> &targets,
                 int top, int criteria_id, int jewel_id, 
-                Signature key, 
+                Key key, 
                 std::vector<int> *ids, 
                 std::vector<int> *body_ids) const {
       if (-1 == top) return key.IsZero();
@@ -394,7 +982,7 @@ namespace monster_avengers {
       const int &holes = targets[top].holes;
       const int &multiplier = targets[top].multiplier;
       for (int seq = jewel_id; seq < jewel_ids_[holes].size(); ++seq) {
-        Signature jewel_key = jewel_keys_[holes][seq];
+        Key jewel_key = jewel_keys_[holes][seq];
         if (multiplier > 1) {
           body_ids->push_back(jewel_ids_[holes][seq]);
           jewel_key *= multiplier;
@@ -414,8 +1002,102 @@ namespace monster_avengers {
       return false;
     }
     
-    std::array<std::vector<Signature>, 4> jewel_keys_;
+    std::array<std::vector<Key>, 4> jewel_keys_;
     std::array<std::vector<int>, 4> jewel_ids_;
+    JewelPlanCache<Key> *plans_;
+    uint64_t fingerprint_;
+    Strategy strategy_;
+  };
+
+  typedef BasicJewelSolver<Signature> JewelSolver;
+
+  // JewelPlanCache keeps the plans that BasicJewelSolver::Solve() found
+  // for recent (skills, jewel key, multiplier) triples, in least
+  // recently used order. The skills, which decide the meaning of the
+  // lanes of the key, are given as a fingerprint of their ids.
+  template <typename Key>
+  class JewelPlanCache {
+  public:
+    typedef typename BasicJewelSolver<Key>::JewelPlan JewelPlan;
+
+    static const size_t DEFAULT_CAPACITY = 1 << 16;  // plans
+
+    explicit JewelPlanCache(size_t capacity = DEFAULT_CAPACITY)
+      : capacity_(capacity), entries_(), index_(), hits_(0), misses_(0) {}
+
+    static uint64_t Fingerprint(const std::vector<int> &skill_ids) {
+      uint64_t result = 0x9e3779b97f4a7c15ULL;
+      for (int skill_id : skill_ids) {
+        result = (result ^ static_cast<uint32_t>(skill_id)) * 
+          0xff51afd7ed558ccdULL;
+        result ^= result >> 32;
+      }
+      return result;
+    }
+
+    // The cached plan, or nullptr if there is none.
+    const JewelPlan *Find(uint64_t fingerprint, const Key &key, 
+                          int multiplier) {
+      auto it = index_.find(Id{fingerprint, key, multiplier});
+      if (index_.end() == it) {
+        misses_++;
+        return nullptr;
+      }
+      hits_++;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return &it->second->second;
+    }
+
+    void Insert(uint64_t fingerprint, const Key &key, int multiplier,
+                const JewelPlan &plan) {
+      Id id{fingerprint, key, multiplier};
+      if (index_.end() != index_.find(id)) return;
+      entries_.emplace_front(id, plan);
+      index_[id] = entries_.begin();
+      while (entries_.size() > capacity_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+      }
+    }
+
+    inline size_t size() const {
+      return entries_.size();
+    }
+
+    inline size_t hits() const {
+      return hits_;
+    }
+
+    inline size_t misses() const {
+      return misses_;
+    }
+
+  private:
+    struct Id {
+      uint64_t fingerprint;
+      Key key;
+      int multiplier;
+
+      bool operator==(const Id &other) const {
+        return fingerprint == other.fingerprint && key == other.key &&
+          multiplier == other.multiplier;
+      }
+    };
+
+    struct IdHash {
+      size_t operator()(const Id &id) const {
+        return static_cast<size_t>((sig::Hash(id.key) ^ id.fingerprint) + 
+                                   id.multiplier);
+      }
+    };
+
+    typedef std::pair<Id, JewelPlan> Entry;
+
+    size_t capacity_;
+    std::list<Entry> entries_;
+    std::unordered_map<Id, typename std::list<Entry>::iterator, IdHash> index_;
+    size_t hits_;
+    size_t misses_;
   };
 
 }
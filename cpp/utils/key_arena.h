@@ -0,0 +1,114 @@
+#ifndef _MONSTER_AVENGERS_KEY_ARENA_
+#define _MONSTER_AVENGERS_KEY_ARENA_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace monster_avengers {
+
+  template <typename Key>
+  class BasicKeyArena;
+
+  // A list of jewel keys held by a BasicKeyArena, as the offset and
+  // the length of its run there. Copying it does not copy the keys.
+  // It reads through the arena, so it stays valid while keys are added,
+  // but the pointers from begin() and end() do not.
+  template <typename Key>
+  class BasicKeyList {
+  public:
+    BasicKeyList() : arena_(nullptr), offset_(0), size_(0) {}
+
+    BasicKeyList(const BasicKeyArena<Key> *arena, uint32_t offset,
+                 uint32_t size)
+      : arena_(arena), offset_(offset), size_(size) {}
+
+    inline const Key *begin() const {
+      return 0 == size_ ? nullptr : arena_->data() + offset_;
+    }
+
+    inline const Key *end() const {
+      return begin() + size_;
+    }
+
+    inline int size() const {
+      return size_;
+    }
+
+    inline bool empty() const {
+      return 0 == size_;
+    }
+
+    inline const Key &operator[](int i) const {
+      return arena_->data()[offset_ + i];
+    }
+
+    inline uint32_t offset() const {
+      return offset_;
+    }
+
+  private:
+    const BasicKeyArena<Key> *arena_;
+    uint32_t offset_;
+    uint32_t size_;
+  };
+
+  // The jewel keys of the trees and armor sets of a query, in lists
+  // that are only appended. Stages that do not filter the keys of a
+  // tree pass its list on instead of copying it.
+  template <typename Key>
+  class BasicKeyArena {
+  public:
+    BasicKeyArena() : keys_(), open_(0) {}
+
+    // Starts a list, which has the keys added until Close().
+    inline void Open() {
+      open_ = keys_.size();
+    }
+
+    inline void Add(const Key &key) {
+      keys_.push_back(key);
+    }
+
+    inline BasicKeyList<Key> Close() const {
+      return BasicKeyList<Key>(this, open_, keys_.size() - open_);
+    }
+
+    // A list of copies of keys[0, size).
+    BasicKeyList<Key> Append(const Key *keys, size_t size) {
+      Open();
+      keys_.insert(keys_.end(), keys, keys + size);
+      return Close();
+    }
+
+    // Discards the keys from size on, with the lists that hold them.
+    inline void Truncate(size_t size) {
+      keys_.resize(size);
+      open_ = (std::min)(open_, size);
+    }
+
+    inline void Clear() {
+      Truncate(0);
+    }
+
+    inline const Key *data() const {
+      return keys_.data();
+    }
+
+    inline size_t size() const {
+      return keys_.size();
+    }
+
+    // Bytes held by the arena, free capacity included.
+    inline size_t MemoryBytes() const {
+      return keys_.capacity() * sizeof(Key);
+    }
+
+  private:
+    std::vector<Key> keys_;
+    size_t open_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_KEY_ARENA_
@@ -12,6 +12,7 @@
 #include "data/effect.h"
 #include "jewels_query.h"
 #include "signature.h"
+#include "key_arena.h"
 
 
 namespace monster_avengers {
@@ -24,11 +25,14 @@ namespace monster_avengers {
     SCREEN = 2,
   };
   
-  struct ArmorSet {
+  template <typename Key>
+  struct BasicArmorSet {
     std::array<int, PART_NUM> ids;
-    std::vector<Signature> jewel_keys;
+    BasicKeyList<Key> jewel_keys;
   };
 
+  typedef BasicArmorSet<Signature> ArmorSet;
+
   struct AmuletEffect : public lisp::Formattable {
     LanguageText name;
     int points;
@@ -214,9 +218,10 @@ namespace monster_avengers {
     int defense;
     std::vector<JewelPlan> plans;
 
+    template <typename Key>
     ArmorResult(const DataSet &data, 
-                const JewelSolver &solver, 
-                const ArmorSet &armor_set) 
+                const BasicJewelSolver<Key> &solver, 
+                const BasicArmorSet<Key> &armor_set) 
       : head(data, armor_set.ids[PART_NUM - HEAD - 1]),
         body(data, armor_set.ids[PART_NUM - BODY - 1]),
         hands(data, armor_set.ids[PART_NUM - HANDS - 1]),
@@ -248,7 +253,7 @@ namespace monster_avengers {
       }
 
       // Combine Jewel Effects
-      for (const Signature &jewel_key : armor_set.jewel_keys) {
+      for (const Key &jewel_key : armor_set.jewel_keys) {
         if (plans.size() >= MAX_JEWEL_PLANS) break;
         plans.emplace_back(data, solver.Solve(jewel_key, multiplier), 
                            multiplier,
@@ -327,9 +332,10 @@ namespace monster_avengers {
     JsonTalisman talisman;
     std::vector<std::vector<JsonDecoration> > plans;
     
+    template <typename Key>
     JsonArmorResult(const DataSet &data, 
-                    const JewelSolver &solver, 
-                    const ArmorSet &armor_set) 
+                    const BasicJewelSolver<Key> &solver, 
+                    const BasicArmorSet<Key> &armor_set) 
       : talisman(data, armor_set.ids[AMULET]) {
       weapon_slot = data.armor(armor_set.ids[GEAR]).holes;
       head_id = armor_set.ids[HEAD];
@@ -347,7 +353,7 @@ namespace monster_avengers {
                         });
       
       plans.clear();
-      for (const Signature &jewel_key : armor_set.jewel_keys) {
+      for (const Key &jewel_key : armor_set.jewel_keys) {
         if (plans.size() >= MAX_JEWEL_PLANS) break;
         plans.emplace_back();
         const JewelSolver::JewelPlan jewel_plan = 
@@ -436,9 +442,10 @@ namespace monster_avengers {
 
   class EncodedArmorSet {
   public:
+    template <typename Key>
     EncodedArmorSet(const DataSet &data, 
-                    const JewelSolver &solver, 
-                    const ArmorSet &armor_set) 
+                    const BasicJewelSolver<Key> &solver, 
+                    const BasicArmorSet<Key> &armor_set) 
       : result() {
       for (int i = 0; i < PART_NUM; ++i) {
 	result[i].id = armor_set.ids[PART_NUM - i - 1];
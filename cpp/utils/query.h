@@ -23,6 +23,11 @@ namespace monster_avengers {
       ADD_AMULET,
       MAX_RESULTS,
       BLACKLIST,
+      SKYLINE,
+      PRECOMPUTE,
+      FEWEST_JEWELS,
+      PARALLEL,
+      ORDERED,
     };
 
     static const std::unordered_map<std::wstring, Command> COMMAND_TRANSLATOR;
@@ -36,8 +41,25 @@ namespace monster_avengers {
     int max_results;
     std::vector<Armor> amulets;
     std::unordered_set<int> blacklist;
+    // Only keep the non-dominated jewel combinations while searching.
+    bool skyline;
+    // Number of threads that fill the jewel tables before searching, or
+    // 0 to fill them on demand. The engine runs at most one per
+    // hardware thread.
+    int precompute;
+    // Allow holes to stay empty, and report the plans with the fewest
+    // jewels.
+    bool fewest_jewels;
+    // Number of workers that run the stages after the foundation over
+    // its trees, or 0 to run them on the calling thread. The engine
+    // runs at most one per hardware thread.
+    int parallel;
+    // With parallel, report the results in the same order as without.
+    bool ordered;
 
-    Query() : effects(), defense(0), weapon_type(MELEE) {}
+    Query() : effects(), defense(0), weapon_type(MELEE), skyline(false),
+              precompute(0), fewest_jewels(false), parallel(0), 
+              ordered(false) {}
 
     // Implies conversion from string as well.
     static Status Parse(const std::wstring &query_text, Query *query) {
@@ -49,6 +71,11 @@ namespace monster_avengers {
       query->max_rare = 11; // by default there is no rare limit.
       query->max_results = 10; // by default we are expecting 10 results.
       query->amulets.clear();
+      query->skyline = false; // by default keep every jewel combination.
+      query->precompute = 0; // by default fill the jewel tables on demand.
+      query->fewest_jewels = false; // by default fill every hole.
+      query->parallel = 0; // by default search on the calling thread.
+      query->ordered = false; // by default report results as found.
 
       auto tokenizer = lisp::Tokenizer::FromText(query_text);
       lisp::Token token;
@@ -56,6 +83,7 @@ namespace monster_avengers {
       Status status(SUCCESS);
       int skill_id = 0;
       int skill_points = 0;
+      int flag = 0;
       std::vector<Effect> effects;
       std::vector<int> nums;
       int holes;
@@ -118,6 +146,29 @@ namespace monster_avengers {
             query->blacklist.insert(i);
           }
           break;
+        case SKYLINE:
+          status = ReadInt(&tokenizer, &flag);
+          if (!status.Success()) return status;
+          query->skyline = (0 != flag);
+          break;
+        case PRECOMPUTE:
+          status = ReadInt(&tokenizer, &query->precompute);
+          if (!status.Success()) return status;
+          break;
+        case FEWEST_JEWELS:
+          status = ReadInt(&tokenizer, &flag);
+          if (!status.Success()) return status;
+          query->fewest_jewels = (0 != flag);
+          break;
+        case PARALLEL:
+          status = ReadInt(&tokenizer, &query->parallel);
+          if (!status.Success()) return status;
+          break;
+        case ORDERED:
+          status = ReadInt(&tokenizer, &flag);
+          if (!status.Success()) return status;
+          query->ordered = (0 != flag);
+          break;
         default:
           return Status(FAIL, "Query: Invalid command.");
         }
@@ -250,7 +301,12 @@ namespace monster_avengers {
      {L"max-rare", MAX_RARE},
      {L"max-results", MAX_RESULTS},
      {L"amulet", ADD_AMULET},
-     {L"blacklist", BLACKLIST}};
+     {L"blacklist", BLACKLIST},
+     {L"skyline", SKYLINE},
+     {L"precompute", PRECOMPUTE},
+     {L"fewest-jewels", FEWEST_JEWELS},
+     {L"parallel", PARALLEL},
+     {L"ordered", ORDERED}};
 }
 
 #endif  // _MONSTER_AVENGERS_QUERY_
@@ -1,71 +1,88 @@
 #ifndef _MONSTER_AVENGERS_SIGNATURE_
 #define _MONSTER_AVENGERS_SIGNATURE_
 
+#include <cstdint>
 #include <cstring>
 #include <functional>
+#include <limits>
 #include "data/data_set.h"
 #include "utils/query.h"
+#include "utils/signature_kernels.h"
 
 namespace monster_avengers {
 
-  // Signature is a 16 bytes (128 bit) unsigned integer, internally
-  // represented as a length-16 char array. Where the encoding
-  // follows:
+  // BasicSignature is a fixed size key of Lanes signed integers of type
+  // Lane, which is either int8_t or int16_t. The encoding follows:
   // 
-  // byte 0: number of 1-slots [8]
+  // lane 0: number of 1-slots [8]
   //
-  // byte 1: number of 3-slots [4] | number of 2 slots [4]
+  // lane 1: number of 3-slots [4] | number of 2 slots [4]
   // 
-  // byte 2: sign [1] | number of body 3-slots [1] | number of body 2-slots [1] |
+  // lane 2: sign [1] | number of body 3-slots [1] | number of body 2-slots [1] |
   //         number of body 1-slots [2] | torso multiplier [3]
   // 
-  // byte 3+: number of points for corresponding skill system [8]
+  // lane 3+: number of points for corresponding skill system
   //
-  // Notes: [x] stands for x bits in the byte.
-  struct Signature {
-    static const int EFFECTS_BEGIN = 3;
-    char bytes[16];
-
-    inline Signature() {
-      memset(bytes, 0, sizeof(Signature));
+  // Notes: [x] stands for x bits in the lane.
+  //
+  // A key has room for MAX_EFFECTS skills, and each skill's points
+  // wrap around outside of [-MAX_POINTS - 1, MAX_POINTS]. The caller
+  // picks a layout that is large enough for the query, see
+  // ArmorUp::SelectLayout().
+  //
+  // The arithmetic operators work on the whole key at once, see
+  // utils/signature_kernels.h.
+  template <int Lanes, typename Lane>
+  struct alignas(16) BasicSignature {
+    static const int EFFECTS_BEGIN = kernel::EFFECTS_BEGIN;
+    static const int LANES = Lanes;
+    static const int MAX_EFFECTS = Lanes - EFFECTS_BEGIN;
+    static const int MAX_POINTS = std::numeric_limits<Lane>::max();
+    typedef Lane LaneType;
+
+    Lane lanes[Lanes];
+
+    inline BasicSignature() {
+      memset(lanes, 0, sizeof(lanes));
     }
 
-    inline Signature(const Armor &armor, const std::vector<Effect> &effects) 
-      : Signature() {
+    inline BasicSignature(const Armor &armor, 
+                          const std::vector<Effect> &effects) 
+      : BasicSignature() {
       if (armor.TorsoUp()) {
         // Torso up armors are not allowedto have holes and effects.
-        bytes[2] = 1;
+        lanes[2] = 1;
         return;
       } else if (BODY == armor.part) {
-        bytes[2] = 1;
+        lanes[2] = 1;
       } else {
-        bytes[2] = 0;
+        lanes[2] = 0;
       }
       
       if (1 == armor.holes) {
-        bytes[0] = 1;
+        lanes[0] = 1;
       } else if (2 == armor.holes) {
-        bytes[1] = 1;
+        lanes[1] = 1;
       } else if (3 == armor.holes) {
-        bytes[1] = 16;
+        lanes[1] = 16;
       }
       
-      int byte_id = EFFECTS_BEGIN;
+      int lane_id = EFFECTS_BEGIN;
       for (const Effect& effect : effects) {
         for (const Effect &armor_effect : armor.effects) {
           if (effect.skill_id == armor_effect.skill_id) {
-            bytes[byte_id] = static_cast<char>(armor_effect.points);
+            lanes[lane_id] = static_cast<Lane>(armor_effect.points);
           }
         }
-        byte_id++;
+        lane_id++;
       }
     }
 
-    inline Signature(const Jewel &jewel, 
-              const std::vector<int> &skill_ids,
-              const std::vector<Effect> &effects,
-              bool *valid)
-      : Signature() {
+    inline BasicSignature(const Jewel &jewel, 
+                          const std::vector<int> &skill_ids,
+                          const std::vector<Effect> &effects,
+                          bool *valid)
+      : BasicSignature() {
       *valid = false;
 
       for (int skill_id : skill_ids) {
@@ -81,30 +98,30 @@ namespace monster_avengers {
       if (!(*valid)) return;
 
       if (1 == jewel.holes) {
-        bytes[0] = 1;
+        lanes[0] = 1;
       } else if (2 == jewel.holes) {
-        bytes[1] = 1;
+        lanes[1] = 1;
       } else if (3 == jewel.holes) {
-        bytes[1] = 16;
+        lanes[1] = 16;
       }
 
-      int byte_id = EFFECTS_BEGIN;
+      int lane_id = EFFECTS_BEGIN;
       for (const Effect &effect : effects) {
         for (const Effect &jewel_effect : jewel.effects) {
           if (effect.skill_id == jewel_effect.skill_id) {
-            bytes[byte_id] = static_cast<char>(jewel_effect.points);
+            lanes[lane_id] = static_cast<Lane>(jewel_effect.points);
           }
         }
-        byte_id++;
+        lane_id++;
       }
     }
 
     // ---------- Signature Methods ----------
 
     void ShowMetaInfo() const {
-      int one = bytes[0];
-      int two = bytes[1] & 15;
-      int three = bytes[1] >> 4;
+      int one = lanes[0];
+      int two = lanes[1] & 15;
+      int three = lanes[1] >> 4;
       wprintf(L"(%d %d %d) + %d, %d\n",
               one, two, three, BodyHoleSum(), multiplier());
     }
@@ -112,187 +129,201 @@ namespace monster_avengers {
     inline void BodyRefactor(int multiplier) {
       if (multiplier > 1) {
         // Transfer Holes
-        if (0 != bytes[0]) {
-          bytes[2] |= (0x08 * bytes[0]);
+        if (0 != lanes[0]) {
+          lanes[2] |= (0x08 * lanes[0]);
         } 
         
-        if (0 != (bytes[1] & 0x0F)) {
-          bytes[2] |= 0x20;
+        if (0 != (lanes[1] & 0x0F)) {
+          lanes[2] |= 0x20;
         } 
         
-        if (0 != (bytes[1] & 0xF0)) {
-          bytes[2] |= 0x40;
+        if (0 != (lanes[1] & 0xF0)) {
+          lanes[2] |= 0x40;
         }
 
-        bytes[0] = 0;
-        bytes[1] = 0;
+        lanes[0] = 0;
+        lanes[1] = 0;
         
-        for (int i = EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
-          bytes[i] *= multiplier;
-        }
+        kernel::ScaleEffects(lanes, multiplier);
       }
     }
 
     inline int BodyHoleSum() const {
       int result = 0;
-      if (0 != (bytes[2] & 0x40)) {
+      if (0 != (lanes[2] & 0x40)) {
         return 3;
-      } else if (0 != (bytes[2] & 0x20)) {
+      } else if (0 != (lanes[2] & 0x20)) {
         result = 2;
       }
-      result += (bytes[2] & 0x18) >> 3;
+      result += (lanes[2] & 0x18) >> 3;
       return result;
     }
 
     void BodyHoles(int *i, int *j, int *k) const {
-      *k = (0 != (bytes[2] & 0x40)) ? 1 : 0;
-      *j = (0 != (bytes[2] & 0x20)) ? 1 : 0;
-      *i = (bytes[2] & 0x18) >> 3;
+      *k = (0 != (lanes[2] & 0x40)) ? 1 : 0;
+      *j = (0 != (lanes[2] & 0x20)) ? 1 : 0;
+      *i = (lanes[2] & 0x18) >> 3;
     }
 
 
     int multiplier() const {
-      return static_cast<int>(bytes[2] & 0x07);
+      return static_cast<int>(lanes[2] & 0x07);
     }
 
-    bool IsZero() const {
-      for (int i = 0; i < sizeof(Signature); ++i) {
-        if (bytes[i] != 0) return false;
-      }
-      return true;
+    inline bool IsZero() const {
+      return kernel::IsZero(lanes);
     }
 
     inline int PointsAt(int id) const {
-      return bytes[3 + id];
+      return lanes[3 + id];
     }
 
-    bool operator==(const Signature &other) const {
-      for (int i = 0; i < sizeof(Signature); ++i) {
-        if (bytes[i] != other.bytes[i]) return false;
-      }
-      return true;
+    inline bool operator==(const BasicSignature &other) const {
+      return kernel::Equal(lanes, other.lanes);
     }
 
     inline void operator*=(int multiplier) {
-      for (int i = EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
-        bytes[i] *= multiplier;
-      }
+      kernel::ScaleEffects(lanes, multiplier);
     }
 
-    inline void operator+=(const Signature &other) {
-      for (int i = 0; i < sizeof(Signature); ++i) {
-        bytes[i] += other.bytes[i];
-      }
+    inline void operator+=(const BasicSignature &other) {
+      kernel::Add(lanes, other.lanes, lanes);
     }
   };
 
-  inline Signature operator+(const Signature &a, const Signature &b) {
-    Signature key;
-    for (int i = 0; i < sizeof(Signature); ++i) {
-      key.bytes[i] =  a.bytes[i] + b.bytes[i];
-    }
+  template <int Lanes, typename Lane>
+  const int BasicSignature<Lanes, Lane>::EFFECTS_BEGIN;
+  template <int Lanes, typename Lane>
+  const int BasicSignature<Lanes, Lane>::LANES;
+  template <int Lanes, typename Lane>
+  const int BasicSignature<Lanes, Lane>::MAX_EFFECTS;
+  template <int Lanes, typename Lane>
+  const int BasicSignature<Lanes, Lane>::MAX_POINTS;
+
+  // The 16 bytes key with 8-bit points and up to 13 skills, which is
+  // enough for almost all the queries.
+  typedef BasicSignature<16, int8_t> Signature;
+  // 32 bytes, 8-bit points and up to 29 skills.
+  typedef BasicSignature<32, int8_t> LongSignature;
+  // 32 bytes, 16-bit points and up to 13 skills.
+  typedef BasicSignature<16, int16_t> WideSignature;
+  // 64 bytes, 16-bit points and up to 29 skills.
+  typedef BasicSignature<32, int16_t> LongWideSignature;
+
+  template <int Lanes, typename Lane>
+  inline BasicSignature<Lanes, Lane> operator+(
+      const BasicSignature<Lanes, Lane> &a, 
+      const BasicSignature<Lanes, Lane> &b) {
+    BasicSignature<Lanes, Lane> key;
+    kernel::Add(a.lanes, b.lanes, key.lanes);
     return key;
   }
 
-  inline Signature operator|(const Signature &a, const Signature &b) {
-    Signature key;
-    for (int i = Signature::EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
-      key.bytes[i] = a.bytes[i] + b.bytes[i];
-    }
+  // Only the skill points are added, and the hole lanes of the
+  // result are zero.
+  template <int Lanes, typename Lane>
+  inline BasicSignature<Lanes, Lane> operator|(
+      const BasicSignature<Lanes, Lane> &a, 
+      const BasicSignature<Lanes, Lane> &b) {
+    BasicSignature<Lanes, Lane> key;
+    kernel::AddEffects(a.lanes, b.lanes, key.lanes);
     return key;
   }
 
 
   
   namespace sig {
-    const int EFFECTS_BEGIN = Signature::EFFECTS_BEGIN;
+    const int EFFECTS_BEGIN = kernel::EFFECTS_BEGIN;
 
-    inline Signature InverseKey(std::vector<Effect>::const_iterator begin,
-                                std::vector<Effect>::const_iterator end) {
-      
-      Signature key;
-      char *bytes = reinterpret_cast<char*>(&key);
-      
-      int byte_id = EFFECTS_BEGIN;
+    template <typename Key = Signature>
+    inline Key InverseKey(std::vector<Effect>::const_iterator begin,
+                          std::vector<Effect>::const_iterator end) {
+      Key key;
+      int lane_id = EFFECTS_BEGIN;
       for (auto it = begin; it != end; ++it) {
-        bytes[byte_id++] = -it->points;
+        key.lanes[lane_id++] = -it->points;
       }
       return key;
     }
 
-    inline Signature InverseKey(Signature input_key) {
-      Signature key = input_key;
-      key.bytes[0] = 0;
-      key.bytes[1] = 0;
-      char *bytes = reinterpret_cast<char*>(&key);
-      for (int i = EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
-        bytes[i] = -bytes[i];
+    template <int Lanes, typename Lane>
+    inline BasicSignature<Lanes, Lane> InverseKey(
+        BasicSignature<Lanes, Lane> input_key) {
+      BasicSignature<Lanes, Lane> key = input_key;
+      key.lanes[0] = 0;
+      key.lanes[1] = 0;
+      for (int i = EFFECTS_BEGIN; i < Lanes; ++i) {
+        key.lanes[i] = -key.lanes[i];
       }
       return key;
     }
 
-    inline Signature AddPoints(Signature input_key, 
-                               int effect_id, int points) {
-      Signature key = input_key;
-      char *bytes = reinterpret_cast<char*>(&key);
-      bytes[EFFECTS_BEGIN + effect_id] += points;
+    template <int Lanes, typename Lane>
+    inline BasicSignature<Lanes, Lane> AddPoints(
+        BasicSignature<Lanes, Lane> input_key, int effect_id, int points) {
+      BasicSignature<Lanes, Lane> key = input_key;
+      key.lanes[EFFECTS_BEGIN + effect_id] += points;
       return key;
     }
     
-    inline int GetPoints(Signature key, int effect_id) {
-      char *bytes = reinterpret_cast<char*>(&key);
-      return bytes[EFFECTS_BEGIN + effect_id];
+    template <int Lanes, typename Lane>
+    inline int GetPoints(const BasicSignature<Lanes, Lane> &key, 
+                         int effect_id) {
+      return key.lanes[EFFECTS_BEGIN + effect_id];
     }
 
-    inline std::vector<Effect> KeyEffects(Signature key, 
-                                          const std::vector<Effect> &required) {
-      char *bytes = reinterpret_cast<char*>(&key);
-      int byte_id = EFFECTS_BEGIN;
+    template <int Lanes, typename Lane>
+    inline std::vector<Effect> KeyEffects(
+        const BasicSignature<Lanes, Lane> &key, 
+        const std::vector<Effect> &required) {
+      int lane_id = EFFECTS_BEGIN;
       std::vector<Effect> result;
       result.reserve(required.size());
       for (int i = 0; i < required.size(); ++i) {
         result.emplace_back(required[i].skill_id,
-                            bytes[byte_id++]);
+                            key.lanes[lane_id++]);
       }
       return result;
     }
 
-    inline std::vector<Effect> KeyEffects(Signature input_key, 
-                                          const Query &query) {
+    template <int Lanes, typename Lane>
+    inline std::vector<Effect> KeyEffects(
+        const BasicSignature<Lanes, Lane> &input_key, const Query &query) {
       return KeyEffects(input_key, query.effects);
     }
 
-    inline void KeyHoles(Signature key, 
+    template <int Lanes, typename Lane>
+    inline void KeyHoles(const BasicSignature<Lanes, Lane> &key, 
                          int *one, int *two, int *three) {
-      char *bytes = reinterpret_cast<char*>(&key);
-      *one = bytes[0];
-      *two = bytes[1] & 15;
-      *three = bytes[1] >> 4;
+      *one = key.lanes[0];
+      *two = key.lanes[1] & 15;
+      *three = key.lanes[1] >> 4;
     }
 
-    inline Signature HolesToKey(int one, int two, int three) {
-      Signature key;
-      char *bytes = reinterpret_cast<char*>(&key);
-      bytes[0] = one;
-      bytes[1] = two;
-      bytes[1] |= (three << 4);
+    template <typename Key = Signature>
+    inline Key HolesToKey(int one, int two, int three) {
+      Key key;
+      key.lanes[0] = one;
+      key.lanes[1] = two;
+      key.lanes[1] |= (three << 4);
       return key;
     }
 
-    inline std::vector<int> KeyPointsVec(Signature key, 
-                                         int size) {
-      char *bytes = reinterpret_cast<char*>(&key);
+    template <int Lanes, typename Lane>
+    inline std::vector<int> KeyPointsVec(
+        const BasicSignature<Lanes, Lane> &key, int size) {
       std::vector<int> result;
       result.reserve(size);
-      for (int byte_id = EFFECTS_BEGIN; 
-           byte_id < EFFECTS_BEGIN + size; 
-           ++byte_id) {
-        result.push_back(bytes[byte_id]);
+      for (int lane_id = EFFECTS_BEGIN; 
+           lane_id < EFFECTS_BEGIN + size; 
+           ++lane_id) {
+        result.push_back(key.lanes[lane_id]);
       }
       return result;
     }
 
-    void ExplainSignature(Signature key,
+    template <int Lanes, typename Lane>
+    void ExplainSignature(const BasicSignature<Lanes, Lane> &key,
                           const std::vector<Effect> &required) {
       int i(0), j(0), k(0);
       KeyHoles(key, &i ,&j, &k);
@@ -307,12 +338,65 @@ namespace monster_avengers {
       wprintf(L"}\n");
     }
 
-    inline bool Satisfy(const Signature &test, 
-                        const Signature &inverse_target) {
-      for (int i = EFFECTS_BEGIN; i < sizeof(Signature); ++i) {
-        if (test.bytes[i] + inverse_target.bytes[i] < 0) return false;
+    template <int Lanes, typename Lane>
+    inline bool Satisfy(const BasicSignature<Lanes, Lane> &test, 
+                        const BasicSignature<Lanes, Lane> &inverse_target) {
+      return kernel::Satisfy(test.lanes, inverse_target.lanes);
+    }
+
+    // Whether a has at least as many points as b on every skill. The
+    // hole lanes are not compared.
+    template <int Lanes, typename Lane>
+    inline bool Dominates(const BasicSignature<Lanes, Lane> &a, 
+                          const BasicSignature<Lanes, Lane> &b) {
+      return kernel::Dominates(a.lanes, b.lanes);
+    }
+
+    // Whether a and b use the same holes, including the body holes and
+    // the torso multiplier.
+    template <int Lanes, typename Lane>
+    inline bool SameHoles(const BasicSignature<Lanes, Lane> &a, 
+                          const BasicSignature<Lanes, Lane> &b) {
+      return 0 == memcmp(a.lanes, b.lanes, EFFECTS_BEGIN * sizeof(Lane));
+    }
+
+    // Multiply-xorshift hash over the whole key, one 64-bit word at a
+    // time. Hashing only a prefix is not enough, since the first lanes
+    // (holes and the first skill) take very few distinct values.
+    template <int Lanes, typename Lane>
+    inline uint64_t Hash(const BasicSignature<Lanes, Lane> &key) {
+      const int WORDS = sizeof(key) / sizeof(uint64_t);
+      uint64_t words[WORDS];
+      memcpy(words, key.lanes, sizeof(words));
+      uint64_t hash = words[0] * 0x9E3779B97F4A7C15ULL;
+      for (int i = 1; i < WORDS; ++i) {
+        hash ^= (hash >> 32) ^ words[i];
+        hash *= 0xBF58476D1CE4E5B9ULL;
+        hash ^= (hash >> 29);
       }
-      return true;
+      hash *= 0x94D049BB133111EBULL;
+      return hash ^ (hash >> 32);
+    }
+
+    // Tests Satisfy(base | candidates[i], inverse_target) for all the
+    // candidates in one pass, and sets bit i of survivors for each
+    // candidate that passes. Use kernel::ForEachSurvivor to visit
+    // them.
+    template <int Lanes, typename Lane>
+    inline void SatisfyBatch(
+        const BasicSignature<Lanes, Lane> &base,
+        const std::vector<BasicSignature<Lanes, Lane> > &candidates,
+        const BasicSignature<Lanes, Lane> &inverse_target,
+        std::vector<uint64_t> *survivors) {
+      static_assert(sizeof(BasicSignature<Lanes, Lane>) == 
+                    sizeof(Lane) * Lanes,
+                    "keys should be contiguous lane arrays.");
+      kernel::SatisfyBatch(base.lanes, 
+                           reinterpret_cast<const Lane (*)[Lanes]>(
+                               candidates.data()),
+                           static_cast<int>(candidates.size()),
+                           inverse_target.lanes,
+                           survivors);
     }
 
   }  // namespace sig
@@ -320,22 +404,11 @@ namespace monster_avengers {
 }  // namespace monster_avengers
 
 namespace std {
-  template <>
-  struct hash<monster_avengers::Signature> {
-    uint32_t operator()(const monster_avengers::Signature &input) const {
-      // // Jenkins Hash Function
-      // // The code is a slightly modified version from the wikipedia page.
-      // uint32_t hash = 0;
-      // for (int i = 0; i < sizeof(monster_avengers::Signature); ++i) {
-      //   hash += input.bytes[i];
-      //   hash += (hash << 10);
-      //   hash ^= (hash >> 6);
-      // }
-      // hash += (hash << 3);
-      // hash ^= (hash >> 11);
-      // hash += (hash << 15);
-      // return hash;
-      return *(const uint32_t*)(&input.bytes[0]);
+  template <int Lanes, typename Lane>
+  struct hash<monster_avengers::BasicSignature<Lanes, Lane> > {
+    size_t operator()(
+        const monster_avengers::BasicSignature<Lanes, Lane> &input) const {
+      return static_cast<size_t>(monster_avengers::sig::Hash(input));
     }
   };
 }  // namespace std
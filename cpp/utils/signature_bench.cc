@@ -0,0 +1,194 @@
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "utils/signature.h"
+#include "utils/jewels_query.h"
+#include "supp/helpers.h"
+#include "supp/timer.h"
+
+using namespace monster_avengers;
+
+// Micro benchmark of the Signature kernels. The keys are the armor
+// and jewel signatures of the 6 skills query in core/test.cc, which
+// is what the search loops feed the kernels with.
+//
+// Usage: signature_bench [dataset folder]
+
+const int ROUNDS = 20;
+
+// Folds the whole key into the checksum so that no byte of the
+// result can be optimized away.
+inline int Fold(const Signature &key) {
+  uint64_t words[2];
+  memcpy(words, key.lanes, sizeof(words));
+  uint64_t folded = words[0] ^ words[1];
+  return static_cast<int>(folded ^ (folded >> 32));
+}
+
+template <typename Kernel>
+double Measure(const std::vector<Signature> &left,
+               const std::vector<Signature> &right,
+               Kernel kernel, int *checksum) {
+  Timer timer;
+  timer.Tic();
+  int count = 0;
+  for (int round = 0; round < ROUNDS; ++round) {
+    for (const Signature &a : left) {
+      for (const Signature &b : right) {
+        count ^= kernel(a, b);
+      }
+    }
+  }
+  *checksum = count;
+  return timer.Toc();
+}
+
+template <typename Portable, typename Dispatched>
+void Compare(const wchar_t *name,
+             const std::vector<Signature> &left,
+             const std::vector<Signature> &right,
+             Portable portable, Dispatched dispatched) {
+  int portable_checksum = 0;
+  int dispatched_checksum = 0;
+  double portable_time = Measure(left, right, portable, &portable_checksum);
+  double dispatched_time = Measure(left, right, dispatched,
+                                   &dispatched_checksum);
+  CHECK(portable_checksum == dispatched_checksum);
+  wprintf(L"%-10ls portable %.4lf sec, dispatched %.4lf sec, %.2lfx\n",
+          name, portable_time, dispatched_time,
+          portable_time / dispatched_time);
+}
+
+int main(int argc, char **argv) {
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+  CHECK(2 <= argc);
+  DataSet data(argv[1]);
+
+  Query query;
+  CHECK_SUCCESS(Query::Parse(L"(:weapon-type \"melee\")"
+                             L"(:weapon-holes 2)"
+                             L"(:skill 25 15)"
+                             L"(:skill 1 10)"
+                             L"(:skill 40 15)"
+                             L"(:skill 41 10)"
+                             L"(:skill 36 10)"
+                             L"(:skill 30 10)",
+                             &query));
+
+  std::vector<Signature> armor_keys;
+  for (const Armor &armor : data.armors()) {
+    armor_keys.emplace_back(armor, query.effects);
+  }
+
+  HoleClient hole_client(data, query.effects);
+  std::vector<Signature> jewel_keys;
+  for (const Signature &key : hole_client.Query(3, 1, 1, 0, 1)) {
+    jewel_keys.push_back(key);
+  }
+
+  Signature inverse = sig::InverseKey(query.effects.begin(),
+                                      query.effects.end());
+
+  wprintf(L"%lld armor keys x %lld jewel keys x %d rounds\n",
+          armor_keys.size(), jewel_keys.size(), ROUNDS);
+#ifdef MONSTER_AVENGERS_SSE2
+  wprintf(L"dispatched kernels: sse2\n");
+#else
+  wprintf(L"dispatched kernels: portable\n");
+#endif
+
+  Compare(L"operator+", armor_keys, jewel_keys,
+          [](const Signature &a, const Signature &b) {
+            Signature c;
+            kernel::portable::Add(a.lanes, b.lanes, c.lanes);
+            return Fold(c);
+          },
+          [](const Signature &a, const Signature &b) {
+            return Fold(a + b);
+          });
+
+  Compare(L"operator|", armor_keys, jewel_keys,
+          [](const Signature &a, const Signature &b) {
+            Signature c;
+            kernel::portable::AddEffects(a.lanes, b.lanes, c.lanes);
+            return Fold(c);
+          },
+          [](const Signature &a, const Signature &b) {
+            return Fold(a | b);
+          });
+
+  Compare(L"operator*=", armor_keys, jewel_keys,
+          [](const Signature &a, const Signature &b) {
+            Signature c = a;
+            kernel::portable::ScaleEffects(c.lanes, b.lanes[0] + 2);
+            return Fold(c);
+          },
+          [](const Signature &a, const Signature &b) {
+            Signature c = a;
+            c *= b.lanes[0] + 2;
+            return Fold(c);
+          });
+
+  Compare(L"operator==", armor_keys, jewel_keys,
+          [](const Signature &a, const Signature &b) {
+            return kernel::portable::Equal(a.lanes, b.lanes) ? 1 : 0;
+          },
+          [](const Signature &a, const Signature &b) {
+            return a == b ? 1 : 0;
+          });
+
+  Compare(L"IsZero", armor_keys, jewel_keys,
+          [](const Signature &a, const Signature &b) {
+            Signature c;
+            kernel::portable::AddEffects(a.lanes, b.lanes, c.lanes);
+            return kernel::portable::IsZero(c.lanes) ? 1 : 0;
+          },
+          [](const Signature &a, const Signature &b) {
+            return (a | b).IsZero() ? 1 : 0;
+          });
+
+  Compare(L"Satisfy", armor_keys, jewel_keys,
+          [&inverse](const Signature &a, const Signature &b) {
+            Signature c;
+            kernel::portable::AddEffects(a.lanes, b.lanes, c.lanes);
+            return kernel::portable::Satisfy(c.lanes, inverse.lanes) ? 1 : 0;
+          },
+          [&inverse](const Signature &a, const Signature &b) {
+            return sig::Satisfy(a | b, inverse) ? 1 : 0;
+          });
+
+  // Batched Satisfy against one call per element.
+  {
+    const std::vector<Signature> &jewel_set = hole_client.Query(3, 1, 1, 0, 1);
+    const std::vector<Signature> &jewel_array = 
+      hole_client.Query(3, 1, 1, 0, 1);
+    std::vector<uint64_t> survivors;
+    int per_element_count = 0;
+    int batch_count = 0;
+    Timer timer;
+    timer.Tic();
+    for (int round = 0; round < ROUNDS; ++round) {
+      for (const Signature &a : armor_keys) {
+        for (const Signature &b : jewel_set) {
+          if (sig::Satisfy(a | b, inverse)) per_element_count++;
+        }
+      }
+    }
+    double per_element_time = timer.Toc();
+    timer.Tic();
+    for (int round = 0; round < ROUNDS; ++round) {
+      for (const Signature &a : armor_keys) {
+        sig::SatisfyBatch(a, jewel_array, inverse, &survivors);
+        kernel::ForEachSurvivor(survivors, [&batch_count](int i) {
+            batch_count++;
+          });
+      }
+    }
+    double batch_time = timer.Toc();
+    CHECK(per_element_count == batch_count);
+    wprintf(L"%-10ls per element %.4lf sec, batched %.4lf sec, %.2lfx\n",
+            L"Batch", per_element_time, batch_time,
+            per_element_time / batch_time);
+  }
+
+  return 0;
+}
@@ -0,0 +1,471 @@
+#ifndef _MONSTER_AVENGERS_SIGNATURE_KERNELS_
+#define _MONSTER_AVENGERS_SIGNATURE_KERNELS_
+
+// Whole-key kernels for BasicSignature. A key is an array of Lanes
+// signed integers of type Lane (int8_t or int16_t), and its size is a
+// multiple of 16 bytes. Every kernel has a portable lane-by-lane
+// version, which is also the reference the SIMD version is tested
+// against. When SSE2 is available (always the case on x86-64, and on
+// x86 with /arch:SSE2 under MSVC) the dispatching version handles the
+// key as one 128 bit register per 16 bytes.
+//
+// The batched kernels additionally have an AVX2 version for the 16
+// bytes keys that handles two keys per register. It is selected at
+// runtime on GCC and Clang, and at compile time (/arch:AVX2)
+// elsewhere.
+
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MONSTER_AVENGERS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(MONSTER_AVENGERS_SSE2) && defined(__AVX2__)
+#define MONSTER_AVENGERS_AVX2 1
+#include <immintrin.h>
+#elif defined(MONSTER_AVENGERS_SSE2) && defined(__GNUC__)
+#define MONSTER_AVENGERS_AVX2 1
+#define MONSTER_AVENGERS_AVX2_RUNTIME 1
+#include <immintrin.h>
+#endif
+
+namespace monster_avengers {
+
+  namespace kernel {
+
+    // Lanes before this index encode holes and body
+    // information. Lanes starting from here are skill points.
+    const int EFFECTS_BEGIN = 3;
+
+    namespace portable {
+
+      template <int Lanes, typename Lane>
+      inline void Add(const Lane (&a)[Lanes], const Lane (&b)[Lanes],
+                      Lane (&c)[Lanes]) {
+        for (int i = 0; i < Lanes; ++i) {
+          c[i] = static_cast<Lane>(a[i] + b[i]);
+        }
+      }
+
+      template <int Lanes, typename Lane>
+      inline void AddEffects(const Lane (&a)[Lanes], const Lane (&b)[Lanes],
+                             Lane (&c)[Lanes]) {
+        for (int i = 0; i < EFFECTS_BEGIN; ++i) {
+          c[i] = 0;
+        }
+        for (int i = EFFECTS_BEGIN; i < Lanes; ++i) {
+          c[i] = static_cast<Lane>(a[i] + b[i]);
+        }
+      }
+
+      template <int Lanes, typename Lane>
+      inline void ScaleEffects(Lane (&a)[Lanes], int multiplier) {
+        for (int i = EFFECTS_BEGIN; i < Lanes; ++i) {
+          a[i] = static_cast<Lane>(a[i] * multiplier);
+        }
+      }
+
+      template <int Lanes, typename Lane>
+      inline bool IsZero(const Lane (&a)[Lanes]) {
+        for (int i = 0; i < Lanes; ++i) {
+          if (a[i] != 0) return false;
+        }
+        return true;
+      }
+
+      template <int Lanes, typename Lane>
+      inline bool Equal(const Lane (&a)[Lanes], const Lane (&b)[Lanes]) {
+        for (int i = 0; i < Lanes; ++i) {
+          if (a[i] != b[i]) return false;
+        }
+        return true;
+      }
+
+      template <int Lanes, typename Lane>
+      inline bool Satisfy(const Lane (&test)[Lanes], 
+                          const Lane (&inverse_target)[Lanes]) {
+        for (int i = EFFECTS_BEGIN; i < Lanes; ++i) {
+          if (test[i] + inverse_target[i] < 0) return false;
+        }
+        return true;
+      }
+
+      template <int Lanes, typename Lane>
+      inline bool Dominates(const Lane (&a)[Lanes], const Lane (&b)[Lanes]) {
+        for (int i = EFFECTS_BEGIN; i < Lanes; ++i) {
+          if (a[i] < b[i]) return false;
+        }
+        return true;
+      }
+
+      template <int Lanes, typename Lane>
+      inline void SatisfyBatch(const Lane (&base)[Lanes], 
+                               const Lane (*candidates)[Lanes], int n,
+                               const Lane (&inverse_target)[Lanes],
+                               uint64_t *survivors) {
+        Lane test[Lanes];
+        for (int i = 0; i < n; ++i) {
+          AddEffects(base, candidates[i], test);
+          if (Satisfy(test, inverse_target)) {
+            survivors[i >> 6] |= (1ULL << (i & 63));
+          }
+        }
+      }
+
+    }  // namespace portable
+
+#ifdef MONSTER_AVENGERS_SSE2
+
+    namespace sse2 {
+
+      // The instructions that depend on the lane width.
+      template <typename Lane>
+      struct Ops {};
+
+      template <>
+      struct Ops<int8_t> {
+        static inline __m128i Add(__m128i a, __m128i b) {
+          return _mm_add_epi8(a, b);
+        }
+
+        static inline __m128i AddSaturate(__m128i a, __m128i b) {
+          return _mm_adds_epi8(a, b);
+        }
+
+        static inline __m128i Negative(__m128i a) {
+          return _mm_cmplt_epi8(a, _mm_setzero_si128());
+        }
+
+        static inline __m128i Less(__m128i a, __m128i b) {
+          return _mm_cmplt_epi8(a, b);
+        }
+
+        static inline __m128i Scale(__m128i x, int multiplier) {
+          // SSE2 has no 8-bit multiplication. Multiply the even and
+          // the odd bytes as 16-bit lanes separately, where the low 8
+          // bits of each product are exactly the wrapped 8-bit product.
+          const __m128i m = _mm_set1_epi16(static_cast<short>(multiplier));
+          const __m128i low_byte = _mm_set1_epi16(0x00FF);
+          __m128i even = _mm_and_si128(_mm_mullo_epi16(x, m), low_byte);
+          __m128i odd = _mm_slli_epi16(_mm_mullo_epi16(_mm_srli_epi16(x, 8),
+                                                       m), 8);
+          return _mm_or_si128(even, odd);
+        }
+      };
+
+      template <>
+      struct Ops<int16_t> {
+        static inline __m128i Add(__m128i a, __m128i b) {
+          return _mm_add_epi16(a, b);
+        }
+
+        static inline __m128i AddSaturate(__m128i a, __m128i b) {
+          return _mm_adds_epi16(a, b);
+        }
+
+        static inline __m128i Negative(__m128i a) {
+          return _mm_cmplt_epi16(a, _mm_setzero_si128());
+        }
+
+        static inline __m128i Less(__m128i a, __m128i b) {
+          return _mm_cmplt_epi16(a, b);
+        }
+
+        static inline __m128i Scale(__m128i x, int multiplier) {
+          const __m128i m = _mm_set1_epi16(static_cast<short>(multiplier));
+          return _mm_mullo_epi16(x, m);
+        }
+      };
+
+      // Number of lanes per 128 bit register.
+      template <typename Lane>
+      struct Step {
+        static const int value = static_cast<int>(16 / sizeof(Lane));
+      };
+
+      // movemask bits of the skill points in the first register.
+      template <typename Lane>
+      inline int EffectsMask() {
+        return 0xFFFF & ~((1 << (EFFECTS_BEGIN * sizeof(Lane))) - 1);
+      }
+
+      // All ones for skill points, zero for the header lanes of the
+      // first register.
+      template <typename Lane>
+      inline __m128i EffectsBytes() {
+        return _mm_slli_si128(_mm_set1_epi8(-1), 
+                              EFFECTS_BEGIN * sizeof(Lane));
+      }
+
+      template <typename Lane>
+      inline __m128i Load(const Lane *a) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+      }
+
+      template <typename Lane>
+      inline void Store(Lane *a, __m128i value) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(a), value);
+      }
+
+      template <int Lanes, typename Lane>
+      inline void Add(const Lane (&a)[Lanes], const Lane (&b)[Lanes],
+                      Lane (&c)[Lanes]) {
+        for (int i = 0; i < Lanes; i += Step<Lane>::value) {
+          Store(c + i, Ops<Lane>::Add(Load(a + i), Load(b + i)));
+        }
+      }
+
+      template <int Lanes, typename Lane>
+      inline void AddEffects(const Lane (&a)[Lanes], const Lane (&b)[Lanes],
+                             Lane (&c)[Lanes]) {
+        Store(c, _mm_and_si128(Ops<Lane>::Add(Load(a), Load(b)),
+                               EffectsBytes<Lane>()));
+        for (int i = Step<Lane>::value; i < Lanes; i += Step<Lane>::value) {
+          Store(c + i, Ops<Lane>::Add(Load(a + i), Load(b + i)));
+        }
+      }
+
+      template <int Lanes, typename Lane>
+      inline void ScaleEffects(Lane (&a)[Lanes], int multiplier) {
+        const __m128i x = Load(a);
+        const __m128i effects = EffectsBytes<Lane>();
+        Store(a, _mm_or_si128(_mm_and_si128(effects, 
+                                            Ops<Lane>::Scale(x, multiplier)),
+                              _mm_andnot_si128(effects, x)));
+        for (int i = Step<Lane>::value; i < Lanes; i += Step<Lane>::value) {
+          Store(a + i, Ops<Lane>::Scale(Load(a + i), multiplier));
+        }
+      }
+
+      template <int Lanes, typename Lane>
+      inline bool IsZero(const Lane (&a)[Lanes]) {
+        __m128i folded = Load(a);
+        for (int i = Step<Lane>::value; i < Lanes; i += Step<Lane>::value) {
+          folded = _mm_or_si128(folded, Load(a + i));
+        }
+        return 0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi8(folded,
+                                                          _mm_setzero_si128()));
+      }
+
+      template <int Lanes, typename Lane>
+      inline bool Equal(const Lane (&a)[Lanes], const Lane (&b)[Lanes]) {
+        __m128i equal = _mm_cmpeq_epi8(Load(a), Load(b));
+        for (int i = Step<Lane>::value; i < Lanes; i += Step<Lane>::value) {
+          equal = _mm_and_si128(equal, _mm_cmpeq_epi8(Load(a + i), 
+                                                      Load(b + i)));
+        }
+        return 0xFFFF == _mm_movemask_epi8(equal);
+      }
+
+      // Non-zero iff some skill points of test + inverse_target is
+      // negative. The exact sum of two lanes is at most twice the lane
+      // range. Saturating it keeps its sign, so a signed compare
+      // against zero on the saturated sum is exact.
+      template <int Lanes, typename Lane>
+      inline int NegativeMask(const Lane *test, const Lane *inverse_target) {
+        int negative = _mm_movemask_epi8(Ops<Lane>::Negative(
+            Ops<Lane>::AddSaturate(Load(test), Load(inverse_target)))) &
+          EffectsMask<Lane>();
+        for (int i = Step<Lane>::value; i < Lanes; i += Step<Lane>::value) {
+          negative |= _mm_movemask_epi8(Ops<Lane>::Negative(
+              Ops<Lane>::AddSaturate(Load(test + i), 
+                                     Load(inverse_target + i))));
+        }
+        return negative;
+      }
+
+      template <int Lanes, typename Lane>
+      inline bool Satisfy(const Lane (&test)[Lanes], 
+                          const Lane (&inverse_target)[Lanes]) {
+        return 0 == NegativeMask<Lanes>(test, inverse_target);
+      }
+
+      template <int Lanes, typename Lane>
+      inline bool Dominates(const Lane (&a)[Lanes], const Lane (&b)[Lanes]) {
+        int less = _mm_movemask_epi8(Ops<Lane>::Less(Load(a), Load(b))) &
+          EffectsMask<Lane>();
+        for (int i = Step<Lane>::value; i < Lanes; i += Step<Lane>::value) {
+          less |= _mm_movemask_epi8(Ops<Lane>::Less(Load(a + i), 
+                                                    Load(b + i)));
+        }
+        return 0 == less;
+      }
+
+      template <int Lanes, typename Lane>
+      inline void SatisfyBatch(const Lane (&base)[Lanes], 
+                               const Lane (*candidates)[Lanes], int n,
+                               const Lane (&inverse_target)[Lanes],
+                               uint64_t *survivors) {
+        Lane test[Lanes];
+        for (int i = 0; i < n; ++i) {
+          Add(base, candidates[i], test);
+          if (0 == NegativeMask<Lanes>(test, inverse_target)) {
+            survivors[i >> 6] |= (1ULL << (i & 63));
+          }
+        }
+      }
+
+    }  // namespace sse2
+
+    using sse2::Add;
+    using sse2::AddEffects;
+    using sse2::ScaleEffects;
+    using sse2::IsZero;
+    using sse2::Equal;
+    using sse2::Satisfy;
+    using sse2::Dominates;
+
+#else
+
+    using portable::Add;
+    using portable::AddEffects;
+    using portable::ScaleEffects;
+    using portable::IsZero;
+    using portable::Equal;
+    using portable::Satisfy;
+    using portable::Dominates;
+
+#endif  // MONSTER_AVENGERS_SSE2
+
+#ifdef MONSTER_AVENGERS_AVX2
+
+    namespace avx2 {
+
+#ifdef MONSTER_AVENGERS_AVX2_RUNTIME
+#define MONSTER_AVENGERS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define MONSTER_AVENGERS_TARGET_AVX2
+#endif
+
+      // Two 16 bytes keys per 256 bit register. Both 128 bit lanes
+      // hold a copy of the base key and of the inverse target.
+      MONSTER_AVENGERS_TARGET_AVX2
+      inline void SatisfyBatch(const int8_t (&base)[16], 
+                               const int8_t (*candidates)[16], int n,
+                               const int8_t (&inverse_target)[16],
+                               uint64_t *survivors) {
+        const __m256i base_key = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(base)));
+        const __m256i inverse = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(inverse_target)));
+        const __m256i zero = _mm256_setzero_si256();
+        const uint32_t effects_mask = 
+          static_cast<uint32_t>(sse2::EffectsMask<int8_t>()) | 
+          (static_cast<uint32_t>(sse2::EffectsMask<int8_t>()) << 16);
+        int i = 0;
+        for (; i + 1 < n; i += 2) {
+          __m256i sum = _mm256_add_epi8(
+              base_key,
+              _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                  candidates[i])));
+          sum = _mm256_adds_epi8(sum, inverse);
+          uint32_t negative = static_cast<uint32_t>(
+              _mm256_movemask_epi8(_mm256_cmpgt_epi8(zero, sum))) &
+            effects_mask;
+          if (0 == (negative & 0xFFFF)) {
+            survivors[i >> 6] |= (1ULL << (i & 63));
+          }
+          if (0 == (negative >> 16)) {
+            survivors[(i + 1) >> 6] |= (1ULL << ((i + 1) & 63));
+          }
+        }
+        if (i < n) {
+          int8_t test[16];
+          sse2::Add(base, candidates[i], test);
+          if (0 == sse2::NegativeMask<16>(test, inverse_target)) {
+            survivors[i >> 6] |= (1ULL << (i & 63));
+          }
+        }
+      }
+
+#undef MONSTER_AVENGERS_TARGET_AVX2
+
+      inline bool Supported() {
+#ifdef MONSTER_AVENGERS_AVX2_RUNTIME
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+#else
+        return true;
+#endif
+      }
+
+    }  // namespace avx2
+
+#endif  // MONSTER_AVENGERS_AVX2
+
+    // Selects the batched kernel for a key layout. Only the 16 bytes
+    // keys have an AVX2 version.
+    template <int Lanes, typename Lane>
+    struct BatchKernel {
+      static inline void Run(const Lane (&base)[Lanes], 
+                             const Lane (*candidates)[Lanes], int n,
+                             const Lane (&inverse_target)[Lanes],
+                             uint64_t *survivors) {
+#if defined(MONSTER_AVENGERS_SSE2)
+        sse2::SatisfyBatch(base, candidates, n, inverse_target, survivors);
+#else
+        portable::SatisfyBatch(base, candidates, n, inverse_target, 
+                               survivors);
+#endif
+      }
+    };
+
+#ifdef MONSTER_AVENGERS_AVX2
+    template <>
+    struct BatchKernel<16, int8_t> {
+      static inline void Run(const int8_t (&base)[16], 
+                             const int8_t (*candidates)[16], int n,
+                             const int8_t (&inverse_target)[16],
+                             uint64_t *survivors) {
+        if (avx2::Supported()) {
+          avx2::SatisfyBatch(base, candidates, n, inverse_target, survivors);
+        } else {
+          sse2::SatisfyBatch(base, candidates, n, inverse_target, survivors);
+        }
+      }
+    };
+#endif  // MONSTER_AVENGERS_AVX2
+
+    // Tests Satisfy(base | candidate, inverse_target) for the n
+    // contiguous keys starting at candidates, and sets bit i of
+    // survivors for each candidate i that passes. survivors is
+    // cleared to hold exactly n bits.
+    template <int Lanes, typename Lane>
+    inline void SatisfyBatch(const Lane (&base)[Lanes], 
+                             const Lane (*candidates)[Lanes], int n,
+                             const Lane (&inverse_target)[Lanes],
+                             std::vector<uint64_t> *survivors) {
+      survivors->assign((n + 63) >> 6, 0);
+      if (0 == n) return;
+      BatchKernel<Lanes, Lane>::Run(base, candidates, n, inverse_target,
+                                    survivors->data());
+    }
+
+    // Calls visit(i) for every bit i set in the survivors bitmask, in
+    // increasing order.
+    template <typename Visitor>
+    inline void ForEachSurvivor(const std::vector<uint64_t> &survivors,
+                                Visitor visit) {
+      for (int word_id = 0; word_id < survivors.size(); ++word_id) {
+        uint64_t word = survivors[word_id];
+        while (0 != word) {
+#ifdef __GNUC__
+          int bit = __builtin_ctzll(word);
+#else
+          int bit = 0;
+          while (0 == (word & (1ULL << bit))) ++bit;
+#endif
+          visit((word_id << 6) + bit);
+          word &= word - 1;
+        }
+      }
+    }
+
+  }  // namespace kernel
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_SIGNATURE_KERNELS_
@@ -0,0 +1,217 @@
+#ifndef _MONSTER_AVENGERS_SIGNATURE_TABLE_
+#define _MONSTER_AVENGERS_SIGNATURE_TABLE_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "utils/signature.h"
+
+namespace monster_avengers {
+
+  // BasicSignatureSet is a flat open addressing hash set of keys of
+  // one BasicSignature layout.
+  //
+  // The keys are stored inline in one dense array, in insertion
+  // order, which is also the iteration order. The hash table itself
+  // only holds 32-bit positions into that array, and is probed
+  // linearly with sig::Hash() of the whole key. clear() keeps all the
+  // allocated memory, so that a set can be reused without touching
+  // the allocator.
+  template <typename Key>
+  class BasicSignatureSet {
+  public:
+    typedef typename std::vector<Key>::const_iterator const_iterator;
+
+    BasicSignatureSet() : keys_(), slots_(), mask_(0) {}
+
+    // Returns the position of key in keys(), and inserts it at the
+    // back first if it is not present yet.
+    inline int Insert(const Key &key, bool *inserted) {
+      if ((keys_.size() + 1) * 2 > slots_.size()) {
+        Rehash(slots_.empty() ? 16 : slots_.size() * 2);
+      }
+      size_t slot = static_cast<size_t>(sig::Hash(key)) & mask_;
+      while (0 != slots_[slot]) {
+        int position = slots_[slot] - 1;
+        if (keys_[position] == key) {
+          *inserted = false;
+          return position;
+        }
+        slot = (slot + 1) & mask_;
+      }
+      keys_.push_back(key);
+      slots_[slot] = static_cast<int32_t>(keys_.size());
+      *inserted = true;
+      return static_cast<int>(keys_.size()) - 1;
+    }
+
+    inline bool insert(const Key &key) {
+      bool inserted = false;
+      Insert(key, &inserted);
+      return inserted;
+    }
+
+    // Returns the position of key in keys(), or -1 if absent.
+    inline int Find(const Key &key) const {
+      if (slots_.empty()) return -1;
+      size_t slot = static_cast<size_t>(sig::Hash(key)) & mask_;
+      while (0 != slots_[slot]) {
+        int position = slots_[slot] - 1;
+        if (keys_[position] == key) return position;
+        slot = (slot + 1) & mask_;
+      }
+      return -1;
+    }
+
+    inline size_t count(const Key &key) const {
+      return -1 == Find(key) ? 0 : 1;
+    }
+
+    inline size_t size() const {
+      return keys_.size();
+    }
+
+    inline bool empty() const {
+      return keys_.empty();
+    }
+
+    inline const_iterator begin() const {
+      return keys_.begin();
+    }
+
+    inline const_iterator end() const {
+      return keys_.end();
+    }
+
+    // The keys as a contiguous array, in insertion order.
+    inline const std::vector<Key> &keys() const {
+      return keys_;
+    }
+
+    inline const Key &operator[](int position) const {
+      return keys_[position];
+    }
+
+    void reserve(size_t size) {
+      keys_.reserve(size);
+      size_t slot_count = 16;
+      while (slot_count < size * 2) slot_count <<= 1;
+      if (slot_count > slots_.size()) Rehash(slot_count);
+    }
+
+    // Removes all the keys but keeps the memory.
+    void clear() {
+      keys_.clear();
+      std::fill(slots_.begin(), slots_.end(), 0);
+    }
+
+    // Average number of slots visited to find a key that is present,
+    // where 1.0 means no collision at all.
+    double MeanProbeLength() const {
+      if (keys_.empty()) return 0.0;
+      size_t total = 0;
+      for (size_t slot = 0; slot < slots_.size(); ++slot) {
+        if (0 == slots_[slot]) continue;
+        size_t home = static_cast<size_t>(sig::Hash(keys_[slots_[slot] - 1])) &
+          mask_;
+        total += ((slot - home) & mask_) + 1;
+      }
+      return static_cast<double>(total) / keys_.size();
+    }
+
+    // Bytes held by the set, including the unused capacity.
+    size_t MemoryBytes() const {
+      return keys_.capacity() * sizeof(Key) +
+        slots_.capacity() * sizeof(int32_t);
+    }
+
+  private:
+    void Rehash(size_t slot_count) {
+      slots_.assign(slot_count, 0);
+      mask_ = slot_count - 1;
+      for (size_t position = 0; position < keys_.size(); ++position) {
+        size_t slot = static_cast<size_t>(sig::Hash(keys_[position])) & mask_;
+        while (0 != slots_[slot]) {
+          slot = (slot + 1) & mask_;
+        }
+        slots_[slot] = static_cast<int32_t>(position + 1);
+      }
+    }
+
+    std::vector<Key> keys_;
+    // 0 for an empty slot, otherwise 1 + the position in keys_.
+    std::vector<int32_t> slots_;
+    size_t mask_;
+  };
+
+  typedef BasicSignatureSet<Signature> SignatureSet;
+
+  // SignatureMap is a BasicSignatureSet with a value stored next to each
+  // key. Keys and values are iterated by position, in insertion
+  // order:
+  //
+  //   for (int i = 0; i < map.size(); ++i) {
+  //     Use(map.key(i), map.value(i));
+  //   }
+  template <typename Value, typename Key = Signature>
+  class SignatureMap {
+  public:
+    SignatureMap() : keys_(), values_() {}
+
+    // Returns the value of key, default constructed if key is new.
+    inline Value &operator[](const Key &key) {
+      bool inserted = false;
+      int position = keys_.Insert(key, &inserted);
+      if (inserted) values_.emplace_back();
+      return values_[position];
+    }
+
+    // Returns nullptr if key is absent.
+    inline Value *find(const Key &key) {
+      int position = keys_.Find(key);
+      return -1 == position ? nullptr : &values_[position];
+    }
+
+    inline size_t size() const {
+      return keys_.size();
+    }
+
+    inline bool empty() const {
+      return keys_.empty();
+    }
+
+    inline const Key &key(int position) const {
+      return keys_[position];
+    }
+
+    inline Value &value(int position) {
+      return values_[position];
+    }
+
+    inline const Value &value(int position) const {
+      return values_[position];
+    }
+
+    inline const BasicSignatureSet<Key> &keys() const {
+      return keys_;
+    }
+
+    void reserve(size_t size) {
+      keys_.reserve(size);
+      values_.reserve(size);
+    }
+
+    // Removes all the entries but keeps the memory of the table.
+    void clear() {
+      keys_.clear();
+      values_.clear();
+    }
+
+  private:
+    BasicSignatureSet<Key> keys_;
+    std::vector<Value> values_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_SIGNATURE_TABLE_
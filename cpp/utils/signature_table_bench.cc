@@ -0,0 +1,146 @@
+#include <unordered_set>
+#include "data/data_set.h"
+#include "utils/query.h"
+#include "utils/signature.h"
+#include "utils/signature_table.h"
+#include "utils/jewels_query.h"
+#include "supp/helpers.h"
+#include "supp/timer.h"
+
+using namespace monster_avengers;
+
+// Collision rate and throughput of the Signature hash tables, on the
+// keys that HoleClient and MergeForests produce for the 6 skills query
+// in core/test.cc.
+//
+// Usage: signature_table_bench [dataset folder]
+
+const int ROUNDS = 3;
+
+// The hash std::hash<Signature> used to have: the first 4 bytes.
+struct PrefixHash {
+  size_t operator()(const Signature &input) const {
+    uint32_t prefix;
+    memcpy(&prefix, input.lanes, sizeof(prefix));
+    return prefix;
+  }
+};
+
+template <typename Hash>
+void MeasureUnorderedSet(const wchar_t *name, 
+                         const std::vector<Signature> &keys) {
+  typedef std::unordered_set<Signature, Hash> Set;
+  Set set;
+  Timer timer;
+  timer.Tic();
+  for (int round = 0; round < ROUNDS; ++round) {
+    set.clear();
+    for (const Signature &key : keys) set.insert(key);
+  }
+  double insert_time = timer.Toc();
+
+  timer.Tic();
+  size_t found = 0;
+  for (int round = 0; round < ROUNDS; ++round) {
+    for (const Signature &key : keys) found += set.count(key);
+  }
+  double lookup_time = timer.Toc();
+  CHECK(found == ROUNDS * keys.size());
+
+  // A key collides if it shares its bucket with another key.
+  size_t colliding = 0;
+  size_t longest = 0;
+  for (size_t bucket = 0; bucket < set.bucket_count(); ++bucket) {
+    size_t size = set.bucket_size(bucket);
+    if (size > 1) colliding += size;
+    if (size > longest) longest = size;
+  }
+  wprintf(L"%-22ls insert %.4lf sec, lookup %.4lf sec, "
+          L"colliding keys %.2lf%%, longest bucket %lld\n",
+          name, insert_time, lookup_time,
+          100.0 * colliding / set.size(), longest);
+}
+
+void MeasureSignatureSet(const std::vector<Signature> &keys) {
+  SignatureSet set;
+  Timer timer;
+  timer.Tic();
+  for (int round = 0; round < ROUNDS; ++round) {
+    set.clear();
+    for (const Signature &key : keys) set.insert(key);
+  }
+  double insert_time = timer.Toc();
+
+  timer.Tic();
+  size_t found = 0;
+  for (int round = 0; round < ROUNDS; ++round) {
+    for (const Signature &key : keys) found += set.count(key);
+  }
+  double lookup_time = timer.Toc();
+  CHECK(found == ROUNDS * keys.size());
+
+  wprintf(L"%-22ls insert %.4lf sec, lookup %.4lf sec, "
+          L"mean probe length %.3lf\n",
+          L"SignatureSet", insert_time, lookup_time, 
+          set.MeanProbeLength());
+}
+
+void Measure(const wchar_t *corpus, const std::vector<Signature> &keys) {
+  SignatureSet distinct;
+  for (const Signature &key : keys) distinct.insert(key);
+  wprintf(L"---------- %ls: %lld keys, %lld distinct ----------\n",
+          corpus, keys.size(), distinct.size());
+  MeasureUnorderedSet<PrefixHash>(L"unordered_set (prefix)", keys);
+  MeasureUnorderedSet<std::hash<Signature> >(L"unordered_set (full)", keys);
+  MeasureSignatureSet(keys);
+}
+
+int main(int argc, char **argv) {
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+  CHECK(2 <= argc);
+  DataSet data(argv[1]);
+
+  Query query;
+  CHECK_SUCCESS(Query::Parse(L"(:weapon-type \"melee\")"
+                             L"(:weapon-holes 2)"
+                             L"(:skill 25 15)"
+                             L"(:skill 1 10)"
+                             L"(:skill 40 15)"
+                             L"(:skill 41 10)"
+                             L"(:skill 36 10)"
+                             L"(:skill 30 10)",
+                             &query));
+
+  // Jewel combinations, as stored in the HoleClient tables.
+  {
+    HoleClient hole_client(data, query.effects);
+    std::vector<Signature> keys;
+    for (int k = 0; k <= 2; ++k) {
+      for (int j = 0; j <= 3; ++j) {
+        for (int i = 0; i <= 4; ++i) {
+          const std::vector<Signature> &answer = 
+            hole_client.Query(i, j, k, 0, 1);
+          keys.insert(keys.end(), answer.begin(), answer.end());
+        }
+      }
+    }
+    Measure(L"HoleClient", keys);
+  }
+
+  // Sums of two parts, as grouped in MergeForests on the two
+  // foundation skills.
+  {
+    std::vector<Effect> foundation(query.effects.begin(), 
+                                   query.effects.begin() + 2);
+    std::vector<Signature> keys;
+    for (int head : data.ArmorIds(HEAD)) {
+      Signature head_key(data.armor(head), foundation);
+      for (int hands : data.ArmorIds(HANDS)) {
+        keys.push_back(head_key + Signature(data.armor(hands), foundation));
+      }
+    }
+    Measure(L"MergeForests", keys);
+  }
+
+  return 0;
+}
@@ -1,8 +1,127 @@
+#include <random>
 #include "utils/signature.h"
 #include "supp/helpers.h"
 
 using namespace monster_avengers;
 
+template <typename Key>
+Key RandomKey(std::mt19937 *generator, 
+              int low = std::numeric_limits<typename Key::LaneType>::min(), 
+              int high = std::numeric_limits<typename Key::LaneType>::max()) {
+  std::uniform_int_distribution<int> distribution(low, high);
+  Key key;
+  for (int i = 0; i < Key::LANES; ++i) {
+    key.lanes[i] = static_cast<typename Key::LaneType>(
+        distribution(*generator));
+  }
+  return key;
+}
+
+template <typename Key>
+bool SameLanes(const typename Key::LaneType *a, 
+               const typename Key::LaneType *b) {
+  return 0 == memcmp(a, b, sizeof(Key));
+}
+
+// The dispatched kernels agree with the portable ones.
+template <typename Key>
+void KernelTest(std::mt19937 *generator) {
+  typedef typename Key::LaneType Lane;
+  for (int round = 0; round < 100000; ++round) {
+    Key a = RandomKey<Key>(generator);
+    Key b = RandomKey<Key>(generator);
+    Lane expected[Key::LANES];
+
+    kernel::portable::Add(a.lanes, b.lanes, expected);
+    CHECK(SameLanes<Key>(expected, (a + b).lanes));
+    Key c = a;
+    c += b;
+    CHECK(SameLanes<Key>(expected, c.lanes));
+
+    kernel::portable::AddEffects(a.lanes, b.lanes, expected);
+    CHECK(SameLanes<Key>(expected, (a | b).lanes));
+
+    int multiplier = round % 6;
+    memcpy(expected, a.lanes, sizeof(Key));
+    kernel::portable::ScaleEffects(expected, multiplier);
+    c = a;
+    c *= multiplier;
+    CHECK(SameLanes<Key>(expected, c.lanes));
+
+    CHECK(kernel::portable::Satisfy(a.lanes, b.lanes) == 
+          sig::Satisfy(a, b));
+    CHECK(kernel::portable::Equal(a.lanes, b.lanes) == (a == b));
+    CHECK(a == a);
+    CHECK(kernel::portable::IsZero(a.lanes) == a.IsZero());
+    CHECK(kernel::portable::Dominates(a.lanes, b.lanes) == 
+          sig::Dominates(a, b));
+    CHECK(sig::Dominates(a, a));
+  }
+  CHECK(Key().IsZero());
+  CHECK(sig::Satisfy(Key(), Key()));
+}
+
+// The batched kernel agrees with Satisfy, including the odd tail that
+// does not fill a whole AVX2 register.
+template <typename Key>
+void BatchTest(std::mt19937 *generator) {
+  int passed = 0;
+  for (int n = 0; n < 150; ++n) {
+    Key base = RandomKey<Key>(generator, -2, 12);
+    Key inverse;
+    std::uniform_int_distribution<int> target(-6, 0);
+    for (int i = Key::EFFECTS_BEGIN; i < Key::LANES; ++i) {
+      inverse.lanes[i] = static_cast<typename Key::LaneType>(
+          target(*generator));
+    }
+    std::vector<Key> candidates;
+    for (int i = 0; i < n; ++i) {
+      candidates.push_back(RandomKey<Key>(generator, -2, 12));
+    }
+    std::vector<uint64_t> survivors;
+    sig::SatisfyBatch(base, candidates, inverse, &survivors);
+    CHECK(survivors.size() == (n + 63) / 64);
+    std::vector<int> expected;
+    for (int i = 0; i < n; ++i) {
+      if (sig::Satisfy(base | candidates[i], inverse)) expected.push_back(i);
+    }
+    std::vector<int> visited;
+    kernel::ForEachSurvivor(survivors, [&visited](int i) {
+        visited.push_back(i);
+      });
+    CHECK(expected == visited);
+    passed += expected.size();
+  }
+  CHECK(0 < passed);
+}
+
+// Points that wrap around in 8-bit lanes are exact in 16-bit lanes.
+template <typename Key>
+void LayoutTest() {
+  std::vector<Effect> effects;
+  for (int i = 0; i < Key::MAX_EFFECTS; ++i) {
+    effects.emplace_back(i + 1, 10);
+  }
+  Key inverse = sig::InverseKey<Key>(effects.begin(), effects.end());
+  Key key = sig::HolesToKey<Key>(1, 2, 3);
+  key = sig::AddPoints(key, Key::MAX_EFFECTS - 1, 
+                       (std::min)(Key::MAX_POINTS, 200));
+  CHECK(sig::GetPoints(key, Key::MAX_EFFECTS - 1) == 
+        (std::min)(Key::MAX_POINTS, 200));
+  int one(0), two(0), three(0);
+  sig::KeyHoles(key, &one, &two, &three);
+  CHECK(1 == one && 2 == two && 3 == three);
+  CHECK(!sig::Satisfy(key, inverse));
+  for (int i = 0; i < Key::MAX_EFFECTS - 1; ++i) {
+    key = sig::AddPoints(key, i, 10);
+  }
+  CHECK(sig::Satisfy(key, inverse));
+  Key body = sig::AddPoints(Key(), 0, 30);
+  body.BodyRefactor(5);
+  CHECK(sig::GetPoints(body, 0) == 
+        (Key::MAX_POINTS > 127 ? 150 : static_cast<int8_t>(150)));
+}
+
 int main() {
   // InverseKeyTest
   Signature key_a = sig::HolesToKey(4, 1, 0);
@@ -26,6 +145,22 @@ int main() {
                         {{46, 10}, {43, 10}, {91, 15}});
 
   CHECK(!sig::Satisfy(key_a | key_b, inverse_key));
+
+  std::mt19937 generator(7);
+  KernelTest<Signature>(&generator);
+  KernelTest<LongSignature>(&generator);
+  KernelTest<WideSignature>(&generator);
+  KernelTest<LongWideSignature>(&generator);
+
+  BatchTest<Signature>(&generator);
+  BatchTest<LongSignature>(&generator);
+  BatchTest<WideSignature>(&generator);
+  BatchTest<LongWideSignature>(&generator);
+
+  LayoutTest<Signature>();
+  LayoutTest<LongSignature>();
+  LayoutTest<WideSignature>();
+  LayoutTest<LongWideSignature>();
   
   return 0;
 }
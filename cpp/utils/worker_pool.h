@@ -0,0 +1,91 @@
+#ifndef _MONSTER_AVENGERS_WORKER_POOL_
+#define _MONSTER_AVENGERS_WORKER_POOL_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace monster_avengers {
+
+  // Threads that run work(worker) for the workers of each Run(), the
+  // worker 0 being the calling thread. They are started by the first
+  // Run() that needs them and wait for the next one until the pool is
+  // destroyed, so a sequence of short parallel loops does not start
+  // and join threads for each loop.
+  class WorkerPool {
+  public:
+    typedef std::function<void(int)> Work;
+
+    WorkerPool() : mutex_(), start_(), finish_(), work_(nullptr),
+                   workers_(0), round_(0), running_(0), stop_(false),
+                   threads_() {}
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    ~WorkerPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      start_.notify_all();
+      for (std::thread &thread : threads_) thread.join();
+    }
+
+    // Returns once work(worker) has returned for every worker in [0,
+    // workers).
+    void Run(int workers, const Work &work) {
+      while (threads_.size() + 1 < workers) {
+        threads_.emplace_back(&WorkerPool::Loop, this, threads_.size() + 1);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        work_ = &work;
+        workers_ = workers;
+        running_ = workers - 1;
+        round_++;
+      }
+      if (1 < workers) start_.notify_all();
+      work(0);
+      std::unique_lock<std::mutex> lock(mutex_);
+      finish_.wait(lock, [this]() { return 0 == running_; });
+      work_ = nullptr;
+    }
+
+  private:
+    void Loop(int worker) {
+      size_t round = 0;
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (true) {
+        start_.wait(lock, [this, round]() {
+            return stop_ || round_ != round;
+          });
+        if (stop_) return;
+        round = round_;
+        if (worker >= workers_) continue;
+        const Work &work = *work_;
+        lock.unlock();
+        work(worker);
+        lock.lock();
+        if (0 == --running_) finish_.notify_one();
+      }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable finish_;
+    const Work *work_;
+    int workers_;
+    // Incremented by each Run(), which tells the threads to start.
+    size_t round_;
+    // Workers of the current Run() that have not returned yet.
+    int running_;
+    bool stop_;
+    std::vector<std::thread> threads_;
+  };
+
+}  // namespace monster_avengers
+
+#endif  // _MONSTER_AVENGERS_WORKER_POOL_